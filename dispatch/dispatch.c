@@ -72,4 +72,16 @@ syscall_t systab[SYSCALL_MAX] = {
 	[SYS_MMAP]          = sys_mmap,
 	[SYS_MUNMAP]        = sys_munmap,
 	[SYS_PIPE]          = sys_pipe,
+	[SYS_RING_SETUP]    = sys_ring_setup,
+	[SYS_RING_ENTER]    = sys_ring_enter,
+	[SYS_SYNC]          = sys_sync,
+	[SYS_FSYNC]         = sys_fsync,
+	[SYS_FDATASYNC]     = sys_fdatasync,
+	[SYS_BDFLUSH]       = sys_bdflush,
+	[SYS_GETDENTS]      = sys_getdents,
+	[SYS_SENDFILE]      = sys_sendfile,
+	[SYS_READV]         = sys_readv,
+	[SYS_WRITEV]        = sys_writev,
+	[SYS_PREADV]        = sys_preadv,
+	[SYS_PWRITEV]       = sys_pwritev,
 };
@@ -16,12 +16,14 @@
  */
 
 #include <kernel/i386.h>
+#include <kernel/bitmap.h>
 #include <kernel/elf.h>
 #include <kernel/dispatch.h>
 #include <kernel/time.h>
 #include <kernel/mmap.h>
 #include <kernel/list.h>
 #include <kernel/fs.h>
+#include <kernel/hashtable.h>
 #include <kernel/signal.h>
 #include <kernel/mm/kmalloc.h>
 #include <kernel/mm/paging.h>
@@ -33,7 +35,14 @@
 #include <telos/syscall.h>
 #include <telos/wait.h>
 
-struct pcb proctab[PT_SIZE];
+/*
+ * Process control blocks are allocated dynamically and looked up by PID in a
+ * hash table.  PIDs are handed out from a bitmap, starting after the most
+ * recently allocated PID so that they are not immediately reused.
+ */
+static DEFINE_HASHTABLE(pid_hash, 10);
+static unsigned long pid_map[PID_MAX / BITS_PER_LONG];
+static pid_t last_pid = 1;
 
 struct proc_status {
 	struct list_head chain;
@@ -75,11 +84,34 @@ void report_status(struct pcb *p, int how, int val)
 
 SYSINIT(proctab, SUB_PROCESS)
 {
-	for (int i = 0; i < PT_SIZE; i++) {
-		proctab[i].pid   = i - PT_SIZE;
-		proctab[i].state = PROC_DEAD;
+	bitmap_set(pid_map, 0); // 0 is a reserved pid
+	bitmap_set(pid_map, 1); // init
+}
+
+static pid_t alloc_pid(void)
+{
+	long pid;
+	const unsigned int words = PID_MAX / BITS_PER_LONG;
+
+	// search after the last PID first, then wrap around
+	if ((pid = bitmap_ffz_from(pid_map, words, last_pid + 1)) < 0)
+		pid = bitmap_ffz(pid_map, words);
+	if (pid < 0)
+		return -EAGAIN;
+	bitmap_set(pid_map, pid);
+	last_pid = pid;
+	return pid;
+}
+
+struct pcb *get_pcb(pid_t pid)
+{
+	struct pcb *p;
+
+	hash_for_each_possible(pid_hash, p, pid_chain, pid) {
+		if (p->pid == pid && p->state != PROC_DEAD)
+			return p;
 	}
-	proctab[0].pid = 0; // 0 is a reserved pid
+	return NULL;
 }
 
 static struct pcb *pcb_common_init(struct pcb *p)
@@ -91,15 +123,47 @@ static struct pcb *pcb_common_init(struct pcb *p)
 	INIT_LIST_HEAD(&p->children);
 	INIT_LIST_HEAD(&p->child_stats);
 	INIT_LIST_HEAD(&p->posix_timers);
+	p->ring = NULL;
+	p->ring_entries = 0;
 	return p;
 }
 
+static struct pcb *alloc_pcb(pid_t pid)
+{
+	struct pcb *p;
+
+	if (!(p = kmalloc(sizeof(*p))))
+		return NULL;
+	memset(p, 0, sizeof(*p));
+	p->pid = pid;
+	hash_add(pid_hash, &p->pid_chain, pid);
+	return pcb_common_init(p);
+}
+
 static struct pcb *get_free_pcb(void)
 {
-	for (int i = 0; i < PT_SIZE; i++)
-		if (proctab[i].state == PROC_DEAD)
-			return pcb_common_init(&proctab[i]);
-	return NULL;
+	struct pcb *p;
+	pid_t pid;
+
+	if ((pid = alloc_pid()) < 0)
+		return NULL;
+	if (!(p = alloc_pcb(pid))) {
+		bitmap_clear(pid_map, pid);
+		return NULL;
+	}
+	return p;
+}
+
+/*
+ * Release a process control block and its PID.  Called once the process has
+ * been reaped (or failed to start).
+ */
+void free_pcb(struct pcb *p)
+{
+	p->state = PROC_DEAD;
+	hash_del(&p->pid_chain);
+	bitmap_clear(pid_map, p->pid);
+	kfree(p);
 }
 
 static struct pcb *pcb_clone(struct pcb *src)
@@ -118,13 +182,16 @@ static struct pcb *pcb_clone(struct pcb *src)
 		if ((p->filp[i] = src->filp[i]))
 			p->filp[i]->f_count++;
 
-	p->pid += PT_SIZE;
 	p->parent_pid = src->pid;
 	p->flags = src->flags;
 
 	p->root = src->root;
 	p->pwd = src->pwd;
 
+	/* the ring mapping is copied along with the address space */
+	p->ring = src->ring;
+	p->ring_entries = src->ring_entries;
+
 	list_add_tail(&p->child_chain, &src->children);
 	return p;
 }
@@ -176,21 +243,18 @@ int create_kernel_process(void(*func)(void*), void *arg, ulong flags)
 	sig_init(&p->sig);
 	for (int i = 0; i < NR_FILES; i++)
 		p->filp[i] = NULL;
-	p->pid += PT_SIZE;
 	p->parent_pid = 1;
 	p->flags = flags | PFLAG_SUPER;
 	p->root = root_inode;
 	p->pwd = root_inode;
 
 	if ((error = mm_init(&p->mm)) < 0)
-		return error;;
-	if ((error = address_space_init(&p->mm)) < 0) {
-		mm_fini(&p->mm);
-		return error;
-	}
+		goto err_pcb;
+	if ((error = address_space_init(&p->mm)) < 0)
+		goto err_mm;
 	if (!vma_map(&p->mm, krostart, kroend - krostart, RODATA_FLAGS)) {
-		mm_fini(&p->mm);
-		return -ENOMEM;
+		error = -ENOMEM;
+		goto err_mm;
 	}
 
 	p->esp = ((char*)KSTACK_END - KFRAME_ROOM);
@@ -202,6 +266,11 @@ int create_kernel_process(void(*func)(void*), void *arg, ulong flags)
 
 	ready(p);
 	return p->pid;
+err_mm:
+	mm_fini(&p->mm);
+err_pcb:
+	free_pcb(p);
+	return error;
 }
 
 /*
@@ -235,11 +304,11 @@ void create_init(void)
 	long esp;
 	struct pcb *p;
 
-	p = pcb_common_init(&proctab[1]);
+	if (!(p = alloc_pcb(1)))
+		panic("failed to allocate init process");
 	sig_init(&p->sig);
 	for (int i = 0; i < NR_FILES; i++)
 		p->filp[i] = NULL;
-	p->pid = 1;
 	p->parent_pid = 1;
 	p->flags = 0;
 	p->root = root_inode;
@@ -507,13 +576,15 @@ long sys_execve(struct exec_args *args)
 	current->ifp = (char*) KSTACK_END - 16;
 	current->esp = (char*) current->ifp - sizeof(struct ucontext);
 
-	esp = STACK_END - 16;
+	esp = STACK_END - 32;
 	put_iret_uframe(current->esp, (uintptr_t)entry, esp);
 
 	main_args = (unsigned long*) esp;
 	main_args[0] = args->argc;
 	main_args[1] = (unsigned long) argv;
 	main_args[2] = (unsigned long) envp;
+	main_args[3] = (unsigned long) &vclock;
+	main_args[4] = (unsigned long) vsyscall;
 
 	return 0;
 }
@@ -529,8 +600,14 @@ long sys_fork(void)
 	if (!(p = pcb_clone(current)))
 		return -EAGAIN;
 
-	if ((rc = mm_clone(&p->mm, &current->mm)) < 0)
+	if ((rc = mm_clone(&p->mm, &current->mm)) < 0) {
+		list_del(&p->child_chain);
+		for (int i = 0; i < NR_FILES; i++)
+			if (p->filp[i])
+				file_unref(p->filp[i]);
+		free_pcb(p);
 		return rc;
+	}
 
 	ready(p);
 	return p->pid;
@@ -545,25 +622,30 @@ long sys_yield(void)
 
 void do_exit(struct pcb *p, int status)
 {
-	struct pcb *pit;
+	struct pcb *init, *pit, *tmp;
 	struct proc_status *sit, *n;
 
 	report_status(p, _WEXITED, status);
 
+	// the pcb is freed when reaped; don't leave its timers in the wheel
+	ktimer_remove(&p->t_alarm);
+	ktimer_remove(&p->t_sleep);
+
 	for (int i = 0; i < NR_FILES; i++)
 		if (current->filp[i] != NULL)
 			sys_close(i);
 
+	if (!(init = get_pcb(1)) || init == p)
+		panic("No init process");
 	// re-parent orphans to init
-	list_for_each_entry(pit, &p->children, child_chain) {
+	list_for_each_entry_safe(pit, tmp, &p->children, child_chain) {
 		pit->parent_pid = 1;
+		list_move_tail(&pit->child_chain, &init->children);
 	}
 	// give status events to new parent
-	if (!(pit = get_pcb(1)))
-		panic("No init process");
 	list_for_each_entry_safe(sit, n, &p->child_stats, chain) {
 		list_del(&sit->chain);
-		assert_status(pit, sit);
+		assert_status(init, sit);
 	}
 
 	mm_fini(&p->mm);
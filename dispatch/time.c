@@ -20,6 +20,7 @@
 #include <kernel/time.h>
 #include <kernel/timer.h>
 #include <kernel/signal.h>
+#include <kernel/mmap.h>
 #include <kernel/mm/paging.h>
 #include <kernel/mm/slab.h>
 #include <kernel/mm/vma.h>
@@ -54,6 +55,64 @@ DEFINE_HASHTABLE(posix_timers, 9);
 unsigned long tick_count = 0; /* global tick count */
 unsigned long system_clock;   /* seconds since the Epoch */
 
+/*
+ * User-readable clock page; see <telos/vclock.h>.  The page lies in the user
+ * read-only range, so the kernel writes it through a second, writable mapping.
+ */
+struct __vclock vclock __user_data __attribute__((aligned(FRAME_SIZE)));
+static struct __vclock *vclock_rw;
+
+static unsigned long long last_tsc;
+static bool have_tsc;
+
+static void vclock_update(bool tick);
+
+SYSINIT(vclock, SUB_DRIVER)
+{
+	unsigned long eax, ebx, ecx, edx;
+
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	have_tsc = edx & CPUID_EDX_TSC;
+	if (have_tsc)
+		last_tsc = rdtsc();
+	vclock_rw = kmap_phys(kernel_to_phys(&vclock));
+	vclock_update(false);
+}
+
+/*
+ * Calibrate the TSC against the PIT.  The number of TSC cycles per tick is a
+ * running average over the interval between timer interrupts.
+ */
+static void vclock_calibrate(void)
+{
+	unsigned long long now = rdtsc();
+	unsigned long delta = now - last_tsc;
+	unsigned long avg = vclock_rw->tsc_per_tick;
+
+	last_tsc = now;
+	vclock_rw->tsc_per_tick = avg ? avg - avg / 8 + delta / 8 : delta;
+	vclock_rw->tsc_base = now;
+}
+
+/*
+ * Publish the current time in the vclock page.  @tick is true when called from
+ * the timer interrupt.  Must be called with interrupts disabled.
+ */
+static void vclock_update(bool tick)
+{
+	if (!vclock_rw)
+		return;
+	vclock_rw->seq++;
+	barrier();
+	if (tick && have_tsc)
+		vclock_calibrate();
+	vclock_rw->ticks = tick_count;
+	vclock_rw->realtime_sec = system_clock;
+	vclock_rw->realtime_nsec = (tick_count % __TICKS_PER_SEC) * __NSEC_PER_TICK;
+	barrier();
+	vclock_rw->seq++;
+}
+
 static DEFINE_SLAB_CACHE(posix_timers_cachep, sizeof(struct posix_timer));
 #define get_posix_timer() slab_alloc(posix_timers_cachep)
 #define free_posix_timer(p) slab_free(posix_timers_cachep, p)
@@ -115,6 +174,7 @@ int posix_rtc_get(struct timespec *tp)
 int posix_rtc_set(struct timespec *tp)
 {
 	system_clock = tp->tv_sec;
+	vclock_update(false);
 	return 0;
 }
 
@@ -308,6 +368,7 @@ void tick(void)
 	if ((++tick_count % __TICKS_PER_SEC) == 0)
 		system_clock++;
 
+	vclock_update(true);
 	ktimers_tick();
 
 	/* choose new process to run */
@@ -0,0 +1,551 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <kernel/cmdline.h>
+#include <kernel/i386.h>
+#include <kernel/mmap.h>
+#include <kernel/time.h>
+#include <kernel/timer.h>
+#include <kernel/drivers/pci.h>
+#include <kernel/mm/paging.h>
+#include <telos/major.h>
+#include <string.h>
+#include "block.h"
+
+/*
+ * ATA hard disk driver.
+ *
+ * Drives on the two legacy IDE channels are probed at boot and registered as
+ * hd0-hd3 (primary master, primary slave, secondary master, secondary slave).
+ * Requests are issued to the drive as a single multi-sector command and are
+ * completed from the channel's IRQ handler, so the CPU is free to run other
+ * processes while the transfer is in progress.
+ *
+ * If a PCI IDE controller with bus-master support is found, transfers are
+ * done with DMA: each buffer in the request gets an entry in the channel's
+ * physical region descriptor table, and the controller raises a single
+ * interrupt when the whole request is finished.  Otherwise (or with the
+ * "ata_nodma" boot parameter) the driver falls back to PIO, taking one
+ * interrupt per sector.
+ *
+ * The two drives on a channel share its registers, so only one command may be
+ * outstanding per channel.  A drive whose request arrives while the other
+ * drive is busy waits on the channel's queue until the current command
+ * completes.
+ */
+
+#define ATA_PRIMARY_BASE   0x1F0
+#define ATA_PRIMARY_CTL    0x3F6
+#define ATA_PRIMARY_IRQ    14
+#define ATA_SECONDARY_BASE 0x170
+#define ATA_SECONDARY_CTL  0x376
+#define ATA_SECONDARY_IRQ  15
+
+/* command block registers (offsets from base) */
+#define ATA_DATA    0
+#define ATA_ERROR   1
+#define ATA_NSECT   2
+#define ATA_LBAL    3
+#define ATA_LBAM    4
+#define ATA_LBAH    5
+#define ATA_DEVICE  6
+#define ATA_STATUS  7
+#define ATA_COMMAND 7
+
+/* device control register bits */
+#define ATA_CTL_NIEN 0x02
+#define ATA_CTL_SRST 0x04
+
+/* status register bits */
+#define ATA_SR_ERR  0x01
+#define ATA_SR_DRQ  0x08
+#define ATA_SR_DF   0x20
+#define ATA_SR_DRDY 0x40
+#define ATA_SR_BSY  0x80
+
+/* device register bits */
+#define ATA_DEV_LBA   0x40
+#define ATA_DEV_SLAVE 0x10
+#define ATA_DEV_OBS   0xA0
+
+/* commands */
+#define ATA_CMD_READ_PIO      0x20
+#define ATA_CMD_READ_PIO_EXT  0x24
+#define ATA_CMD_READ_DMA_EXT  0x25
+#define ATA_CMD_WRITE_PIO     0x30
+#define ATA_CMD_WRITE_PIO_EXT 0x34
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_DMA      0xC8
+#define ATA_CMD_WRITE_DMA     0xCA
+#define ATA_CMD_IDENTIFY      0xEC
+
+/* bus master IDE registers (offsets from the channel's bus master base) */
+#define BM_COMMAND 0
+#define BM_STATUS  2
+#define BM_PRDT    4
+
+#define BM_CMD_START 0x01
+#define BM_CMD_READ  0x08 /* device to memory */
+
+#define BM_SR_ACTIVE 0x01
+#define BM_SR_ERR    0x02
+#define BM_SR_IRQ    0x04
+
+/* physical region descriptor */
+struct ata_prd {
+	u32 addr;
+	u16 size; /* 0 means 64K */
+	u16 flags;
+} __packed;
+
+#define PRD_EOT 0x8000
+
+#define ATA_LBA28_MAX   (1UL << 28)
+#define ATA_LBA28_NSECT 256
+#define ATA_LBA48_NSECT 65536
+
+#define ATA_POLL_LIMIT 100000
+#define ATA_TIMEOUT    (10 * __TICKS_PER_SEC)
+
+#define NR_CHANNELS 2
+#define NR_DRIVES   (NR_CHANNELS * 2)
+
+struct ata_drive;
+
+struct ata_channel {
+	port_t base;
+	port_t ctl;
+	port_t bmide;               /* 0 if bus mastering is unavailable */
+	unsigned int irq;
+	struct ata_prd *prdt;
+	struct ata_drive *active;   /* drive with a command in progress */
+	struct list_head waiting;   /* drives waiting for the channel */
+	blkcnt_t done;              /* sectors transferred (PIO) */
+	struct timer timer;
+};
+
+struct ata_drive {
+	struct block_device dev;
+	struct ata_channel *chan;
+	struct list_head chain;
+	bool present;
+	bool slave;
+	bool lba48;
+	bool dma;
+	char model[41];
+};
+
+static struct ata_channel channels[NR_CHANNELS] = {
+	{
+		.base = ATA_PRIMARY_BASE,
+		.ctl  = ATA_PRIMARY_CTL,
+		.irq  = ATA_PRIMARY_IRQ,
+	},{
+		.base = ATA_SECONDARY_BASE,
+		.ctl  = ATA_SECONDARY_CTL,
+		.irq  = ATA_SECONDARY_IRQ,
+	},
+};
+
+static struct ata_drive drives[NR_DRIVES];
+
+/* wait ~400ns for the status register to become valid */
+static void ata_delay(struct ata_channel *chan)
+{
+	for (int i = 0; i < 4; i++)
+		inb(chan->ctl);
+}
+
+/*
+ * Busy-wait until (status & mask) == want.  This is only used during probing
+ * and for the short wait between issuing a PIO write and sending its first
+ * sector.
+ */
+static int ata_poll(struct ata_channel *chan, unsigned char mask,
+		unsigned char want)
+{
+	for (unsigned long i = 0; i < ATA_POLL_LIMIT; i++) {
+		unsigned char status = inb(chan->ctl);
+		if (status & ATA_SR_BSY)
+			continue;
+		if (status & (ATA_SR_ERR | ATA_SR_DF))
+			return -EIO;
+		if ((status & mask) == want)
+			return 0;
+	}
+	return -ETIMEDOUT;
+}
+
+static void ata_select(struct ata_channel *chan, struct ata_drive *drive,
+		unsigned char bits)
+{
+	outb(chan->base + ATA_DEVICE, ATA_DEV_OBS | bits
+			| (drive->slave ? ATA_DEV_SLAVE : 0));
+	ata_delay(chan);
+}
+
+static void ata_reset(struct ata_channel *chan)
+{
+	outb(chan->ctl, ATA_CTL_SRST);
+	ata_delay(chan);
+	outb(chan->ctl, 0);
+	ata_poll(chan, ATA_SR_BSY, 0);
+}
+
+/*
+ * Returns the address of the n'th sector of a request.  All buffers in a
+ * request have the same size, which is a multiple of the sector size.
+ */
+static void *sector_data(struct request *req, unsigned int n)
+{
+	unsigned int per_buf = req->buffers[0]->b_size / SECTOR_SIZE;
+	struct buffer *buf = req->buffers[n / per_buf];
+	return (char*) buf->b_data + (n % per_buf) * SECTOR_SIZE;
+}
+
+/*
+ * Fill in the PRD table for a request.  Buffer data is a single page, so one
+ * descriptor per buffer never crosses a page (or 64K) boundary.  Buffer pages
+ * and the PRD table come from kalloc_pages(), so their physical addresses are
+ * looked up in the page tables.
+ */
+static void ata_setup_prdt(struct ata_channel *chan, struct request *req)
+{
+	for (unsigned int i = 0; i < req->nr_buffers; i++) {
+		struct buffer *buf = req->buffers[i];
+		chan->prdt[i] = (struct ata_prd) {
+			.addr  = kvirt_to_phys(buf->b_data),
+			.size  = buf->b_size,
+			.flags = 0,
+		};
+	}
+	chan->prdt[req->nr_buffers-1].flags = PRD_EOT;
+
+	outl(chan->bmide + BM_PRDT, kvirt_to_phys(chan->prdt));
+	outb(chan->bmide + BM_COMMAND, req->rw == READ ? BM_CMD_READ : 0);
+	outb(chan->bmide + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);
+}
+
+static unsigned char ata_command(struct ata_drive *drive, int rw, bool ext)
+{
+	static const unsigned char cmds[2][2][2] = {
+		// PIO
+		{ { ATA_CMD_READ_PIO,  ATA_CMD_READ_PIO_EXT  },
+		  { ATA_CMD_WRITE_PIO, ATA_CMD_WRITE_PIO_EXT } },
+		// DMA
+		{ { ATA_CMD_READ_DMA,  ATA_CMD_READ_DMA_EXT  },
+		  { ATA_CMD_WRITE_DMA, ATA_CMD_WRITE_DMA_EXT } },
+	};
+	return cmds[drive->dma][rw != READ][ext];
+}
+
+static void ata_complete(struct ata_channel *chan, int error);
+
+/*
+ * Issue the active request of @drive to the hardware.  The channel must be
+ * idle.
+ */
+static void ata_issue(struct ata_channel *chan, struct ata_drive *drive)
+{
+	struct request *req = drive->dev.active;
+	unsigned long lba = req->sector;
+	unsigned long nsect = req->nr_sectors;
+	bool ext = lba + nsect > ATA_LBA28_MAX || nsect > ATA_LBA28_NSECT;
+
+	chan->active = drive;
+	chan->done = 0;
+	ktimer_start(&chan->timer, ATA_TIMEOUT);
+
+	if ((unsigned long) req->sector + nsect > (unsigned long) drive->dev.sectors
+			|| (ext && (!drive->lba48 || nsect > ATA_LBA48_NSECT))) {
+		ata_complete(chan, -EIO);
+		return;
+	}
+
+	if (drive->dma)
+		ata_setup_prdt(chan, req);
+
+	if (ext) {
+		ata_select(chan, drive, ATA_DEV_LBA);
+		outb(chan->base + ATA_NSECT, (nsect >> 8) & 0xFF);
+		outb(chan->base + ATA_LBAL,  (lba >> 24) & 0xFF);
+		outb(chan->base + ATA_LBAM,  0);
+		outb(chan->base + ATA_LBAH,  0);
+	} else {
+		ata_select(chan, drive, ATA_DEV_LBA | ((lba >> 24) & 0xF));
+	}
+	outb(chan->base + ATA_NSECT, nsect & 0xFF);
+	outb(chan->base + ATA_LBAL,  lba & 0xFF);
+	outb(chan->base + ATA_LBAM,  (lba >> 8) & 0xFF);
+	outb(chan->base + ATA_LBAH,  (lba >> 16) & 0xFF);
+	outb(chan->base + ATA_COMMAND, ata_command(drive, req->rw, ext));
+
+	if (drive->dma) {
+		outb(chan->bmide + BM_COMMAND, inb(chan->bmide + BM_COMMAND)
+				| BM_CMD_START);
+		return;
+	}
+
+	// PIO write: the first sector is sent before any interrupt
+	if (req->rw != READ) {
+		if (ata_poll(chan, ATA_SR_DRQ, ATA_SR_DRQ) < 0) {
+			ata_reset(chan);
+			ata_complete(chan, -EIO);
+			return;
+		}
+		outsw(chan->base + ATA_DATA, sector_data(req, 0), SECTOR_SIZE / 2);
+	}
+}
+
+/*
+ * Finish the channel's current command.  The next waiting drive (if any) is
+ * given the channel before the completed request is retired, so that a drive
+ * with a steady stream of requests can't starve the other drive.
+ */
+static void ata_complete(struct ata_channel *chan, int error)
+{
+	struct ata_drive *drive = chan->active;
+	struct request *req = drive->dev.active;
+
+	ktimer_remove(&chan->timer);
+	chan->active = NULL;
+
+	if (!list_empty(&chan->waiting)) {
+		struct ata_drive *next = list_first_entry(&chan->waiting,
+				struct ata_drive, chain);
+		list_del(&next->chain);
+		ata_issue(chan, next);
+	}
+
+	req->error = error;
+	block_request_completed(&drive->dev, req);
+}
+
+static void ata_pio_interrupt(struct ata_channel *chan, unsigned char status)
+{
+	struct request *req = chan->active->dev.active;
+
+	if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+		ata_complete(chan, -EIO);
+		return;
+	}
+
+	if (req->rw == READ) {
+		if (!(status & ATA_SR_DRQ)) {
+			ata_complete(chan, -EIO);
+			return;
+		}
+		insw(chan->base + ATA_DATA, sector_data(req, chan->done),
+				SECTOR_SIZE / 2);
+		if (++chan->done == req->nr_sectors)
+			ata_complete(chan, 0);
+		return;
+	}
+
+	// write: the interrupt signals that the previous sector was written
+	if (++chan->done == req->nr_sectors) {
+		ata_complete(chan, 0);
+		return;
+	}
+	if (!(status & ATA_SR_DRQ)) {
+		ata_complete(chan, -EIO);
+		return;
+	}
+	outsw(chan->base + ATA_DATA, sector_data(req, chan->done),
+			SECTOR_SIZE / 2);
+}
+
+static void ata_interrupt(unsigned int irq, void *data)
+{
+	struct ata_channel *chan = data;
+	unsigned char status, bm_status = 0;
+
+	if (chan->bmide)
+		bm_status = inb(chan->bmide + BM_STATUS);
+
+	// reading the status register acknowledges the interrupt
+	status = inb(chan->base + ATA_STATUS);
+	if (!chan->active)
+		return;
+
+	if (!chan->active->dma) {
+		ata_pio_interrupt(chan, status);
+		return;
+	}
+
+	if (!(bm_status & BM_SR_IRQ))
+		return;
+	outb(chan->bmide + BM_COMMAND, 0);
+	outb(chan->bmide + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);
+	if ((status & (ATA_SR_ERR | ATA_SR_DF)) || (bm_status & BM_SR_ERR))
+		ata_complete(chan, -EIO);
+	else
+		ata_complete(chan, 0);
+}
+
+static void ata_timeout(void *data)
+{
+	struct ata_channel *chan = data;
+
+	if (!chan->active)
+		return;
+	warn("ata: timeout on channel %x, resetting", chan->base);
+	if (chan->bmide)
+		outb(chan->bmide + BM_COMMAND, 0);
+	ata_reset(chan);
+	ata_complete(chan, -EIO);
+}
+
+static void handle_request(struct block_device *dev, struct request *req)
+{
+	struct ata_drive *drive = container_of(dev, struct ata_drive, dev);
+	struct ata_channel *chan = drive->chan;
+
+	if (chan->active)
+		list_add_tail(&drive->chain, &chan->waiting);
+	else
+		ata_issue(chan, drive);
+}
+
+static struct block_device *get_device(unsigned int minor)
+{
+	if (minor < NR_DRIVES && drives[minor].present)
+		return &drives[minor].dev;
+	return NULL;
+}
+
+/* IDENTIFY strings are stored as big-endian words */
+static void ata_string(char *dst, unsigned short *src, unsigned int words)
+{
+	unsigned int i;
+
+	for (i = 0; i < words; i++) {
+		dst[i*2]   = src[i] >> 8;
+		dst[i*2+1] = src[i] & 0xFF;
+	}
+	for (i = words * 2; i > 0 && dst[i-1] == ' '; i--)
+		;
+	dst[i] = '\0';
+}
+
+static int ata_identify(struct ata_channel *chan, struct ata_drive *drive)
+{
+	unsigned short id[256];
+	unsigned long sectors;
+
+	ata_select(chan, drive, 0);
+	outb(chan->base + ATA_NSECT, 0);
+	outb(chan->base + ATA_LBAL,  0);
+	outb(chan->base + ATA_LBAM,  0);
+	outb(chan->base + ATA_LBAH,  0);
+	outb(chan->base + ATA_COMMAND, ATA_CMD_IDENTIFY);
+	if (!inb(chan->base + ATA_STATUS))
+		return -ENODEV;
+	if (ata_poll(chan, ATA_SR_BSY, 0) < 0)
+		return -ENODEV;
+	// ATAPI and SATA devices abort IDENTIFY with a signature in LBA mid/hi
+	if (inb(chan->base + ATA_LBAM) || inb(chan->base + ATA_LBAH))
+		return -ENODEV;
+	if (ata_poll(chan, ATA_SR_DRQ, ATA_SR_DRQ) < 0)
+		return -ENODEV;
+	insw(chan->base + ATA_DATA, id, 256);
+
+	// LBA is required
+	if (!(id[49] & (1 << 9)))
+		return -ENODEV;
+
+	// capacity is clamped to what fits in a blkcnt_t
+	drive->lba48 = id[83] & (1 << 10);
+	if (!drive->lba48)
+		sectors = id[60] | ((unsigned long) id[61] << 16);
+	else if (id[103] || id[102] || (id[101] & 0x8000))
+		sectors = 0x7FFFFFFF;
+	else
+		sectors = id[100] | ((unsigned long) id[101] << 16);
+	drive->dma = chan->bmide && (id[49] & (1 << 8));
+	ata_string(drive->model, &id[27], 20);
+
+	INIT_BLOCK_DEVICE(&drive->dev, handle_request, SECTOR_SIZE, sectors);
+	return 0;
+}
+
+/*
+ * Locate the bus master registers of the PCI IDE controller.  Only
+ * controllers in compatibility mode are supported, since the driver uses the
+ * legacy ports and IRQs.
+ */
+static port_t ata_find_bmide(void)
+{
+	struct pci_dev pci;
+	unsigned long bar, cmd;
+
+	if (cmdline_flag("ata_nodma"))
+		return 0;
+	if (pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &pci) < 0)
+		return 0;
+	// native mode on either channel, or no bus master support
+	if ((pci.prog_if & 0x05) || !(pci.prog_if & 0x80))
+		return 0;
+	bar = pci_read_config(&pci, PCI_BAR(4));
+	if (!(bar & PCI_BAR_IO))
+		return 0;
+	cmd = pci_read_config(&pci, PCI_COMMAND);
+	pci_write_config(&pci, PCI_COMMAND, (cmd & 0xFFFF) | PCI_COMMAND_IO
+			| PCI_COMMAND_MASTER);
+	return bar & PCI_BAR_IO_MASK;
+}
+
+SYSINIT(ata, SUB_DRIVER)
+{
+	port_t bmide = ata_find_bmide();
+
+	register_block_driver(HD_MAJOR, "hd", get_device, NULL);
+
+	for (int i = 0; i < NR_CHANNELS; i++) {
+		struct ata_channel *chan = &channels[i];
+		bool found = false;
+
+		// floating bus: no controller
+		if (inb(chan->base + ATA_STATUS) == 0xFF)
+			continue;
+
+		INIT_LIST_HEAD(&chan->waiting);
+		ktimer_init(&chan->timer, ata_timeout, chan, TF_STATIC);
+		if (bmide && (chan->prdt = kalloc_pages(1)))
+			chan->bmide = bmide + i * 8;
+
+		outb(chan->ctl, ATA_CTL_NIEN);
+		for (int j = 0; j < 2; j++) {
+			struct ata_drive *drive = &drives[i*2 + j];
+			drive->chan = chan;
+			drive->slave = j;
+			if (ata_identify(chan, drive) < 0)
+				continue;
+			drive->present = found = true;
+			kprintf("hd%d: %s, %lu sectors%s\n", i*2 + j, drive->model,
+					(unsigned long) drive->dev.sectors,
+					drive->dma ? ", DMA" : "");
+		}
+		if (!found)
+			continue;
+
+		outb(chan->ctl, 0);
+		if (request_irq(chan->irq, ata_interrupt, chan) < 0)
+			warn("ata: IRQ %u unavailable", chan->irq);
+	}
+}
@@ -21,21 +21,66 @@
 #include <kernel/fs.h>
 #include <kernel/list.h>
 #include <kernel/log2.h>
+#include <telos/blkdev.h>
+#include <string.h>
 
 #define SECTOR_SIZE 512
 
-// TODO: allow multi-block requests
+#define MAX_REQUEST_BUFFERS 32
+
+/*
+ * A block I/O request.  A request covers nr_sectors contiguous sectors
+ * starting at sector, and transfers to/from the memory of one or more buffers
+ * (in sector order).  All buffers in a request have the same size.
+ *
+ * The chain and fifo_chain members are for use by the I/O scheduler.
+ */
 struct request {
 	struct list_head chain;
+	struct list_head fifo_chain;
 	int rw;
+	pid_t pid;
+	unsigned long start_time;
 	blkcnt_t sector;
 	blkcnt_t nr_sectors;
-	char *mem;
-	struct buffer *buf;
+	unsigned int nr_buffers;
+	int error;
+	struct buffer *buffers[MAX_REQUEST_BUFFERS];
+};
+
+struct block_device;
+
+/*
+ * I/O scheduler interface.  The scheduler owns pending requests between
+ * submission and dispatch: add() queues a new request, merge() tries to add
+ * a buffer to a pending request, and next() removes and returns the request
+ * which should be handed to the driver next (or NULL if none are pending).
+ * init() returns the scheduler's private data, which is stored in
+ * dev->sched_data.
+ */
+struct io_scheduler {
+	const char *name;
+	void *(*init)(struct block_device *);
+	void (*exit)(struct block_device *);
+	bool (*merge)(struct block_device *, int, struct buffer *);
+	void (*add)(struct block_device *, struct request *);
+	struct request *(*next)(struct block_device *);
+	bool (*empty)(struct block_device *);
 };
 
+extern struct io_scheduler noop_iosched;
+extern struct io_scheduler deadline_iosched;
+extern struct io_scheduler fair_iosched;
+
+#define IOSCHED_DEFAULT IOSCHED_DEADLINE
+
 struct block_device {
-	struct list_head requests;
+	struct list_head plug_chain;
+	struct request *active;
+	blkcnt_t head;
+	struct io_scheduler *sched;
+	void *sched_data;
+	struct blkdev_stats stats;
 	void (*handle_request)(struct block_device *, struct request*);
 	blksize_t blksize;
 	blkcnt_t sectors;
@@ -48,19 +93,31 @@ struct block_driver {
 
 extern struct file_operations blkdev_generic_fops;
 
+int elevator_init(struct block_device *dev, int sched);
+int elevator_switch(struct block_device *dev, int sched);
+int elevator_id(struct block_device *dev);
+bool request_merge(struct request *req, int rw, struct buffer *buf);
+struct request *request_clook(struct block_device *dev, struct list_head *list);
+void request_insert_sorted(struct list_head *list, struct request *req);
+
 static inline void INIT_BLOCK_DEVICE(struct block_device *dev,
 		void (*handle_request)(struct block_device*, struct request*),
 		unsigned long blksize, unsigned long sectors)
 {
-	INIT_LIST_HEAD(&dev->requests);
+	INIT_LIST_HEAD(&dev->plug_chain);
+	dev->active = NULL;
+	dev->head = 0;
+	memset(&dev->stats, 0, sizeof(dev->stats));
 	dev->handle_request = handle_request;
 	dev->blksize = blksize;
 	dev->sectors = sectors;
+	if (elevator_init(dev, IOSCHED_DEFAULT) < 0)
+		panic("failed to initialize I/O scheduler");
 }
 
 static inline bool request_queue_empty(struct block_device *dev)
 {
-	return list_empty(&dev->requests);
+	return dev->sched->empty(dev);
 }
 
 static inline off_t io_block_start(blksize_t blksize, unsigned long off)
@@ -39,14 +39,18 @@ static void handle_request(struct block_device *device, struct request *req)
 {
 	struct mod_device *dev = device->private;
 	off_t off = req->sector * SECTOR_SIZE;
-	off_t req_size = req->nr_sectors * SECTOR_SIZE;
-	off_t len = MIN(req_size, dev->len - off);
-	if (req->rw == READ) {
-		memcpy(req->mem, dev->mem+off, len);
-		if (len != req_size)
-			memset(req->mem + len, 0, req_size - len);
-	} else {
-		memcpy(dev->mem+off, req->mem, len);
+
+	for (unsigned int i = 0; i < req->nr_buffers; i++) {
+		struct buffer *buf = req->buffers[i];
+		off_t len = off < dev->len ? MIN(buf->b_size, dev->len - off) : 0;
+		if (req->rw == READ) {
+			memcpy(buf->b_data, dev->mem+off, len);
+			if (len != buf->b_size)
+				memset(buf->b_data + len, 0, buf->b_size - len);
+		} else {
+			memcpy(dev->mem+off, buf->b_data, len);
+		}
+		off += buf->b_size;
 	}
 	block_request_completed(device, req);
 }
@@ -0,0 +1,124 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <kernel/fs.h>
+#include <kernel/time.h>
+#include <kernel/mm/kmalloc.h>
+#include "block.h"
+
+/*
+ * The deadline I/O scheduler.
+ *
+ * Requests are normally dispatched in C-LOOK order from a sector-sorted list.
+ * Each request is also placed on a per-direction FIFO, and if the oldest read
+ * or write has waited longer than its expiry time, it is dispatched next
+ * instead.  Reads expire much sooner than writes, since processes usually
+ * block on reads but not on writes.
+ */
+
+#define READ_EXPIRE  50		/* 500 ms */
+#define WRITE_EXPIRE 500	/* 5 seconds */
+
+struct deadline_data {
+	struct list_head sorted;
+	struct list_head fifo[2];
+};
+
+static const unsigned long expire[2] = {
+	[READ-1]  = READ_EXPIRE,
+	[WRITE-1] = WRITE_EXPIRE,
+};
+
+static void *deadline_init(struct block_device *dev)
+{
+	struct deadline_data *dd = kmalloc(sizeof(*dd));
+	if (!dd)
+		return NULL;
+	INIT_LIST_HEAD(&dd->sorted);
+	INIT_LIST_HEAD(&dd->fifo[0]);
+	INIT_LIST_HEAD(&dd->fifo[1]);
+	return dd;
+}
+
+static void deadline_exit(struct block_device *dev)
+{
+	kfree(dev->sched_data);
+}
+
+static bool deadline_merge(struct block_device *dev, int rw,
+		struct buffer *buf)
+{
+	struct request *req;
+	struct deadline_data *dd = dev->sched_data;
+
+	list_for_each_entry(req, &dd->sorted, chain) {
+		if (request_merge(req, rw, buf))
+			return true;
+	}
+	return false;
+}
+
+static void deadline_add(struct block_device *dev, struct request *req)
+{
+	struct deadline_data *dd = dev->sched_data;
+
+	request_insert_sorted(&dd->sorted, req);
+	list_add_tail(&req->fifo_chain, &dd->fifo[req->rw-1]);
+}
+
+static struct request *deadline_expired(struct deadline_data *dd, int rw)
+{
+	struct request *req;
+
+	if (list_empty(&dd->fifo[rw-1]))
+		return NULL;
+	req = list_first_entry(&dd->fifo[rw-1], struct request, fifo_chain);
+	if (tick_count - req->start_time < expire[rw-1])
+		return NULL;
+	return req;
+}
+
+static struct request *deadline_next(struct block_device *dev)
+{
+	struct request *req;
+	struct deadline_data *dd = dev->sched_data;
+
+	if (!(req = deadline_expired(dd, READ)) &&
+			!(req = deadline_expired(dd, WRITE)) &&
+			!(req = request_clook(dev, &dd->sorted)))
+		return NULL;
+	list_del(&req->chain);
+	list_del(&req->fifo_chain);
+	return req;
+}
+
+static bool deadline_empty(struct block_device *dev)
+{
+	struct deadline_data *dd = dev->sched_data;
+	return list_empty(&dd->sorted);
+}
+
+struct io_scheduler deadline_iosched = {
+	.name  = "deadline",
+	.init  = deadline_init,
+	.exit  = deadline_exit,
+	.merge = deadline_merge,
+	.add   = deadline_add,
+	.next  = deadline_next,
+	.empty = deadline_empty,
+};
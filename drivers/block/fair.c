@@ -0,0 +1,164 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <kernel/fs.h>
+#include <kernel/mm/kmalloc.h>
+#include <kernel/mm/slab.h>
+#include "block.h"
+
+/*
+ * The fair-queueing I/O scheduler.
+ *
+ * Each process submitting I/O gets its own queue of requests, sorted by
+ * sector.  Queues are served round-robin: the active queue is served in
+ * C-LOOK order until it is empty or has used up its budget of FAIR_BUDGET
+ * sectors, then it moves to the back of the line.  A process streaming large
+ * writes can thus only delay another process's reads by one budget's worth
+ * of I/O.  Buffers are only merged into requests from the same process.
+ */
+
+#define FAIR_BUDGET 256 /* sectors */
+
+struct fair_queue {
+	struct list_head chain;
+	struct list_head requests;
+	pid_t pid;
+	long budget;
+};
+
+struct fair_data {
+	struct list_head queues;
+	struct fair_queue *active;
+};
+
+static DEFINE_SLAB_CACHE(fair_queue_cachep, sizeof(struct fair_queue));
+
+static void *fair_init(struct block_device *dev)
+{
+	struct fair_data *fd = kmalloc(sizeof(*fd));
+	if (!fd)
+		return NULL;
+	INIT_LIST_HEAD(&fd->queues);
+	fd->active = NULL;
+	return fd;
+}
+
+static void fair_exit(struct block_device *dev)
+{
+	struct fair_queue *fq, *tmp;
+	struct fair_data *fd = dev->sched_data;
+
+	list_for_each_entry_safe(fq, tmp, &fd->queues, chain) {
+		list_del(&fq->chain);
+		slab_free(fair_queue_cachep, fq);
+	}
+	kfree(fd);
+}
+
+static struct fair_queue *fair_find_queue(struct fair_data *fd, pid_t pid)
+{
+	struct fair_queue *fq;
+
+	list_for_each_entry(fq, &fd->queues, chain) {
+		if (fq->pid == pid)
+			return fq;
+	}
+	return NULL;
+}
+
+static bool fair_merge(struct block_device *dev, int rw, struct buffer *buf)
+{
+	struct request *req;
+	struct fair_queue *fq;
+
+	if (!(fq = fair_find_queue(dev->sched_data, current->pid)))
+		return false;
+	list_for_each_entry(req, &fq->requests, chain) {
+		if (request_merge(req, rw, buf))
+			return true;
+	}
+	return false;
+}
+
+static void fair_add(struct block_device *dev, struct request *req)
+{
+	struct fair_data *fd = dev->sched_data;
+	struct fair_queue *fq = fair_find_queue(fd, req->pid);
+
+	if (!fq) {
+		if (!(fq = slab_alloc(fair_queue_cachep)))
+			panic("No memory for I/O queue");
+		INIT_LIST_HEAD(&fq->requests);
+		fq->pid = req->pid;
+		fq->budget = FAIR_BUDGET;
+		list_add_tail(&fq->chain, &fd->queues);
+	}
+	request_insert_sorted(&fq->requests, req);
+}
+
+/*
+ * Queues are removed as soon as they become empty, so every queue on
+ * fd->queues has at least one request.
+ */
+static struct request *fair_next(struct block_device *dev)
+{
+	struct request *req;
+	struct fair_data *fd = dev->sched_data;
+	struct fair_queue *fq = fd->active;
+
+	// out of budget: go to the back of the line
+	if (fq && fq->budget <= 0) {
+		fq->budget = FAIR_BUDGET;
+		list_del(&fq->chain);
+		list_add_tail(&fq->chain, &fd->queues);
+		fq = NULL;
+	}
+	if (!fq) {
+		if (list_empty(&fd->queues))
+			return NULL;
+		fq = list_first_entry(&fd->queues, struct fair_queue, chain);
+		fd->active = fq;
+	}
+
+	req = request_clook(dev, &fq->requests);
+	list_del(&req->chain);
+	fq->budget -= req->nr_sectors;
+
+	if (list_empty(&fq->requests)) {
+		list_del(&fq->chain);
+		slab_free(fair_queue_cachep, fq);
+		fd->active = NULL;
+	}
+	return req;
+}
+
+static bool fair_empty(struct block_device *dev)
+{
+	struct fair_data *fd = dev->sched_data;
+	return list_empty(&fd->queues);
+}
+
+struct io_scheduler fair_iosched = {
+	.name  = "fair",
+	.init  = fair_init,
+	.exit  = fair_exit,
+	.merge = fair_merge,
+	.add   = fair_add,
+	.next  = fair_next,
+	.empty = fair_empty,
+};
@@ -0,0 +1,202 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <kernel/fs.h>
+#include <kernel/mm/kmalloc.h>
+#include "block.h"
+
+/*
+ * I/O scheduler framework, common helpers, and the noop scheduler.
+ */
+
+static struct io_scheduler *schedulers[__NR_IOSCHED] = {
+	[IOSCHED_NOOP]     = &noop_iosched,
+	[IOSCHED_DEADLINE] = &deadline_iosched,
+	[IOSCHED_FAIR]     = &fair_iosched,
+};
+
+int elevator_init(struct block_device *dev, int sched)
+{
+	if (sched < 0 || sched >= __NR_IOSCHED)
+		return -EINVAL;
+	if (!(dev->sched_data = schedulers[sched]->init(dev)))
+		return -ENOMEM;
+	dev->sched = schedulers[sched];
+	return 0;
+}
+
+int elevator_id(struct block_device *dev)
+{
+	for (int i = 0; i < __NR_IOSCHED; i++) {
+		if (schedulers[i] == dev->sched)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Change the I/O scheduler for a device.  Pending requests are moved from the
+ * old scheduler to the new one.
+ */
+int elevator_switch(struct block_device *dev, int sched)
+{
+	void *data;
+	struct request *req, *tmp;
+	LIST_HEAD(pending);
+
+	if (sched < 0 || sched >= __NR_IOSCHED)
+		return -EINVAL;
+	if (schedulers[sched] == dev->sched)
+		return 0;
+	if (!(data = schedulers[sched]->init(dev)))
+		return -ENOMEM;
+
+	while ((req = dev->sched->next(dev)))
+		list_add_tail(&req->chain, &pending);
+	dev->sched->exit(dev);
+
+	dev->sched = schedulers[sched];
+	dev->sched_data = data;
+	list_for_each_entry_safe(req, tmp, &pending, chain) {
+		list_del(&req->chain);
+		dev->sched->add(dev, req);
+	}
+	return 0;
+}
+
+#define NR_SECTORS(buffer) ((buffer)->b_size / SECTOR_SIZE)
+#define SECTOR(buffer) ((buffer)->b_blocknr * NR_SECTORS(buffer))
+
+/*
+ * Try to merge a buffer into a request, at either end.
+ */
+bool request_merge(struct request *req, int rw, struct buffer *buf)
+{
+	blkcnt_t sector = SECTOR(buf);
+	blkcnt_t nr_sectors = NR_SECTORS(buf);
+
+	if (req->rw != rw || req->nr_buffers == MAX_REQUEST_BUFFERS)
+		return false;
+	if (req->buffers[0]->b_size != buf->b_size)
+		return false;
+	// back merge
+	if (req->sector + req->nr_sectors == sector) {
+		req->buffers[req->nr_buffers++] = buf;
+		req->nr_sectors += nr_sectors;
+		return true;
+	}
+	// front merge
+	if (sector + nr_sectors == req->sector) {
+		for (unsigned int i = req->nr_buffers; i > 0; i--)
+			req->buffers[i] = req->buffers[i-1];
+		req->buffers[0] = buf;
+		req->nr_buffers++;
+		req->sector = sector;
+		req->nr_sectors += nr_sectors;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Insert a request into a list sorted by sector (linked through req->chain).
+ */
+void request_insert_sorted(struct list_head *list, struct request *req)
+{
+	struct request *pos;
+
+	list_for_each_entry(pos, list, chain) {
+		if (req->sector < pos->sector)
+			break;
+	}
+	list_add_tail(&req->chain, &pos->chain);
+}
+
+/*
+ * Choose a request from a sorted list in C-LOOK order: the first request at or
+ * beyond the current head position, wrapping around to the lowest sector.
+ */
+struct request *request_clook(struct block_device *dev, struct list_head *list)
+{
+	struct request *req;
+
+	if (list_empty(list))
+		return NULL;
+	list_for_each_entry(req, list, chain) {
+		if (req->sector >= dev->head)
+			return req;
+	}
+	return list_first_entry(list, struct request, chain);
+}
+
+/*
+ * The noop scheduler: FIFO dispatch, with merging.
+ */
+
+static void *noop_init(struct block_device *dev)
+{
+	struct list_head *queue = kmalloc(sizeof(*queue));
+	if (queue)
+		INIT_LIST_HEAD(queue);
+	return queue;
+}
+
+static void noop_exit(struct block_device *dev)
+{
+	kfree(dev->sched_data);
+}
+
+static bool noop_merge(struct block_device *dev, int rw, struct buffer *buf)
+{
+	struct request *req;
+	struct list_head *queue = dev->sched_data;
+
+	list_for_each_entry_reverse(req, queue, chain) {
+		if (request_merge(req, rw, buf))
+			return true;
+	}
+	return false;
+}
+
+static void noop_add(struct block_device *dev, struct request *req)
+{
+	list_add_tail(&req->chain, (struct list_head*) dev->sched_data);
+}
+
+static struct request *noop_next(struct block_device *dev)
+{
+	struct list_head *queue = dev->sched_data;
+	if (list_empty(queue))
+		return NULL;
+	return list_pop(queue, struct request, chain);
+}
+
+static bool noop_empty(struct block_device *dev)
+{
+	return list_empty((struct list_head*) dev->sched_data);
+}
+
+struct io_scheduler noop_iosched = {
+	.name  = "noop",
+	.init  = noop_init,
+	.exit  = noop_exit,
+	.merge = noop_merge,
+	.add   = noop_add,
+	.next  = noop_next,
+	.empty = noop_empty,
+};
@@ -0,0 +1,143 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <kernel/cmdline.h>
+#include <kernel/fs.h>
+#include <kernel/time.h>
+#include <kernel/timer.h>
+#include <kernel/mm/paging.h>
+#include <telos/major.h>
+#include <string.h>
+#include "block.h"
+
+/*
+ * RAM disk block device driver.
+ *
+ * The RAM disk is configured with boot parameters:
+ *
+ *   ramdisk=SIZE          size of the disk (e.g. "ramdisk=16M")
+ *   ramdisk_latency=MS    simulated per-request latency, in milliseconds
+ *   ramdisk_bw=BYTES      simulated bandwidth, in bytes per second
+ *   ramdisk_async         complete requests from the timer, even with no delay
+ *
+ * Without a simulated latency or bandwidth (and without ramdisk_async),
+ * requests are completed synchronously in handle_request.  Otherwise, the
+ * transfer is done and the request is completed from a timer callback after
+ * the simulated service time, which is rounded up to whole ticks.
+ */
+
+struct ramdisk {
+	unsigned char *mem;
+	unsigned long size;
+	unsigned long latency;   /* ticks */
+	unsigned long bandwidth; /* bytes per second, or 0 for unlimited */
+	bool async;
+	struct timer timer;
+};
+
+static struct ramdisk ramdisk;
+static struct block_device ramdisk_dev;
+
+static unsigned long request_delay(struct ramdisk *rd, struct request *req)
+{
+	unsigned long delay = rd->latency;
+	if (rd->bandwidth) {
+		unsigned long bytes = req->nr_sectors * SECTOR_SIZE;
+		delay += (bytes * __TICKS_PER_SEC + rd->bandwidth - 1)
+			/ rd->bandwidth;
+	}
+	return delay;
+}
+
+static void ramdisk_transfer(struct ramdisk *rd, struct request *req)
+{
+	unsigned long off = req->sector * SECTOR_SIZE;
+
+	for (unsigned int i = 0; i < req->nr_buffers; i++) {
+		struct buffer *buf = req->buffers[i];
+		if (off + buf->b_size > rd->size) {
+			req->error = -EIO;
+			return;
+		}
+		if (req->rw == READ)
+			memcpy(buf->b_data, rd->mem + off, buf->b_size);
+		else
+			memcpy(rd->mem + off, buf->b_data, buf->b_size);
+		off += buf->b_size;
+	}
+}
+
+static void ramdisk_complete(void *data)
+{
+	struct block_device *dev = data;
+	struct request *req = dev->active;
+
+	ramdisk_transfer(dev->private, req);
+	block_request_completed(dev, req);
+}
+
+static void handle_request(struct block_device *dev, struct request *req)
+{
+	struct ramdisk *rd = dev->private;
+	unsigned long delay = request_delay(rd, req);
+
+	if (!delay && !rd->async) {
+		ramdisk_transfer(rd, req);
+		block_request_completed(dev, req);
+		return;
+	}
+	ktimer_init(&rd->timer, ramdisk_complete, dev, TF_STATIC);
+	ktimer_start(&rd->timer, delay ? delay : 1);
+}
+
+static struct block_device *get_device(unsigned int minor)
+{
+	if (minor == 0 && ramdisk.mem)
+		return &ramdisk_dev;
+	return NULL;
+}
+
+SYSINIT(ramdisk, SUB_DRIVER)
+{
+	unsigned long size, pages, ms;
+
+	register_block_driver(RAMDISK_MAJOR, "ramdisk", get_device, NULL);
+
+	if (cmdline_ulong("ramdisk", &size) || !size)
+		return;
+	// kalloc_pages() panics when memory runs out, so check first, and leave
+	// a quarter of free memory for the rest of the kernel
+	pages = size / FRAME_SIZE + (size % FRAME_SIZE != 0);
+	if (pages > nr_free_frames() - nr_free_frames() / 4) {
+		warn("not enough memory for %lu byte RAM disk", size);
+		return;
+	}
+	size = pages * FRAME_SIZE;
+	ramdisk.mem = kalloc_pages(pages);
+	memset(ramdisk.mem, 0, size);
+	ramdisk.size = size;
+
+	if (!cmdline_ulong("ramdisk_latency", &ms))
+		ramdisk.latency = (ms * __TICKS_PER_SEC + 999) / 1000;
+	cmdline_ulong("ramdisk_bw", &ramdisk.bandwidth);
+	ramdisk.async = cmdline_flag("ramdisk_async");
+
+	INIT_BLOCK_DEVICE(&ramdisk_dev, handle_request, SECTOR_SIZE,
+			size / SECTOR_SIZE);
+	ramdisk_dev.private = &ramdisk;
+}
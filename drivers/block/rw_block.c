@@ -16,8 +16,13 @@
  */
 
 #include <kernel/fs.h>
+#include <kernel/mmap.h>
+#include <kernel/time.h>
 #include <kernel/wait.h>
 #include <kernel/mm/kmalloc.h>
+#include <kernel/mm/paging.h>
+#include <kernel/mm/vma.h>
+#include <telos/ioctl.h>
 #include <telos/major.h>
 #include <string.h>
 #include "block.h"
@@ -31,11 +36,47 @@ static DEFINE_SLAB_CACHE(request_cachep, sizeof(struct request));
 
 static struct block_driver blkdev[MAX_BLKDEV];
 
+/*
+ * Plugging.  While the queues are plugged, new requests are held back from
+ * idle devices so that a batch of submissions can be merged and sorted before
+ * the driver sees them.  Plugged devices are started by finish_plug(), or
+ * when a process would otherwise sleep waiting on a held-back request.
+ */
+static unsigned int plug_depth;
+static LIST_HEAD(plugged_devices);
+
+static void start_request(struct block_device *dev);
+
+static void run_plugged_queues(void)
+{
+	struct block_device *dev;
+
+	while (!list_empty(&plugged_devices)) {
+		dev = list_first_entry(&plugged_devices, struct block_device,
+				plug_chain);
+		list_del_init(&dev->plug_chain);
+		start_request(dev);
+	}
+}
+
+void start_plug(void)
+{
+	plug_depth++;
+}
+
+void finish_plug(void)
+{
+	if (--plug_depth == 0)
+		run_plugged_queues();
+}
+
 /*
  * Wait until a buffer is unlocked.
  */
 void buffer_wait(struct buffer *buf)
 {
+	if (buf->b_lock)
+		run_plugged_queues();
 	while (buf->b_lock) {
 		wait_interruptible(&buf->b_wait);
 		// TODO: handle signals
@@ -51,6 +92,7 @@ static void buffer_lock(struct buffer *buf)
 static void buffer_unlock(struct buffer *buf)
 {
 	buf->b_lock = false;
+	wake_all(&buf->b_wait, 0);
 }
 
 #define NR_SECTORS(buffer) ((buffer)->b_size / SECTOR_SIZE)
@@ -63,11 +105,13 @@ static struct request *make_request(int rw, struct buffer *buf)
 		panic("No memory for block request");
 	// FIXME: block until memory available
 	req->rw = rw;
+	req->pid = current->pid;
+	req->start_time = tick_count;
 	req->sector = SECTOR(buf);
 	req->nr_sectors = NR_SECTORS(buf);
-	req->mem = buf->b_data;
-	req->buf = buf;
-	buf->b_count++;
+	req->nr_buffers = 1;
+	req->buffers[0] = buf;
+	req->error = 0;
 	return req;
 }
 
@@ -77,35 +121,117 @@ static struct block_device *get_device(dev_t dev)
 }
 
 /*
- * Submit an I/O request on a buffer.
+ * Hand the next pending request to the driver, if the device is idle.
  */
-int submit_block(int rw, struct buffer *buf)
+static void start_request(struct block_device *dev)
+{
+	struct request *req;
+
+	if (dev->active || !(req = dev->sched->next(dev)))
+		return;
+	dev->stats.queued--;
+	dev->active = req;
+	dev->head = req->sector + req->nr_sectors;
+	dev->handle_request(dev, req);
+}
+
+/*
+ * Submit an I/O request on a buffer, without waiting for it to complete.  The
+ * buffer is merged into a pending request if possible; otherwise a new
+ * request is given to the device's I/O scheduler.
+ *
+ * If @end_io is not NULL, it is called with the buffer and @data when the I/O
+ * completes, after the buffer is unlocked.  It may be called from interrupt
+ * context, or before this function returns, and must not sleep.  Whether the
+ * I/O succeeded can be determined from the BUF_UPTODATE and BUF_ERROR flags.
+ * If a read can't be started because the buffer's page is shared and can't be
+ * copied, the buffer is completed with BUF_ERROR and -ENOMEM is returned.
+ */
+int submit_block_async(int rw, struct buffer *buf,
+		void (*end_io)(struct buffer *, void *), void *data)
 {
 	struct block_device *dev = get_device(buf->b_dev);
-	struct request *req = make_request(rw, buf);
 	buffer_lock(buf);
-	if (request_queue_empty(dev))
-		dev->handle_request(dev, req);
-	else
-		list_add_tail(&req->chain, &dev->requests);
+	buf->b_flags &= ~BUF_ERROR;
+	// the device may write to the frame directly (DMA), so it mustn't be
+	// shared with user space, whether or not the buffer is merged
+	if (rw == READ && kunshare_page(buf->b_data) == -ENOMEM) {
+		buf->b_flags |= BUF_ERROR;
+		buffer_unlock(buf);
+		if (end_io)
+			end_io(buf, data);
+		return -ENOMEM;
+	}
+	buf->b_count++;
+	buf->b_end_io = end_io;
+	buf->b_end_io_data = data;
+	if (dev->sched->merge(dev, rw, buf)) {
+		dev->stats.merges++;
+	} else {
+		dev->sched->add(dev, make_request(rw, buf));
+		if (++dev->stats.queued > dev->stats.max_queued)
+			dev->stats.max_queued = dev->stats.queued;
+	}
+	if (plug_depth) {
+		if (list_empty(&dev->plug_chain))
+			list_add_tail(&dev->plug_chain, &plugged_devices);
+	} else {
+		start_request(dev);
+	}
+	return 0;
+}
+
+int submit_block(int rw, struct buffer *buf)
+{
+	return submit_block_async(rw, buf, NULL, NULL);
+}
+
+/*
+ * Submit I/O on a batch of buffers.  The buffers are submitted under a plug,
+ * so that adjacent blocks are merged into as few requests as possible.
+ */
+int submit_blocks(int rw, struct buffer **bufs, unsigned int nr,
+		void (*end_io)(struct buffer *, void *), void *data)
+{
+	start_plug();
+	for (unsigned int i = 0; i < nr; i++)
+		submit_block_async(rw, bufs[i], end_io, data);
+	finish_plug();
 	return 0;
 }
 
 /*
  * Block drivers call this function to signal completion of an I/O request.
+ * A nonzero req->error indicates that the request failed.
  */
 void block_request_completed(struct block_device *dev, struct request *req)
 {
-	req->buf->b_flags |= BUF_UPTODATE;
-	release_buffer(req->buf);
-	buffer_unlock(req->buf);
+	if (req->rw == READ) {
+		dev->stats.reads++;
+		dev->stats.read_sectors += req->nr_sectors;
+	} else {
+		dev->stats.writes++;
+		dev->stats.write_sectors += req->nr_sectors;
+	}
+	dev->stats.wait_ticks += tick_count - req->start_time;
+
+	for (unsigned int i = 0; i < req->nr_buffers; i++) {
+		struct buffer *buf = req->buffers[i];
+		void (*end_io)(struct buffer *, void *) = buf->b_end_io;
+
+		if (req->error)
+			buf->b_flags |= BUF_ERROR;
+		else
+			buf->b_flags |= BUF_UPTODATE;
+		buf->b_end_io = NULL;
+		buffer_unlock(buf);
+		if (end_io)
+			end_io(buf, buf->b_end_io_data);
+		release_buffer(buf);
+	}
 	slab_free(request_cachep, req);
-
-	if (request_queue_empty(dev))
-		return;
-	req = list_first_entry(&dev->requests, struct request, chain);
-	list_del(&req->chain);
-	dev->handle_request(dev, req);
+	dev->active = NULL;
+	start_request(dev);
 }
 
 blksize_t blkdev_blksize(dev_t devno)
@@ -137,82 +263,151 @@ int set_blocksize(dev_t devno, blksize_t size)
 }
 
 /*
- * Use a slab cache for allocating small bio_vecs (the common case for
- * directory/small file block lists), and fall back on kmalloc for larger
- * allocations.
+ * Scatter/gather block I/O.
  */
-#define SMALL_BIO_MAX 8
-#define BIO_VEC_SIZE(blkcnt) \
-	(sizeof(struct bio_vec) + sizeof(blkcnt_t)*blkcnt)
-
-static DEFINE_SLAB_CACHE(small_bio_cachep, BIO_VEC_SIZE(SMALL_BIO_MAX));
 
-struct bio_vec *alloc_bio_vec(dev_t dev, blkcnt_t blkcnt, blksize_t blksize)
-{
-	struct bio_vec *bio = blkcnt <= SMALL_BIO_MAX
-		? slab_alloc(small_bio_cachep)
-		: kmalloc(BIO_VEC_SIZE(blkcnt));
-	bio->dev = dev;
-	bio->blkcnt = blkcnt;
-	bio->blksize = blksize;
-	return bio;
-}
-
-void free_bio_vec(struct bio_vec *bio)
-{
-	if (bio->blkcnt <= SMALL_BIO_MAX)
-		slab_free(small_bio_cachep, bio);
-	else
-		kfree(bio);
-}
+/*
+ * Blocks are processed in batches: buffers for the whole batch are looked up
+ * and any reads are submitted together (so that contiguous blocks are merged
+ * into large requests) before waiting on the first one.
+ */
+#define BIO_BATCH MAX_REQUEST_BUFFERS
 
 /*
- * Scatter/gather block I/O.
+ * Reads of whole, page-sized blocks into page-aligned user memory map the
+ * buffer's frame into the reader's address space copy-on-write, rather than
+ * copying it.
  */
+static bool bio_share_block(struct buffer *buf, char *dst, off_t start,
+		off_t end)
+{
+	if (start || end != FRAME_SIZE || (uintptr_t)dst >= kernel_base)
+		return false;
+	return !vm_share_page(dst, buf->b_data);
+}
 
-static ssize_t bio_do_io(struct bio_vec *vec, char *iobuf, size_t len,
+static ssize_t bio_do_io(struct block_map *map, char *iobuf, size_t len,
 		size_t pos, int rw)
 {
+	struct buffer *bufs[BIO_BATCH];
+	struct buffer *reads[BIO_BATCH];
+	unsigned int nr_reads;
 	size_t nr_bytes = 0;
-	blkcnt_t blocks = io_block_count(vec->blksize, pos, len);
-	blkcnt_t first_block = io_off_to_block(vec->blksize, pos);
-	off_t start = io_block_off(vec->blksize, pos);
-	off_t end = MIN((unsigned long)vec->blksize, start + len);
-
-	for (blkcnt_t b = first_block; b - first_block < blocks; b++) {
-		// do I/O within a single block
-		struct buffer *buffer = read_block(vec->dev, vec->block[b],
-				vec->blksize);
-		if (rw == READ) {
-			memcpy(iobuf+nr_bytes, buffer->b_data+start, end-start);
-		} else {
-			memcpy(buffer->b_data+start, iobuf+nr_bytes, end-start);
-			buffer->b_flags |= BUF_DIRTY;
+	blkcnt_t blocks = io_block_count(map->blksize, pos, len);
+	blkcnt_t first_block = io_off_to_block(map->blksize, pos);
+	off_t start = io_block_off(map->blksize, pos);
+	blkcnt_t pblk = 0, run = 0;
+	ssize_t error = 0;
+
+	for (blkcnt_t b = first_block; b - first_block < blocks; ) {
+		blkcnt_t n = MIN(BIO_BATCH, blocks - (b - first_block));
+		blkcnt_t got;
+		size_t left = len - nr_bytes;
+		off_t s = start;
+
+		// map blocks, get buffers and start reads
+		for (got = 0, nr_reads = 0; got < n; got++) {
+			off_t e = MIN((unsigned long)map->blksize, s + left);
+			struct buffer *buffer = NULL;
+			if (!run && (pblk = bmap(map, b + got, &run)) < 0) {
+				error = pblk;
+				run = 0;
+				break;
+			}
+			if (bmap_hole(map, pblk) && rw == WRITE) {
+				// newly allocated blocks start out zeroed
+				if ((pblk = bmap_alloc(map, b + got)) < 0) {
+					error = pblk;
+					run = 0;
+					break;
+				}
+				run = 1;
+				buffer = get_buffer(map->dev, pblk, map->blksize);
+				if (!buffer) {
+					error = -ENOMEM;
+					break;
+				}
+				memset(buffer->b_data, 0, map->blksize);
+				buffer->b_flags |= BUF_UPTODATE;
+				pblk++;
+			} else if (!bmap_hole(map, pblk)) {
+				buffer = get_buffer(map->dev, pblk, map->blksize);
+				if (!buffer) {
+					error = -ENOMEM;
+					break;
+				}
+				pblk++;
+			}
+			run--;
+			bufs[got] = buffer;
+			// no need to read blocks that will be entirely overwritten,
+			// or which are already being read
+			if (buffer && !(buffer->b_flags & BUF_UPTODATE) &&
+					!buffer->b_lock &&
+					!(rw == WRITE && s == 0 && e == map->blksize))
+				reads[nr_reads++] = buffer;
+			left -= e - s;
+			s = 0;
 		}
-		release_buffer(buffer);
-
-		// update counts
-		nr_bytes += end - start;
-		start = 0;
-		end = MIN((unsigned long)vec->blksize, len - nr_bytes);
+		submit_blocks(READ, reads, nr_reads, NULL, NULL);
+
+		// do I/O within each block
+		for (blkcnt_t i = 0; i < got; i++) {
+			off_t end = MIN((unsigned long)map->blksize,
+					start + (len - nr_bytes));
+			// holes read as zeros
+			if (!bufs[i]) {
+				memset(iobuf+nr_bytes, 0, end-start);
+				nr_bytes += end - start;
+				start = 0;
+				continue;
+			}
+			buffer_wait(bufs[i]);
+			if (bufs[i]->b_flags & BUF_ERROR) {
+				while (i < got) {
+					if (bufs[i])
+						release_buffer(bufs[i]);
+					i++;
+				}
+				return nr_bytes ? (ssize_t) nr_bytes : -EIO;
+			}
+			if (rw == READ) {
+				if (!bio_share_block(bufs[i], iobuf+nr_bytes,
+							start, end))
+					memcpy(iobuf+nr_bytes,
+							bufs[i]->b_data+start,
+							end-start);
+			} else {
+				memcpy(bufs[i]->b_data+start, iobuf+nr_bytes,
+						end-start);
+				bufs[i]->b_flags |= BUF_UPTODATE;
+				mark_buffer_dirty(bufs[i]);
+			}
+			release_buffer(bufs[i]);
+			nr_bytes += end - start;
+			start = 0;
+		}
+		if (got < n)
+			return nr_bytes ? (ssize_t) nr_bytes : error;
+		b += got;
 	}
 	return nr_bytes;
 }
 
-ssize_t bio_read(struct bio_vec *vec, char *iobuf, size_t len,
+ssize_t bio_read(struct block_map *map, char *iobuf, size_t len,
 		unsigned long *pos)
 {
-	ssize_t r = bio_do_io(vec, iobuf, len, *pos, READ);
+	ssize_t r = bio_do_io(map, iobuf, len, *pos, READ);
 	if (r < 0)
 		return r;
 	*pos += r;
 	return r;
 }
 
-ssize_t bio_write(struct bio_vec *vec, const char *iobuf, size_t len,
+ssize_t bio_write(struct block_map *map, const char *iobuf, size_t len,
 		unsigned long *pos)
 {
-	ssize_t r = bio_do_io(vec, (char*)iobuf, len, *pos, WRITE);
+	ssize_t r = bio_do_io(map, (char*)iobuf, len, *pos, WRITE);
 	if (r < 0)
 		return r;
 	*pos += r;
@@ -220,16 +415,138 @@ ssize_t bio_write(struct bio_vec *vec, const char *iobuf, size_t len,
 }
 
 /*
- * Generic VFS read function for filesystems that provide bio_vec block lists
- * to the VFS.
+ * Read-ahead.  When a file is read sequentially, the blocks following the
+ * current read are submitted without waiting for them, so that the device
+ * queue stays full while the reader is busy with the data it has.  The window
+ * starts at RA_MIN blocks and doubles on each sequential read up to RA_MAX.
+ * A non-sequential read collapses the window.
+ */
+#define RA_MIN 4
+#define RA_MAX MAX_REQUEST_BUFFERS
+
+/*
+ * Update the read-ahead state for a read of blocks [first, last].  If there
+ * is anything to read ahead, returns true and sets [*start, *end) to the
+ * range of blocks to submit (which is clipped to limit).
+ */
+static bool ra_update(struct file_ra *ra, blkcnt_t first, blkcnt_t last,
+		blkcnt_t limit, blkcnt_t *start, blkcnt_t *end)
+{
+	if (first != ra->next && (first < ra->next || first >= ra->end)) {
+		ra->next = last + 1;
+		ra->end = 0;
+		ra->size = 0;
+		return false;
+	}
+	ra->next = last + 1;
+	ra->size = ra->size ? MIN(ra->size * 2, RA_MAX) : RA_MIN;
+	*start = MAX(ra->next, ra->end);
+	*end = MIN(ra->next + ra->size, limit);
+	if (*start >= *end)
+		return false;
+	ra->end = *end;
+	return true;
+}
+
+/*
+ * Start an asynchronous read of a block, if it isn't already cached.
+ */
+static void readahead_block(dev_t dev, blkcnt_t block, blksize_t size)
+{
+	struct buffer *buf = get_buffer(dev, block, size);
+	if (!buf)
+		return;
+	if (!(buf->b_flags & BUF_UPTODATE) && !buf->b_lock)
+		submit_block(READ, buf);
+	release_buffer(buf);
+}
+
+/*
+ * Start read-ahead of the logical blocks [start, end) of a block map.
+ */
+static void readahead_blocks(struct block_map *map, blkcnt_t start,
+		blkcnt_t end)
+{
+	blkcnt_t pblk, run;
+
+	while (start < end) {
+		if ((pblk = bmap(map, start, &run)) < 0)
+			return;
+		run = MIN(run, end - start);
+		if (!bmap_hole(map, pblk)) {
+			for (blkcnt_t i = 0; i < run; i++)
+				readahead_block(map->dev, pblk + i, map->blksize);
+		}
+		start += run;
+	}
+}
+
+/*
+ * Generic VFS read function for filesystems that provide block maps to the
+ * VFS.
  */
 ssize_t bio_file_read(struct file *file, char *buf, size_t len,
 		unsigned long *pos)
 {
-	if (*pos > file->f_inode->i_size)
+	ssize_t r;
+	blkcnt_t start, end;
+	struct block_map *map = file->f_inode->i_map;
+
+	if (*pos >= file->f_inode->i_size || !len)
+		return 0;
+	len = MIN(len, file->f_inode->i_size - *pos);
+
+	// read-ahead requests are queued along with the read itself
+	start_plug();
+	if (ra_update(&file->f_ra, io_off_to_block(map->blksize, *pos),
+				io_off_to_block(map->blksize, *pos + len - 1),
+				map->blkcnt, &start, &end))
+		readahead_blocks(map, start, end);
+	r = bio_read(map, buf, len, pos);
+	finish_plug();
+	return r;
+}
+
+/*
+ * Vectored version of bio_file_read.  Read-ahead is set up once for the whole
+ * range, and all of the segments are read under one plug, so that their
+ * blocks are merged into large requests.
+ */
+ssize_t bio_file_readv(struct file *file, const struct iovec *iov,
+		unsigned long nr_segs, unsigned long *pos)
+{
+	ssize_t r, total = 0;
+	size_t len = 0;
+	blkcnt_t start, end;
+	struct block_map *map = file->f_inode->i_map;
+
+	for (unsigned long i = 0; i < nr_segs; i++)
+		len += iov[i].iov_len;
+	if (*pos >= file->f_inode->i_size || !len)
 		return 0;
 	len = MIN(len, file->f_inode->i_size - *pos);
-	return bio_read(file->f_inode->i_bio, buf, len, pos);
+
+	start_plug();
+	if (ra_update(&file->f_ra, io_off_to_block(map->blksize, *pos),
+				io_off_to_block(map->blksize, *pos + len - 1),
+				map->blkcnt, &start, &end))
+		readahead_blocks(map, start, end);
+	for (unsigned long i = 0; i < nr_segs && len; i++) {
+		size_t n = MIN(iov[i].iov_len, len);
+		if (!n)
+			continue;
+		if ((r = bio_read(map, iov[i].iov_base, n, pos)) < 0) {
+			if (!total)
+				total = r;
+			break;
+		}
+		total += r;
+		len -= r;
+		if ((size_t) r < n)
+			break;
+	}
+	finish_plug();
+	return total;
 }
 
 /*
@@ -237,47 +554,79 @@ ssize_t bio_file_read(struct file *file, char *buf, size_t len,
  */
 
 static ssize_t blkdev_generic_io(dev_t rdev, char *iobuf, size_t len,
-		unsigned long *pos, int rw)
+		unsigned long *pos, int rw, struct file_ra *ra)
 {
 	struct block_device *dev = get_device(rdev);
+	if (*pos >= (unsigned long) dev->sectors*SECTOR_SIZE || !len)
+		return 0;
 	len = MIN(len, dev->sectors*SECTOR_SIZE - *pos);
 	blkcnt_t count = io_block_count(dev->blksize, *pos, len);
 	blkcnt_t first = io_off_to_block(dev->blksize, *pos);
-	unsigned long io_off = io_block_off(dev->blksize, *pos);
+	blkcnt_t ra_start, ra_end;
+	struct block_map map;
 
-	// populate bio_vec with sequential blocks
-	struct bio_vec *bio = alloc_bio_vec(rdev, count, dev->blksize);
-	for (blkcnt_t i = 0; i < count; i++)
-		bio->block[i] = first + i;
+	INIT_IDENTITY_MAP(&map, rdev, first + count, dev->blksize);
 
-	ssize_t r = bio_do_io(bio, iobuf, len, io_off, rw);
+	start_plug();
+	if (ra && rw == READ && ra_update(ra, first, first + count - 1,
+				dev->sectors*SECTOR_SIZE / dev->blksize,
+				&ra_start, &ra_end)) {
+		for (blkcnt_t b = ra_start; b < ra_end; b++)
+			readahead_block(rdev, b, dev->blksize);
+	}
+	ssize_t r = bio_do_io(&map, iobuf, len, *pos, rw);
+	finish_plug();
 	if (r > 0)
 		*pos += r;
-
-	free_bio_vec(bio);
 	return r;
 }
 
 ssize_t blkdev_read(dev_t dev, void *dst, size_t len, unsigned long pos)
 {
-	return blkdev_generic_io(dev, dst, len, &pos, READ);
+	return blkdev_generic_io(dev, dst, len, &pos, READ, NULL);
 }
 
 ssize_t blkdev_write(dev_t dev, void *src, size_t len, unsigned long pos)
 {
-	return blkdev_generic_io(dev, src, len, &pos, WRITE);
+	return blkdev_generic_io(dev, src, len, &pos, WRITE, NULL);
 }
 
 static ssize_t blkdev_generic_read(struct file *f, char *dst, size_t len,
 		unsigned long *pos)
 {
-	return blkdev_generic_io(f->f_rdev, dst, len, pos, READ);
+	return blkdev_generic_io(f->f_rdev, dst, len, pos, READ, &f->f_ra);
 }
 
 static ssize_t blkdev_generic_write(struct file *f, const char *src, size_t len,
 		unsigned long *pos)
 {
-	return blkdev_generic_io(f->f_rdev, (char*)src, len, pos, WRITE);
+	return blkdev_generic_io(f->f_rdev, (char*)src, len, pos, WRITE, NULL);
+}
+
+static int blkdev_getstats(struct block_device *dev, struct blkdev_stats *stats)
+{
+	if (vm_verify(&current->mm, stats, sizeof(*stats), VM_WRITE))
+		return -EFAULT;
+	*stats = dev->stats;
+	return 0;
+}
+
+int blkdev_generic_ioctl(struct inode *inode, struct file *file,
+		unsigned int cmd, unsigned long arg)
+{
+	struct block_device *dev = get_device(inode->i_rdev);
+	if (!dev)
+		return -ENXIO;
+
+	switch (cmd) {
+	case BLKGETSCHED:
+		return elevator_id(dev);
+	case BLKSETSCHED:
+		return elevator_switch(dev, arg);
+	case BLKGETSTATS:
+		return blkdev_getstats(dev, (struct blkdev_stats*) arg);
+	}
+	return -EINVAL;
 }
 
 int blkdev_generic_open(struct inode *inode, struct file *file)
@@ -291,6 +640,7 @@ struct file_operations blkdev_generic_fops = {
 	.read = blkdev_generic_read,
 	.write = blkdev_generic_write,
 	.open = blkdev_generic_open,
+	.ioctl = blkdev_generic_ioctl,
 };
 
 void register_block_driver(unsigned int major, const char *name,
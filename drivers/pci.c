@@ -0,0 +1,101 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <kernel/i386.h>
+#include <kernel/drivers/pci.h>
+
+/*
+ * PCI configuration space access (configuration mechanism #1).  This is just
+ * enough to locate devices by class and program their command register and
+ * BARs; there is no device tree or resource allocation.
+ */
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+#define PCI_MAX_BUS  256
+#define PCI_MAX_SLOT 32
+#define PCI_MAX_FUNC 8
+
+static unsigned long config_address(unsigned int bus, unsigned int slot,
+		unsigned int func, unsigned int off)
+{
+	return 0x80000000UL | (bus << 16) | (slot << 11) | (func << 8)
+		| (off & 0xFC);
+}
+
+static unsigned long read_config(unsigned int bus, unsigned int slot,
+		unsigned int func, unsigned int off)
+{
+	outl(PCI_CONFIG_ADDRESS, config_address(bus, slot, func, off));
+	return inl(PCI_CONFIG_DATA);
+}
+
+unsigned long pci_read_config(struct pci_dev *dev, unsigned int off)
+{
+	return read_config(dev->bus, dev->slot, dev->func, off);
+}
+
+void pci_write_config(struct pci_dev *dev, unsigned int off, unsigned long val)
+{
+	outl(PCI_CONFIG_ADDRESS, config_address(dev->bus, dev->slot, dev->func,
+				off));
+	outl(PCI_CONFIG_DATA, val);
+}
+
+/*
+ * Finds the first function with the given class and subclass.  Returns 0 and
+ * fills in @dev if one is found, or -ENODEV otherwise.
+ */
+int pci_find_class(unsigned char class, unsigned char subclass,
+		struct pci_dev *dev)
+{
+	for (unsigned int bus = 0; bus < PCI_MAX_BUS; bus++) {
+		for (unsigned int slot = 0; slot < PCI_MAX_SLOT; slot++) {
+			for (unsigned int func = 0; func < PCI_MAX_FUNC; func++) {
+				unsigned long id, cr;
+
+				id = read_config(bus, slot, func, PCI_VENDOR_ID);
+				if ((id & 0xFFFF) == 0xFFFF) {
+					if (func == 0)
+						break;
+					continue;
+				}
+				cr = read_config(bus, slot, func, PCI_CLASS_REVISION);
+				if ((cr >> 24) == class && ((cr >> 16) & 0xFF) == subclass) {
+					*dev = (struct pci_dev) {
+						.bus      = bus,
+						.slot     = slot,
+						.func     = func,
+						.vendor   = id & 0xFFFF,
+						.device   = id >> 16,
+						.class    = class,
+						.subclass = subclass,
+						.prog_if  = (cr >> 8) & 0xFF,
+					};
+					return 0;
+				}
+				// single-function device
+				if (func == 0 && !(read_config(bus, slot, 0,
+							PCI_HEADER_TYPE) & 0x800000))
+					break;
+			}
+		}
+	}
+	return -ENODEV;
+}
@@ -0,0 +1,263 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <kernel/fs.h>
+#include <kernel/mm/kmalloc.h>
+#include <kernel/mm/slab.h>
+#include <string.h>
+
+/*
+ * Block maps.
+ *
+ * A block map translates a file's logical block numbers to device blocks.
+ * Rather than flattening the whole block list when the inode is read, the map
+ * caches runs of contiguous blocks (extents) in a sorted array, and asks the
+ * filesystem to map a new run whenever a lookup misses.  The cost of a map is
+ * therefore proportional to the number of discontiguous runs in the parts of
+ * the file which have actually been accessed.
+ */
+
+#define MIN_EXTENTS 4
+
+static DEFINE_SLAB_CACHE(block_map_cachep, sizeof(struct block_map));
+
+struct block_map *alloc_block_map(dev_t dev, blkcnt_t blkcnt,
+		blksize_t blksize,
+		int (*get_extent)(struct block_map *, blkcnt_t, struct extent *),
+		void *private)
+{
+	struct block_map *map = slab_alloc(block_map_cachep);
+	if (!map)
+		return NULL;
+	INIT_IDENTITY_MAP(map, dev, blkcnt, blksize);
+	map->get_extent = get_extent;
+	map->private = private;
+	return map;
+}
+
+void free_block_map(struct block_map *map)
+{
+	if (map->extents)
+		kfree(map->extents);
+	slab_free(block_map_cachep, map);
+}
+
+/*
+ * Drop all cached extents, e.g. after the underlying block list has changed.
+ */
+void block_map_invalidate(struct block_map *map)
+{
+	map->nr_extents = 0;
+	map->hint = 0;
+}
+
+/*
+ * Change the number of logical blocks in the map, dropping any cached extents
+ * beyond the new end.
+ */
+void block_map_resize(struct block_map *map, blkcnt_t blkcnt)
+{
+	while (map->nr_extents) {
+		struct extent *last = &map->extents[map->nr_extents-1];
+		if (last->lblk + last->len <= blkcnt)
+			break;
+		if (last->lblk < blkcnt) {
+			last->len = blkcnt - last->lblk;
+			break;
+		}
+		map->nr_extents--;
+	}
+	map->hint = 0;
+	map->blkcnt = blkcnt;
+}
+
+/*
+ * Returns the index of the last extent starting at or before @lblk, or -1 if
+ * there is none.
+ */
+static int extent_search(struct block_map *map, blkcnt_t lblk)
+{
+	int lo = 0, hi = map->nr_extents - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (map->extents[mid].lblk <= lblk)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
+
+static bool extent_contains(struct extent *ext, blkcnt_t lblk)
+{
+	return lblk >= ext->lblk && lblk < ext->lblk + ext->len;
+}
+
+/* can @b be appended to @a? */
+static bool extent_adjacent(struct extent *a, struct extent *b)
+{
+	if (a->lblk + a->len != b->lblk)
+		return false;
+	if (!a->pblk || !b->pblk)
+		return !a->pblk && !b->pblk;
+	return a->pblk + a->len == b->pblk;
+}
+
+static int extent_grow(struct block_map *map)
+{
+	unsigned int max = map->max_extents ? map->max_extents * 2 : MIN_EXTENTS;
+	struct extent *extents = kmalloc(max * sizeof(struct extent));
+
+	if (!extents)
+		return -ENOMEM;
+	if (map->extents) {
+		memcpy(extents, map->extents,
+				map->nr_extents * sizeof(struct extent));
+		kfree(map->extents);
+	}
+	map->extents = extents;
+	map->max_extents = max;
+	return 0;
+}
+
+/*
+ * Insert a newly mapped extent, which doesn't overlap any cached extent,
+ * merging it with its neighbours where possible.  Returns the index of the
+ * extent containing ext->lblk.
+ */
+static int extent_insert(struct block_map *map, struct extent *ext)
+{
+	int i = extent_search(map, ext->lblk) + 1;
+
+	if (i > 0 && extent_adjacent(&map->extents[i-1], ext)) {
+		map->extents[i-1].len += ext->len;
+		if ((unsigned) i < map->nr_extents
+				&& extent_adjacent(&map->extents[i-1], &map->extents[i])) {
+			map->extents[i-1].len += map->extents[i].len;
+			map->nr_extents--;
+			for (unsigned int j = i; j < map->nr_extents; j++)
+				map->extents[j] = map->extents[j+1];
+		}
+		return i - 1;
+	}
+	if ((unsigned) i < map->nr_extents
+			&& extent_adjacent(ext, &map->extents[i])) {
+		map->extents[i].lblk = ext->lblk;
+		map->extents[i].len += ext->len;
+		if (map->extents[i].pblk)
+			map->extents[i].pblk = ext->pblk;
+		return i;
+	}
+
+	// not cached if out of memory; the mapping is still returned
+	if (map->nr_extents == map->max_extents && extent_grow(map) < 0)
+		return -1;
+	for (unsigned int j = map->nr_extents; j > (unsigned) i; j--)
+		map->extents[j] = map->extents[j-1];
+	map->extents[i] = *ext;
+	map->nr_extents++;
+	return i;
+}
+
+static void extent_remove(struct block_map *map, unsigned int i)
+{
+	map->nr_extents--;
+	for (; i < map->nr_extents; i++)
+		map->extents[i] = map->extents[i+1];
+}
+
+/*
+ * Map a logical block.  Returns the device block (0 for a hole in a
+ * filesystem map) and stores in *len the number of blocks, starting at @lblk,
+ * which are mapped contiguously.  Returns a negative error code if the block
+ * can't be mapped.
+ */
+blkcnt_t bmap(struct block_map *map, blkcnt_t lblk, blkcnt_t *len)
+{
+	struct extent ext, *cached;
+	int i, error;
+
+	if (lblk < 0 || lblk >= map->blkcnt)
+		return -EINVAL;
+
+	if (!map->get_extent) {
+		*len = map->blkcnt - lblk;
+		return lblk;
+	}
+
+	// sequential access usually hits the last extent used
+	if (map->hint < map->nr_extents
+			&& extent_contains(&map->extents[map->hint], lblk)) {
+		cached = &map->extents[map->hint];
+		goto found;
+	}
+	i = extent_search(map, lblk);
+	if (i >= 0 && extent_contains(&map->extents[i], lblk)) {
+		map->hint = i;
+		cached = &map->extents[i];
+		goto found;
+	}
+
+	if ((error = map->get_extent(map, lblk, &ext)) < 0)
+		return error;
+	// don't let the new extent overlap the next cached one
+	if ((unsigned) (i + 1) < map->nr_extents)
+		ext.len = MIN(ext.len, map->extents[i+1].lblk - lblk);
+	ext.len = MIN(ext.len, map->blkcnt - lblk);
+	if ((i = extent_insert(map, &ext)) < 0) {
+		*len = ext.len;
+		return ext.pblk;
+	}
+	map->hint = i;
+	cached = &map->extents[i];
+found:
+	*len = cached->lblk + cached->len - lblk;
+	if (!cached->pblk)
+		return 0;
+	return cached->pblk + (lblk - cached->lblk);
+}
+
+/*
+ * Allocate a device block for a hole at logical block @lblk.  The cached hole
+ * extent containing @lblk (if any) is dropped, since the rest of the hole is
+ * cheap to map again.  Returns the new device block, or a negative error
+ * code.
+ */
+blkcnt_t bmap_alloc(struct block_map *map, blkcnt_t lblk)
+{
+	struct extent ext;
+	blkcnt_t pblk;
+	int i;
+
+	if (!map->alloc_block)
+		return -EIO;
+	if (lblk < 0 || lblk >= map->blkcnt)
+		return -EINVAL;
+	if ((pblk = map->alloc_block(map, lblk)) < 0)
+		return pblk;
+
+	i = extent_search(map, lblk);
+	if (i >= 0 && extent_contains(&map->extents[i], lblk))
+		extent_remove(map, i);
+
+	ext = (struct extent) { .lblk = lblk, .pblk = pblk, .len = 1 };
+	if ((i = extent_insert(map, &ext)) >= 0)
+		map->hint = i;
+	return pblk;
+}
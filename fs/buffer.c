@@ -15,8 +15,11 @@
  *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <kernel/cmdline.h>
 #include <kernel/fs.h>
 #include <kernel/hashtable.h>
+#include <kernel/multiboot.h>
+#include <kernel/time.h>
 #include <kernel/mm/paging.h>
 #include <telos/major.h>
 
@@ -27,16 +30,67 @@
  * device code (the other half is in drivers/block/rw_block.c).
  */
 
+static u32 buffer_hash_key(struct hlist_node *node);
+
 /*
  * Hash table storing all active/cached buffers.
  */
-static DEFINE_HASHTABLE(ht_blocks, 9);
+static DEFINE_HTABLE(ht_blocks, 9, buffer_hash_key);
 
 static DEFINE_SLAB_CACHE(buffer_cachep, sizeof(struct buffer));
 
-static long buffer_key(dev_t dev, blkcnt_t block, blksize_t size)
+/*
+ * Unreferenced buffers are kept on an LRU list, least recently used first.
+ * When the number of cached buffers reaches buffer_cache_max, buffers are
+ * evicted from the head of this list (dirty buffers are written back before
+ * being freed).
+ */
+static LIST_HEAD(buffer_lru);
+static unsigned long nr_buffers;
+static unsigned long buffer_cache_max;
+
+/* default cap: 1/BUFFER_CACHE_RATIO of physical memory */
+#define BUFFER_CACHE_RATIO 8
+#define BUFFER_CACHE_MIN   64
+
+/*
+ * Dirty buffers are kept on a list in the order they were dirtied, so that
+ * the write-back daemon can find buffers which have been dirty for too long.
+ */
+static LIST_HEAD(dirty_buffers);
+static unsigned long nr_dirty;
+
+/* percentage of the cache which may be dirty before write-back is forced */
+#define DIRTY_RATIO 40
+
+static unsigned long shrink_buffer_cache(unsigned long nr);
+
+static struct shrinker buffer_shrinker = {
+	.shrink = shrink_buffer_cache,
+};
+
+SYSINIT(buffer_cache, SUB_VFS)
 {
-	return dev+block;
+	unsigned long frames = MULTIBOOT_MEM_MAX(mb_info) / FRAME_SIZE;
+	buffer_cache_max = MAX(frames / BUFFER_CACHE_RATIO, BUFFER_CACHE_MIN);
+	if (!cmdline_ulong("bcache", &frames))
+		set_buffer_cache_max(frames);
+	register_shrinker(&buffer_shrinker);
+}
+
+/*
+ * The device number is mixed before being combined with the block number, so
+ * that the same blocks on different devices don't collide.
+ */
+static u32 buffer_key(dev_t dev, blkcnt_t block)
+{
+	return hash_32(dev, 32) ^ hash_long(block, 32);
+}
+
+static u32 buffer_hash_key(struct hlist_node *node)
+{
+	struct buffer *b = hlist_entry(node, struct buffer, b_hash);
+	return buffer_key(b->b_dev, b->b_blocknr);
 }
 
 /*
@@ -45,8 +99,8 @@ static long buffer_key(dev_t dev, blkcnt_t block, blksize_t size)
 static struct buffer *find_buffer(dev_t dev, blkcnt_t block, blksize_t size)
 {
 	struct buffer *buffer;
-	long key = buffer_key(dev, block, size);
-	hash_for_each_possible(ht_blocks, buffer, b_hash, key) {
+	u32 key = buffer_key(dev, block);
+	htable_for_each_possible(&ht_blocks, buffer, b_hash, key) {
 		if (buffer->b_dev == dev && buffer->b_blocknr == block) {
 			if (buffer->b_size == size)
 				return buffer;
@@ -58,12 +112,272 @@ static struct buffer *find_buffer(dev_t dev, blkcnt_t block, blksize_t size)
 	return NULL;
 }
 
+/*
+ * Take a reference to a buffer, removing it from the LRU list.
+ */
+static void hold_buffer(struct buffer *buf)
+{
+	if (buf->b_count++ == 0)
+		list_del_init(&buf->b_lru);
+}
+
+/*
+ * Drop a reference to a buffer.  Unreferenced buffers go to the tail of the
+ * LRU list, where they remain cached until evicted.
+ */
+void release_buffer(struct buffer *buf)
+{
+	if (!buf)
+		return;
+	if (--buf->b_count == 0)
+		list_add_tail(&buf->b_lru, &buffer_lru);
+}
+
+bool buffers_over_dirty_limit(void)
+{
+	return nr_dirty * 100 >= buffer_cache_max * DIRTY_RATIO;
+}
+
+/*
+ * Mark a buffer as modified.  The buffer will be written back by the
+ * write-back daemon after it has been dirty for a while, or sooner if too much
+ * of the cache is dirty.
+ */
+void mark_buffer_dirty(struct buffer *buf)
+{
+	if (buf->b_flags & BUF_DIRTY)
+		return;
+	buf->b_flags |= BUF_DIRTY;
+	buf->b_dirtied = tick_count;
+	list_add_tail(&buf->b_dirty, &dirty_buffers);
+	nr_dirty++;
+	if (buffers_over_dirty_limit())
+		wakeup_bdflush();
+}
+
+static void clear_buffer_dirty(struct buffer *buf)
+{
+	buf->b_flags &= ~BUF_DIRTY;
+	list_del(&buf->b_dirty);
+	nr_dirty--;
+}
+
+/*
+ * Flush any writes to a buffer to disk.
+ */
+static void flush_buffer(struct buffer *buffer)
+{
+	if (!(buffer->b_flags & BUF_DIRTY))
+		return;
+	hold_buffer(buffer);
+	clear_buffer_dirty(buffer);
+	submit_block(WRITE, buffer);
+	buffer_wait(buffer);
+	release_buffer(buffer);
+}
+
+/*
+ * Batched write-back.  Buffers are taken off the dirty list and inserted into
+ * a private list in (device, block) order, so that adjacent blocks are
+ * submitted back to back.  All writes are submitted before waiting on any of
+ * them.
+ */
+static void queue_writeback(struct list_head *list, struct buffer *buf)
+{
+	struct buffer *pos;
+
+	hold_buffer(buf);
+	clear_buffer_dirty(buf);
+	list_for_each_entry(pos, list, b_chain) {
+		if (pos->b_dev > buf->b_dev || (pos->b_dev == buf->b_dev &&
+					pos->b_blocknr > buf->b_blocknr))
+			break;
+	}
+	list_add_tail(&buf->b_chain, &pos->b_chain);
+}
+
+/*
+ * Completion of asynchronous write-back: failed writes are re-dirtied so that
+ * they are retried later.
+ */
+static void writeback_end_io(struct buffer *buf, void *data)
+{
+	if (buf->b_flags & BUF_ERROR)
+		mark_buffer_dirty(buf);
+	release_buffer(buf);
+}
+
+static void submit_writeback(struct list_head *list, bool wait)
+{
+	struct buffer *buf, *tmp;
+
+	start_plug();
+	list_for_each_entry_safe(buf, tmp, list, b_chain) {
+		if (wait) {
+			submit_block(WRITE, buf);
+		} else {
+			list_del(&buf->b_chain);
+			submit_block_async(WRITE, buf, writeback_end_io, NULL);
+		}
+	}
+	finish_plug();
+	if (!wait)
+		return;
+	list_for_each_entry_safe(buf, tmp, list, b_chain) {
+		buffer_wait(buf);
+		list_del(&buf->b_chain);
+		release_buffer(buf);
+	}
+}
+
+static void __writeback_buffers(unsigned long age, bool wait)
+{
+	struct buffer *buf, *tmp;
+	LIST_HEAD(list);
+
+	list_for_each_entry_safe(buf, tmp, &dirty_buffers, b_dirty) {
+		if (tick_count - buf->b_dirtied < age)
+			break;
+		queue_writeback(&list, buf);
+	}
+	submit_writeback(&list, wait);
+}
+
+/*
+ * Start write-back of buffers which have been dirty for at least @age ticks.
+ * Does not wait for the writes to complete.
+ */
+void writeback_buffers(unsigned long age)
+{
+	__writeback_buffers(age, false);
+}
+
+/*
+ * Write back all dirty buffers, and wait for the writes to complete.
+ */
+void sync_buffers(void)
+{
+	__writeback_buffers(0, true);
+}
+
+/*
+ * Write back all dirty buffers belonging to a given device.
+ */
+int fsync_dev(dev_t dev)
+{
+	struct buffer *buf, *tmp;
+	LIST_HEAD(list);
+
+	list_for_each_entry_safe(buf, tmp, &dirty_buffers, b_dirty) {
+		if (buf->b_dev == dev)
+			queue_writeback(&list, buf);
+	}
+	submit_writeback(&list, true);
+	return 0;
+}
+
+/*
+ * Write back any dirty buffers for the blocks in a block map.  Only mapped
+ * extents are considered: blocks which were never mapped can't have been
+ * written through the map.
+ */
+int fsync_block_map(struct block_map *map)
+{
+	struct buffer *buf;
+	LIST_HEAD(list);
+
+	for (unsigned int i = 0; i < map->nr_extents; i++) {
+		struct extent *ext = &map->extents[i];
+		if (!ext->pblk)
+			continue;
+		for (blkcnt_t j = 0; j < ext->len; j++) {
+			buf = find_buffer(map->dev, ext->pblk + j, map->blksize);
+			if (buf && buf->b_flags & BUF_DIRTY)
+				queue_writeback(&list, buf);
+		}
+	}
+	submit_writeback(&list, true);
+	return 0;
+}
+
+static void free_buffer(struct buffer *buffer)
+{
+	if (buffer->b_count)
+		panic("tried to free referenced buffer");
+	if (buffer->b_flags & BUF_DIRTY)
+		clear_buffer_dirty(buffer);
+	list_del(&buffer->b_lru);
+	htable_del(&ht_blocks, &buffer->b_hash);
+	kfree_pages(buffer->b_data, 1);
+	slab_free(buffer_cachep, buffer);
+	nr_buffers--;
+}
+
+/*
+ * Write back and free the least recently used buffer.  Returns -EBUSY if the
+ * buffer was referenced while it was being written back.
+ */
+static int evict_buffer(void)
+{
+	struct buffer *b;
+
+	if (list_empty(&buffer_lru))
+		return -ENOMEM;
+	b = list_first_entry(&buffer_lru, struct buffer, b_lru);
+	flush_buffer(b);
+	// someone may have found the buffer while we slept
+	if (b->b_count || b->b_flags & BUF_DIRTY)
+		return -EBUSY;
+	free_buffer(b);
+	return 0;
+}
+
+/*
+ * Free up to nr clean, unreferenced buffers.  This is called from the page
+ * allocator when it runs out of frames, so it must not sleep: dirty buffers
+ * are skipped.
+ */
+static unsigned long shrink_buffer_cache(unsigned long nr)
+{
+	struct buffer *b, *tmp;
+	unsigned long freed = 0;
+
+	list_for_each_entry_safe(b, tmp, &buffer_lru, b_lru) {
+		if (freed >= nr)
+			break;
+		if (b->b_flags & BUF_DIRTY)
+			continue;
+		free_buffer(b);
+		freed++;
+	}
+	return freed;
+}
+
+/*
+ * Set the maximum number of buffers kept in the cache, evicting buffers as
+ * needed to meet the new limit.
+ */
+int set_buffer_cache_max(unsigned long max)
+{
+	if (max < BUFFER_CACHE_MIN)
+		return -EINVAL;
+	buffer_cache_max = max;
+	while (nr_buffers > buffer_cache_max && !list_empty(&buffer_lru))
+		evict_buffer();
+	return 0;
+}
+
 /*
  * Allocate and initialize a buffer.
  */
 static struct buffer *make_buffer(dev_t dev, blkcnt_t block, blksize_t size)
 {
 	struct buffer *b;
+
+	// make room in the cache (if every buffer is in use, we go over)
+	while (nr_buffers >= buffer_cache_max && !list_empty(&buffer_lru))
+		evict_buffer();
+
 	if (!(b = slab_alloc(buffer_cachep)))
 		return NULL;
 	if (!(b->b_data = kalloc_pages(1))) {
@@ -76,8 +390,11 @@ static struct buffer *make_buffer(dev_t dev, blkcnt_t block, blksize_t size)
 	b->b_size = size;
 	b->b_count = 1;
 	b->b_lock = false;
+	b->b_end_io = NULL;
+	INIT_LIST_HEAD(&b->b_lru);
 	INIT_WAIT_QUEUE(&b->b_wait);
-	hash_add(ht_blocks, &b->b_hash, buffer_key(dev, block, size));
+	htable_add(&ht_blocks, &b->b_hash, buffer_key(dev, block));
+	nr_buffers++;
 	return b;
 }
 
@@ -85,11 +402,13 @@ static struct buffer *make_buffer(dev_t dev, blkcnt_t block, blksize_t size)
  * Get a buffer for a given device/block number, allocating one if the buffer
  * is not in the hash table.  The returned buffer may not be up to date.
  */
-static struct buffer *get_buffer(dev_t dev, blkcnt_t block, blksize_t size)
+struct buffer *get_buffer(dev_t dev, blkcnt_t block, blksize_t size)
 {
 	struct buffer *b;
-	if ((b = find_buffer(dev, block, size)))
+	if ((b = find_buffer(dev, block, size))) {
+		hold_buffer(b);
 		return b;
+	}
 	return make_buffer(dev, block, size);
 }
 
@@ -98,10 +417,15 @@ static struct buffer *get_buffer(dev_t dev, blkcnt_t block, blksize_t size)
  */
 static struct buffer *read_buffer(struct buffer *buffer)
 {
+	buffer_wait(buffer);
 	if (!(buffer->b_flags & BUF_UPTODATE)) {
 		submit_block(READ, buffer);
 		buffer_wait(buffer);
 	}
+	if (!(buffer->b_flags & BUF_UPTODATE)) {
+		release_buffer(buffer);
+		return NULL;
+	}
 	return buffer;
 }
 
@@ -116,56 +440,61 @@ struct buffer *read_block(dev_t dev, blkcnt_t block, blksize_t size)
 	return read_buffer(b);
 }
 
-/*
- * Flush any writes to a buffer to disk.
- */
-static void flush_buffer(struct buffer *buffer)
-{
-	if (!(buffer->b_flags & BUF_DIRTY))
-		return;
-	submit_block(WRITE, buffer);
-	buffer_wait(buffer);
-}
-
-static void free_buffer(struct buffer *buffer)
-{
-	if (buffer->b_count)
-		panic("tried to free referenced buffer");
-	kfree_pages(buffer->b_data, 1);
-	slab_free(buffer_cachep, buffer);
-	hash_del(&buffer->b_hash);
-}
-
 /*
  * Flush and free all buffers associated with a given device.
+ *
+ * Waiting on a buffer sleeps, and while we sleep the hash table may be resized
+ * and the buffers around the one we're waiting on may be evicted, so the scan
+ * starts over after anything that blocks.  Dirty buffers are written back in
+ * one batch first, so that this rarely happens.
  */
 int free_device_buffers(dev_t dev)
 {
-	unsigned bkt;
+	unsigned long bkt;
 	struct hlist_node *tmp;
 	struct buffer *buffer;
-	hash_for_each_safe(ht_blocks, bkt, tmp, buffer, b_hash) {
+
+	fsync_dev(dev);
+restart:
+	htable_for_each_safe(&ht_blocks, bkt, tmp, buffer, b_hash) {
 		if (buffer->b_dev != dev)
 			continue;
-		if (buffer->b_lock)
+		if (buffer->b_lock) {
+			hold_buffer(buffer);
 			buffer_wait(buffer);
+			release_buffer(buffer);
+			goto restart;
+		}
 		if (buffer->b_count)
 			return -EBUSY;
-		flush_buffer(buffer);
+		if (buffer->b_flags & BUF_DIRTY) {
+			flush_buffer(buffer);
+			goto restart;
+		}
 		free_buffer(buffer);
 	}
 	return 0;
 }
 
+/*
+ * Free all unreferenced buffers.  As in free_device_buffers(), the scan starts
+ * over after writing back a buffer.
+ */
 void clear_buffer_cache(void)
 {
-	unsigned i;
+	unsigned long i;
 	struct buffer *buffer;
 	struct hlist_node *tmp;
-	hash_for_each_safe(ht_blocks, i, tmp, buffer, b_hash) {
+
+	sync_buffers();
+restart:
+	htable_for_each_safe(&ht_blocks, i, tmp, buffer, b_hash) {
 		if (buffer->b_lock || buffer->b_count > 0)
 			continue;
-		flush_buffer(buffer);
+		if (buffer->b_flags & BUF_DIRTY) {
+			flush_buffer(buffer);
+			goto restart;
+		}
 		free_buffer(buffer);
 	}
 }
@@ -0,0 +1,201 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <kernel/fs.h>
+#include <kernel/hashtable.h>
+#include <kernel/list.h>
+#include <string.h>
+
+/*
+ * Directory name cache.
+ *
+ * Maps (super block, directory inode number, name) to the inode number the
+ * name refers to, or to nothing at all (a negative entry, recording that the
+ * name does not exist).  A hit lets path resolution skip the file system's
+ * lookup, which is typically a directory scan.
+ *
+ * There is a fixed pool of entries, recycled in LRU order.  Names longer than
+ * DCACHE_NAME_LEN are not cached.  Entries are invalidated by the VFS when a
+ * name is created or removed, when a directory is freed, and when a file
+ * system is unmounted.  Every invalidation bumps dcache_seq, so that the
+ * result of a lookup which slept while the directory changed is not cached.
+ */
+
+#define DCACHE_NAME_LEN  32
+#define DCACHE_SIZE      1024
+#define DCACHE_HASH_BITS 9
+
+struct dcache_entry {
+	struct hlist_node hash;
+	struct list_head lru;
+	struct super_block *sb;
+	ino_t dir;
+	ino_t ino; // 0 for a negative entry
+	unsigned char len;
+	char name[DCACHE_NAME_LEN];
+};
+
+static struct dcache_entry dcache[DCACHE_SIZE];
+static DEFINE_HASHTABLE(dcache_hash, DCACHE_HASH_BITS);
+static LIST_HEAD(dcache_lru); // least recently used first
+static unsigned long dcache_seq;
+
+SYSINIT(dcache, SUB_VFS)
+{
+	for (int i = 0; i < DCACHE_SIZE; i++) {
+		INIT_HLIST_NODE(&dcache[i].hash);
+		list_add_tail(&dcache[i].lru, &dcache_lru);
+	}
+}
+
+static u32 dcache_key(struct super_block *sb, ino_t dir, const char *name,
+		int len)
+{
+	return name_hash(hash32_ptr(sb) ^ (dir * GOLDEN_RATIO_PRIME_32), name,
+			len);
+}
+
+static struct dcache_entry *dcache_find(struct super_block *sb, ino_t dir,
+		const char *name, int len)
+{
+	struct dcache_entry *ent;
+
+	hash_for_each_possible(dcache_hash, ent, hash,
+			dcache_key(sb, dir, name, len)) {
+		if (ent->sb == sb && ent->dir == dir && ent->len == len
+				&& !memcmp(ent->name, name, len))
+			return ent;
+	}
+	return NULL;
+}
+
+static void dcache_free(struct dcache_entry *ent)
+{
+	hash_del(&ent->hash);
+	list_move(&ent->lru, &dcache_lru);
+}
+
+static inline bool dcache_name_ok(const char *name, int len)
+{
+	if (len > DCACHE_NAME_LEN)
+		return false;
+	// "." and ".." are cheap, and ".." changes when a directory moves
+	return !(name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')));
+}
+
+/*
+ * Look up @name in @dir.  Returns true on a hit, with the inode number (or 0
+ * for a negative entry) in *@ino.
+ */
+bool dcache_lookup(struct inode *dir, const char *name, int len, ino_t *ino)
+{
+	struct dcache_entry *ent;
+
+	if (!dcache_name_ok(name, len))
+		return false;
+	if (!(ent = dcache_find(dir->i_sb, dir->i_ino, name, len)))
+		return false;
+	list_move_tail(&ent->lru, &dcache_lru);
+	*ino = ent->ino;
+	return true;
+}
+
+/*
+ * Return the current invalidation sequence number.  A lookup samples this
+ * before calling into the file system and passes it to dcache_add.
+ */
+unsigned long dcache_sequence(void)
+{
+	return dcache_seq;
+}
+
+/*
+ * Record the result of a lookup of @name in the directory (@sb, @dir): the
+ * inode @inode, or a negative entry if @inode is NULL.  Nothing is cached if
+ * the directory may have changed since @seq was sampled.
+ */
+void dcache_add(struct super_block *sb, ino_t dir, const char *name, int len,
+		struct inode *inode, unsigned long seq)
+{
+	struct dcache_entry *ent;
+	ino_t ino = 0;
+
+	if (seq != dcache_seq || !dcache_name_ok(name, len))
+		return;
+	if (inode) {
+		// a mount point: cache the covered inode, which iget will cross
+		if (inode->i_sb != sb) {
+			struct inode *covered = inode->i_sb->s_covered;
+			if (inode != inode->i_sb->s_mounted || !covered
+					|| covered->i_sb != sb)
+				return;
+			inode = covered;
+		}
+		ino = inode->i_ino;
+	}
+
+	if (!(ent = dcache_find(sb, dir, name, len))) {
+		ent = list_first_entry(&dcache_lru, struct dcache_entry, lru);
+		hash_del(&ent->hash);
+		ent->sb = sb;
+		ent->dir = dir;
+		ent->len = len;
+		memcpy(ent->name, name, len);
+		hash_add(dcache_hash, &ent->hash, dcache_key(sb, dir, name, len));
+	}
+	ent->ino = ino;
+	list_move_tail(&ent->lru, &dcache_lru);
+}
+
+/*
+ * Forget @name in the directory (@sb, @dir), after it has been created,
+ * removed or renamed.
+ */
+void dcache_remove(struct super_block *sb, ino_t dir, const char *name,
+		int len)
+{
+	struct dcache_entry *ent;
+
+	dcache_seq++;
+	if (len <= DCACHE_NAME_LEN && (ent = dcache_find(sb, dir, name, len)))
+		dcache_free(ent);
+}
+
+/*
+ * Forget every entry in the directory (@sb, @dir), which is being freed.
+ */
+void dcache_purge_dir(struct super_block *sb, ino_t dir)
+{
+	dcache_seq++;
+	for (int i = 0; i < DCACHE_SIZE; i++) {
+		if (hash_hashed(&dcache[i].hash) && dcache[i].sb == sb
+				&& dcache[i].dir == dir)
+			dcache_free(&dcache[i]);
+	}
+}
+
+/*
+ * Forget every entry for a file system, which is being unmounted.
+ */
+void dcache_purge_sb(struct super_block *sb)
+{
+	dcache_seq++;
+	for (int i = 0; i < DCACHE_SIZE; i++) {
+		if (hash_hashed(&dcache[i].hash) && dcache[i].sb == sb)
+			dcache_free(&dcache[i]);
+	}
+}
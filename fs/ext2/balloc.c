@@ -0,0 +1,252 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <kernel/bitmap.h>
+#include <kernel/fs.h>
+#include <telos/stat.h>
+#include "ext2.h"
+
+/*
+ * Block allocation.
+ *
+ * Blocks are allocated near a goal block chosen by the caller (normally the
+ * block following the file's previous block, or the start of the inode's
+ * group), so that files are laid out contiguously where possible.  When a
+ * regular file allocates a block, up to prealloc_blocks further free blocks
+ * following it are reserved for the file; sequential writes then consume the
+ * reserved blocks without touching the bitmaps.  Unused reserved blocks are
+ * returned when the file is closed or truncated, or when an allocation misses
+ * the reserved window.
+ */
+
+/* how far past the goal a free block is still considered "near" */
+#define EXT2_GOAL_WINDOW 64
+
+static unsigned long block_group(struct ext2_superblock *sb, blkcnt_t block)
+{
+	return (block - sb->first_data_block) / sb->blocks_per_group;
+}
+
+static unsigned long block_index(struct ext2_superblock *sb, blkcnt_t block)
+{
+	return (block - sb->first_data_block) % sb->blocks_per_group;
+}
+
+/* the last group may be shorter than blocks_per_group */
+static unsigned long group_blocks(struct ext2_superblock *sb,
+		unsigned long group)
+{
+	unsigned long first = group * sb->blocks_per_group + sb->first_data_block;
+	return MIN(sb->blocks_per_group, sb->blocks_count - first);
+}
+
+/*
+ * Find a free block in a group's bitmap.  A free block within
+ * EXT2_GOAL_WINDOW of @goal is preferred, followed by the start of a free
+ * word (i.e. a run of free blocks) after the goal, followed by any free block.
+ */
+static long find_free_block(unsigned long *bitmap, unsigned long nbits,
+		long goal)
+{
+	unsigned long words = (nbits + BITS_PER_LONG - 1) / BITS_PER_LONG;
+	long bit = -1;
+
+	if (goal >= 0) {
+		if (!bitmap_test(bitmap, goal))
+			return goal;
+		bit = bitmap_ffz_from(bitmap, words, goal);
+		if (bit >= 0 && bit - goal < EXT2_GOAL_WINDOW)
+			return bit;
+	}
+	for (unsigned long w = goal > 0 ? goal / BITS_PER_LONG : 0; w < words; w++) {
+		if (!bitmap[w])
+			return w * BITS_PER_LONG;
+	}
+	if (bit < 0)
+		bit = bitmap_ffz(bitmap, words);
+	return bit;
+}
+
+/*
+ * Allocate a block in @group, plus up to *@count - 1 free blocks directly
+ * following it.  Returns the block's index within the group and stores the
+ * number of blocks allocated in *@count, or returns -1 if the group is full.
+ */
+static long alloc_in_group(struct super_block *vsb, unsigned long group,
+		long goal, unsigned int *count)
+{
+	struct ext2_superblock *sb = ext2_superblock(vsb);
+	unsigned long nbits = group_blocks(sb, group);
+	struct buffer *gbuf, *bbuf;
+	struct ext2_bg_descriptor *gd = ext2_group_desc(vsb, group, &gbuf);
+	unsigned long *bitmap;
+	unsigned int n;
+	long bit;
+
+	if (!gd->free_blocks_count)
+		return -1;
+	if (!(bbuf = read_block(vsb->s_dev, gd->block_bitmap,
+					ext2_block_size(sb))))
+		return -1;
+	bitmap = bbuf->b_data;
+
+	bit = find_free_block(bitmap, nbits, goal);
+	if (bit < 0 || (unsigned long) bit >= nbits) {
+		release_buffer(bbuf);
+		return -1;
+	}
+
+	bitmap_set(bitmap, bit);
+	for (n = 1; n < *count && bit + n < nbits; n++) {
+		if (bitmap_test(bitmap, bit + n))
+			break;
+		bitmap_set(bitmap, bit + n);
+	}
+	*count = n;
+
+	gd->free_blocks_count -= n;
+	sb->free_blocks_count -= n;
+	mark_buffer_dirty(bbuf);
+	mark_buffer_dirty(gbuf);
+	ext2_mark_sb_dirty(vsb);
+	release_buffer(bbuf);
+	return bit;
+}
+
+static unsigned int prealloc_size(struct super_block *vsb, struct inode *vnode)
+{
+	struct ext2_superblock *sb = ext2_superblock(vsb);
+
+	if (S_ISDIR(vnode->i_mode)) {
+		if (sb->feature_compat & EXT2_FEATURE_COMPAT_DIR_PREALLOC)
+			return sb->prealloc_dir_blocks;
+		return 0;
+	}
+	return sb->prealloc_blocks ? sb->prealloc_blocks
+		: EXT2_DEFAULT_PREALLOC_BLOCKS;
+}
+
+/*
+ * Allocate a block for @vnode, as close to @goal as possible.  Returns the
+ * block number, or -ENOSPC.
+ */
+blkcnt_t ext2_new_block(struct inode *vnode, blkcnt_t goal)
+{
+	struct super_block *vsb = vnode->i_sb;
+	struct ext2_superblock *sb = ext2_superblock(vsb);
+	struct ext2_sb_private *sbp = vsb->s_private;
+	struct ext2_inode_private *private = vnode->i_private;
+	unsigned long group;
+
+	if (private->prealloc_count) {
+		if (private->prealloc_block == goal) {
+			private->prealloc_block++;
+			private->prealloc_count--;
+			private->inode->blocks += ext2_block_sectors(sb);
+			return goal;
+		}
+		ext2_discard_prealloc(vnode);
+	}
+
+	if (goal < (blkcnt_t) sb->first_data_block
+			|| goal >= (blkcnt_t) sb->blocks_count)
+		goal = sb->first_data_block + sb->blocks_per_group
+			* ((vnode->i_ino - 1) / sb->inodes_per_group);
+	group = block_group(sb, goal);
+
+	for (unsigned long i = 0; i < sbp->nr_groups; i++) {
+		unsigned long g = (group + i) % sbp->nr_groups;
+		unsigned int count = 1 + prealloc_size(vsb, vnode);
+		long bit = alloc_in_group(vsb, g, i ? -1 : (long) block_index(sb, goal),
+				&count);
+		blkcnt_t block;
+
+		if (bit < 0)
+			continue;
+		block = sb->first_data_block + g * sb->blocks_per_group + bit;
+		if (count > 1) {
+			private->prealloc_block = block + 1;
+			private->prealloc_count = count - 1;
+		}
+		private->inode->blocks += ext2_block_sectors(sb);
+		return block;
+	}
+	return -ENOSPC;
+}
+
+/*
+ * Return @count blocks starting at @block to the free pool.  The caller is
+ * responsible for adjusting the owning inode's block count.
+ */
+void ext2_free_blocks(struct super_block *vsb, blkcnt_t block,
+		unsigned long count)
+{
+	struct ext2_superblock *sb = ext2_superblock(vsb);
+	struct buffer *bbuf = NULL, *gbuf = NULL;
+	struct ext2_bg_descriptor *gd = NULL;
+	unsigned long group = ~0UL;
+
+	if (block < (blkcnt_t) sb->first_data_block
+			|| block + count > sb->blocks_count) {
+		warn("ext2: freeing blocks outside of file system");
+		return;
+	}
+
+	for (unsigned long i = 0; i < count; i++, block++) {
+		if (block_group(sb, block) != group) {
+			if (bbuf) {
+				mark_buffer_dirty(bbuf);
+				mark_buffer_dirty(gbuf);
+				release_buffer(bbuf);
+			}
+			group = block_group(sb, block);
+			gd = ext2_group_desc(vsb, group, &gbuf);
+			bbuf = read_block(vsb->s_dev, gd->block_bitmap,
+					ext2_block_size(sb));
+			if (!bbuf)
+				return;
+		}
+		if (!bitmap_test(bbuf->b_data, block_index(sb, block))) {
+			warn("ext2: freeing free block %ld", block);
+			continue;
+		}
+		bitmap_clear(bbuf->b_data, block_index(sb, block));
+		gd->free_blocks_count++;
+		sb->free_blocks_count++;
+	}
+	if (bbuf) {
+		mark_buffer_dirty(bbuf);
+		mark_buffer_dirty(gbuf);
+		release_buffer(bbuf);
+	}
+	ext2_mark_sb_dirty(vsb);
+}
+
+/*
+ * Return any blocks preallocated for @vnode.
+ */
+void ext2_discard_prealloc(struct inode *vnode)
+{
+	struct ext2_inode_private *private = vnode->i_private;
+
+	if (!private->prealloc_count)
+		return;
+	ext2_free_blocks(vnode->i_sb, private->prealloc_block,
+			private->prealloc_count);
+	private->prealloc_count = 0;
+}
@@ -16,61 +16,437 @@
  */
 
 #include <kernel/fs.h>
+#include <kernel/time.h>
+#include <telos/stat.h>
 #include <string.h>
 #include "ext2.h"
 
 /*
- * If @dst is NULL, get the first dirent in @dir.  Otherwise get the dirent
- * after @dst.  If @dst is the last dirent, NULL is returned.
+ * Directory blocks.  Entries are manipulated in place in the buffer cache,
+ * one directory block at a time.  Entries never span blocks: the last entry
+ * in each block has a rec_len reaching to the end of the block.
  */
-static struct ext2_dirent *next_dirent(struct inode *dir, unsigned long *off,
-		struct ext2_dirent *dst)
+
+#define dirent_at(buf, off) \
+	((struct ext2_dirent*)((char*)(buf)->b_data + (off)))
+
+static inline bool dirent_match(struct ext2_dirent *de, const char *name,
+		int len)
+{
+	return de->ino && de->name_len == len && !memcmp(de->name, name, len);
+}
+
+/*
+ * Search a directory block for the entry @name.  If found, the offsets of the
+ * entry and its predecessor (or -1 if it is the first in the block) are
+ * returned in *@res_off and *@res_prev.
+ */
+bool ext2_search_dirblock(struct buffer *buf, blksize_t blksize,
+		const char *name, int len, long *res_off, long *res_prev)
+{
+	long prev = -1;
+
+	for (long off = 0; off < blksize; ) {
+		struct ext2_dirent *de = dirent_at(buf, off);
+		if (de->rec_len < 8 || off + de->rec_len > blksize)
+			break;
+		if (dirent_match(de, name, len)) {
+			*res_off = off;
+			*res_prev = prev;
+			return true;
+		}
+		prev = off;
+		off += de->rec_len;
+	}
+	return false;
+}
+
+/*
+ * Find the entry @name in @dir.  On success, the buffer holding the entry is
+ * returned in *@res_buf, along with the offsets of the entry and the entry
+ * preceding it in the same block.  Indexed directories are searched through
+ * the index; others are scanned block by block.
+ */
+static int ext2_find_entry(struct inode *dir, const char *name, int len,
+		struct buffer **res_buf, long *res_off, long *res_prev)
 {
-	do {
-		if (*off >= dir->i_size)
-			return NULL;
-		unsigned long unused = *off;
-		bio_read(dir->i_bio, (char*)dst, sizeof(struct ext2_dirent), &unused);
-		*off += dst->rec_len;
-	} while (!dst->ino);
-	return dst;
+	const blksize_t blksize = dir->i_map->blksize;
+	blkcnt_t nr_blocks = dir->i_size / blksize;
+	int error;
+
+	if (ext2_dx_dir(dir)) {
+		error = ext2_dx_find_entry(dir, name, len, res_buf, res_off,
+				res_prev);
+		if (error != -EINVAL)
+			return error;
+		// the index is unusable: fall back to a linear search
+	}
+
+	for (blkcnt_t b = 0; b < nr_blocks; b++) {
+		struct buffer *buf = ext2_bread(dir, b, false);
+		if (!buf)
+			return -EIO;
+		if (ext2_search_dirblock(buf, blksize, name, len, res_off,
+					res_prev)) {
+			*res_buf = buf;
+			return 0;
+		}
+		release_buffer(buf);
+	}
+	return -ENOENT;
 }
 
 int ext2_lookup(struct inode *dir, const char *name, int len,
 		struct inode **result)
 {
-	struct ext2_dirent dirent;
-	unsigned long pos = 0;
-	while (next_dirent(dir, &pos, &dirent)) {
-		if (dirent.name_len != len)
-			continue;
-		if (!memcmp(name, dirent.name, len)) {
-			*result = iget(dir->i_sb, dirent.ino);
-			iput(dir);
+	struct buffer *buf;
+	long off, prev;
+	int error;
+
+	*result = NULL;
+	if (!(error = ext2_find_entry(dir, name, len, &buf, &off, &prev))) {
+		if (!(*result = iget(dir->i_sb, dirent_at(buf, off)->ino)))
+			error = -EIO;
+		release_buffer(buf);
+	}
+	iput(dir);
+	return error;
+}
+
+static const unsigned char ext2_dt[] = {
+	[EXT2_FT_UNKNOWN]  = DT_UNKNOWN,
+	[EXT2_FT_REG_FILE] = DT_REG,
+	[EXT2_FT_DIR]      = DT_DIR,
+	[EXT2_FT_CHRDEV]   = DT_CHR,
+	[EXT2_FT_BLKDEV]   = DT_BLK,
+	[EXT2_FT_FIFO]     = DT_FIFO,
+	[EXT2_FT_SOCK]     = DT_SOCK,
+	[EXT2_FT_SYMLINK]  = DT_LNK,
+};
+
+static unsigned int ext2_dirent_type(struct super_block *sb,
+		struct ext2_dirent *de)
+{
+	if (!(ext2_superblock(sb)->feature_incompat
+				& EXT2_FEATURE_INCOMPAT_FILETYPE))
+		return DT_UNKNOWN;
+	if (de->file_type >= sizeof(ext2_dt))
+		return DT_UNKNOWN;
+	return ext2_dt[de->file_type];
+}
+
+/*
+ * Read directory entries, a block at a time.  f_pos is a byte offset into the
+ * directory; if it doesn't fall on an entry (e.g. after lseek), iteration
+ * resumes at the next entry in the block.
+ */
+int ext2_readdir(struct inode *dir, struct file *file, void *dirent,
+		filldir_t filldir)
+{
+	const blksize_t blksize = dir->i_map->blksize;
+
+	while (file->f_pos < dir->i_size) {
+		unsigned long base = file->f_pos - file->f_pos % blksize;
+		long start = file->f_pos % blksize;
+		struct buffer *buf = ext2_bread(dir, base / blksize, false);
+
+		if (!buf)
+			return -EIO;
+		for (long off = 0; off < blksize; ) {
+			struct ext2_dirent *de = dirent_at(buf, off);
+			if (de->rec_len < 8 || off + de->rec_len > blksize)
+				break; // corrupt: skip the rest of the block
+			if (off >= start) {
+				if (de->ino && filldir(dirent, de->name, de->name_len,
+							base + off + de->rec_len, de->ino,
+							ext2_dirent_type(dir->i_sb, de))) {
+					release_buffer(buf);
+					return 0;
+				}
+				file->f_pos = base + off + de->rec_len;
+			}
+			off += de->rec_len;
+		}
+		release_buffer(buf);
+		file->f_pos = base + blksize;
+	}
+	return 0;
+}
+
+static void ext2_set_dirent(struct super_block *sb, struct ext2_dirent *de,
+		const char *name, int len, struct inode *inode)
+{
+	de->ino = inode->i_ino;
+	de->name_len = len;
+	de->file_type = ext2_file_type(sb, inode->i_mode);
+	memcpy(de->name, name, len);
+}
+
+static void ext2_touch_dir(struct inode *dir)
+{
+	struct ext2_inode *raw = ext2_inode(dir);
+
+	raw->mtime = raw->ctime = system_clock;
+	ext2_write_inode(dir);
+}
+
+/*
+ * Insert an entry into the directory block in @buf, in the first gap large
+ * enough to hold it.  Returns -ENOSPC if there is no such gap.
+ */
+int ext2_insert_dirent(struct inode *dir, struct buffer *buf, const char *name,
+		int len, struct inode *inode)
+{
+	const blksize_t blksize = dir->i_map->blksize;
+	const unsigned int need = ext2_rec_len(len);
+
+	for (long off = 0; off < blksize; ) {
+		struct ext2_dirent *de = dirent_at(buf, off);
+		unsigned int used;
+
+		if (de->rec_len < 8 || off + de->rec_len > blksize)
+			return -EIO;
+		used = de->ino ? ext2_rec_len(de->name_len) : 0;
+		if (de->rec_len - used >= need) {
+			if (de->ino) {
+				// split the entry, giving its slack to the new one
+				struct ext2_dirent *new = dirent_at(buf, off + used);
+				new->rec_len = de->rec_len - used;
+				de->rec_len = used;
+				de = new;
+			}
+			ext2_set_dirent(dir->i_sb, de, name, len, inode);
+			mark_buffer_dirty(buf);
 			return 0;
 		}
+		off += de->rec_len;
 	}
-	iput(dir);
-	return -ENOENT;
+	return -ENOSPC;
+}
+
+/*
+ * Extend a directory by one (zeroed) block.  The new block's logical number
+ * is returned in *@block.
+ */
+struct buffer *ext2_append_block(struct inode *dir, blkcnt_t *block)
+{
+	const blksize_t blksize = dir->i_map->blksize;
+	blkcnt_t nr_blocks = dir->i_size / blksize;
+	struct buffer *buf;
+
+	block_map_resize(dir->i_map, nr_blocks + 1);
+	if (!(buf = ext2_bread(dir, nr_blocks, true))) {
+		block_map_resize(dir->i_map, nr_blocks);
+		return NULL;
+	}
+	dir->i_size += blksize;
+	*block = nr_blocks;
+	return buf;
+}
+
+/*
+ * Add an entry for @inode named @name to @dir.  In a linear directory the
+ * entry goes in the first gap large enough to hold it; if there is none, the
+ * directory is extended by a block (or, if it has outgrown its first block,
+ * converted to an indexed directory).
+ */
+int ext2_add_entry(struct inode *dir, const char *name, int len,
+		struct inode *inode)
+{
+	const blksize_t blksize = dir->i_map->blksize;
+	blkcnt_t nr_blocks = dir->i_size / blksize;
+	struct ext2_superblock *sb = ext2_superblock(dir->i_sb);
+	struct buffer *buf;
+	long off, prev;
+	int error;
+
+	if (!len || len > 255)
+		return -ENAMETOOLONG;
+
+	if (!(error = ext2_find_entry(dir, name, len, &buf, &off, &prev))) {
+		release_buffer(buf);
+		return -EEXIST;
+	}
+	if (error != -ENOENT)
+		return error;
+
+	if (ext2_dx_dir(dir)) {
+		error = ext2_dx_add_entry(dir, name, len, inode);
+		if (error != -EINVAL)
+			goto out;
+	}
+	// inserting linearly would corrupt an index we can't maintain
+	ext2_inode(dir)->flags &= ~EXT2_INDEX_FL;
+
+	for (blkcnt_t b = 0; b < nr_blocks; b++) {
+		if (!(buf = ext2_bread(dir, b, false)))
+			return -EIO;
+		error = ext2_insert_dirent(dir, buf, name, len, inode);
+		release_buffer(buf);
+		if (error != -ENOSPC)
+			goto out;
+	}
+
+	if (nr_blocks == 1 && (sb->feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+		if (!(error = ext2_dx_make_indexed(dir)))
+			error = ext2_dx_add_entry(dir, name, len, inode);
+		if (error != -EINVAL)
+			goto out;
+	}
+
+	if (!(buf = ext2_append_block(dir, &nr_blocks)))
+		return -ENOSPC;
+	dirent_at(buf, 0)->rec_len = blksize;
+	error = ext2_insert_dirent(dir, buf, name, len, inode);
+	release_buffer(buf);
+out:
+	if (!error)
+		ext2_touch_dir(dir);
+	return error;
 }
 
-int ext2_readdir(struct inode *dir, struct file *file, struct dirent *dirent,
-		int count)
+/*
+ * Allocate an inode with mode @mode and link it into @dir as @name.  On
+ * failure the new inode is released.
+ */
+static int ext2_do_mknod(struct inode *dir, const char *name, int len,
+		int mode, struct inode **result)
 {
-	struct ext2_dirent fs_dirent;
-	if (!next_dirent(dir, &file->f_pos, &fs_dirent))
-		return -ENOENT;
-	dirent->d_ino = fs_dirent.ino;
-	memcpy(dirent->d_name, fs_dirent.name, fs_dirent.name_len);
-	dirent->d_name[fs_dirent.name_len] = '\0';
+	struct inode *inode;
+	int error;
+
+	if ((error = ext2_new_inode(dir, mode, &inode)) < 0)
+		return error;
+	inode->i_nlink = 1;
+	ext2_write_inode(inode);
+	if ((error = ext2_add_entry(dir, name, len, inode)) < 0) {
+		inode->i_nlink = 0;
+		iput(inode);
+		return error;
+	}
+	*result = inode;
 	return 0;
 }
 
+int ext2_create(struct inode *dir, const char *name, int len, int mode,
+		struct inode **result)
+{
+	int error;
+
+	*result = NULL;
+	error = ext2_do_mknod(dir, name, len, S_IFREG | (mode & ~S_IFMT),
+			result);
+	iput(dir);
+	return error;
+}
+
+int ext2_mknod(struct inode *dir, const char *name, int len, int mode,
+		dev_t rdev)
+{
+	struct inode *inode;
+	int error;
+
+	if (!(error = ext2_do_mknod(dir, name, len, mode, &inode))) {
+		if (S_ISCHR(mode) || S_ISBLK(mode)) {
+			inode->i_rdev = rdev;
+			ext2_write_inode(inode);
+		}
+		iput(inode);
+	}
+	iput(dir);
+	return error;
+}
+
+int ext2_mkdir(struct inode *dir, const char *name, int len, int mode)
+{
+	struct inode *inode;
+	struct buffer *buf;
+	struct ext2_dirent *de;
+	int error;
+
+	if ((error = ext2_new_inode(dir, S_IFDIR | (mode & ~S_IFMT), &inode)) < 0)
+		goto out;
+
+	// create the "." and ".." entries
+	block_map_resize(inode->i_map, 1);
+	if (!(buf = ext2_bread(inode, 0, true))) {
+		error = -ENOSPC;
+		goto fail;
+	}
+	inode->i_size = inode->i_map->blksize;
+	inode->i_nlink = 2;
+	de = dirent_at(buf, 0);
+	de->rec_len = ext2_rec_len(1);
+	ext2_set_dirent(dir->i_sb, de, ".", 1, inode);
+	de = dirent_at(buf, ext2_rec_len(1));
+	de->rec_len = inode->i_size - ext2_rec_len(1);
+	ext2_set_dirent(dir->i_sb, de, "..", 2, dir);
+	mark_buffer_dirty(buf);
+	release_buffer(buf);
+	ext2_write_inode(inode);
+
+	if ((error = ext2_add_entry(dir, name, len, inode)) < 0)
+		goto fail;
+	dir->i_nlink++;
+	ext2_write_inode(dir);
+	iput(inode);
+	goto out;
+fail:
+	inode->i_nlink = 0;
+	iput(inode);
+out:
+	iput(dir);
+	return error;
+}
+
+int ext2_unlink(struct inode *dir, const char *name, int len)
+{
+	struct inode *inode = NULL;
+	struct buffer *buf;
+	struct ext2_dirent *de;
+	long off, prev;
+	int error;
+
+	if ((error = ext2_find_entry(dir, name, len, &buf, &off, &prev)) < 0)
+		goto out;
+	de = dirent_at(buf, off);
+	error = -EIO;
+	if (!(inode = iget(dir->i_sb, de->ino)))
+		goto release;
+	error = -EPERM;
+	if (S_ISDIR(inode->i_mode))
+		goto release;
+
+	// merge the entry into its predecessor, or mark it unused
+	if (prev >= 0)
+		dirent_at(buf, prev)->rec_len += de->rec_len;
+	else
+		de->ino = 0;
+	mark_buffer_dirty(buf);
+	ext2_touch_dir(dir);
+
+	inode->i_nlink--;
+	ext2_inode(inode)->ctime = system_clock;
+	ext2_write_inode(inode);
+	error = 0;
+release:
+	release_buffer(buf);
+out:
+	iput(inode);
+	iput(dir);
+	return error;
+}
+
 struct file_operations ext2_dir_fops = {
 	.readdir = ext2_readdir,
+	.fsync = file_fsync,
 };
 
 struct inode_operations ext2_dir_iops = {
+	.create = ext2_create,
 	.lookup = ext2_lookup,
+	.unlink = ext2_unlink,
+	.mkdir = ext2_mkdir,
+	.mknod = ext2_mknod,
 	.default_file_ops = &ext2_dir_fops,
 };
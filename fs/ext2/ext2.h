@@ -73,8 +73,11 @@ struct ext2_superblock {
 	/* other options */
 	uint32_t default_mount_options;
 	uint32_t first_meta_bg;
-	uint8_t _reserved[760];
+	uint8_t _reserved1[88];
+	uint32_t flags;
+	uint8_t _reserved[668];
 } __packed;
+assert_struct_offset(struct ext2_superblock, flags, 0x160);
 
 /* s.magic */
 enum { EXT2_SUPER_MAGIC = 0xEF53 };
@@ -92,6 +95,12 @@ enum {
 	EXT2_ERRORS_PANIC    = 3  // cause a kernel panic
 };
 
+/* s.flags */
+enum {
+	EXT2_FLAGS_SIGNED_HASH   = 1, // directory hashes use signed chars
+	EXT2_FLAGS_UNSIGNED_HASH = 2  // directory hashes use unsigned chars
+};
+
 /* s.creator_os */
 enum {
 	EXT2_OS_LINUX   = 0,
@@ -144,6 +153,10 @@ enum {
 	EXT2_FEATURE_RO_COMPAT_BTREE_DIR    = 4
 };
 
+/* features implemented here; others refuse the mount, or force it read-only */
+#define EXT2_FEATURE_INCOMPAT_SUPP  EXT2_FEATURE_INCOMPAT_FILETYPE
+#define EXT2_FEATURE_RO_COMPAT_SUPP EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER
+
 struct ext2_bg_descriptor {
 	uint32_t block_bitmap;
 	uint32_t inode_bitmap;
@@ -155,6 +168,13 @@ struct ext2_bg_descriptor {
 	uint8_t _reserved[12];
 } __packed;
 
+/* i.block */
+#define EXT2_NDIR_BLOCKS 12
+#define EXT2_IND_BLOCK   12
+#define EXT2_DIND_BLOCK  13
+#define EXT2_TIND_BLOCK  14
+#define EXT2_N_BLOCKS    15
+
 struct ext2_inode {
 	uint16_t mode;
 	uint16_t uid;
@@ -168,7 +188,7 @@ struct ext2_inode {
 	uint32_t blocks;
 	uint32_t flags;
 	uint32_t osd1;
-	uint32_t block[15];
+	uint32_t block[EXT2_N_BLOCKS];
 	uint32_t generation;
 	uint32_t file_acl;
 	uint32_t dir_acl;
@@ -235,12 +255,141 @@ enum {
 	EXT2_RESERVED_FL     = 0x80000000  // reserved for ext2 library
 };
 
+/* file types in directory entries (EXT2_FEATURE_INCOMPAT_FILETYPE) */
+enum {
+	EXT2_FT_UNKNOWN  = 0,
+	EXT2_FT_REG_FILE = 1,
+	EXT2_FT_DIR      = 2,
+	EXT2_FT_CHRDEV   = 3,
+	EXT2_FT_BLKDEV   = 4,
+	EXT2_FT_FIFO     = 5,
+	EXT2_FT_SOCK     = 6,
+	EXT2_FT_SYMLINK  = 7
+};
+
+/*
+ * Hashed directory indexes (EXT2_FEATURE_COMPAT_DIR_INDEX).
+ *
+ * Block 0 of an indexed directory holds the "." and ".." entries, the last
+ * of which covers the rest of the block.  Hidden in that space is the root
+ * of a tree of (hash, block) pairs, sorted by hash, which map ranges of name
+ * hashes to the leaf blocks holding those names.  Interior index blocks
+ * appear to be a single empty directory entry.  Leaf blocks are ordinary
+ * directory blocks, so a directory can always be read linearly.
+ *
+ * The first entry in each index block holds the count and limit of entries
+ * in place of its hash (which is implicitly 0).  The low bit of a hash in the
+ * index marks a leaf that continues a run of equal hashes from the previous
+ * leaf.
+ */
+enum {
+	EXT2_HASH_LEGACY            = 0,
+	EXT2_HASH_HALF_MD4          = 1,
+	EXT2_HASH_TEA               = 2,
+	EXT2_HASH_LEGACY_UNSIGNED   = 3,
+	EXT2_HASH_HALF_MD4_UNSIGNED = 4,
+	EXT2_HASH_TEA_UNSIGNED      = 5
+};
+
+#define EXT2_HTREE_EOF 0x7FFFFFFFU
+#define EXT2_HTREE_LEVELS 2
+
+struct ext2_dx_entry {
+	uint32_t hash;
+	uint32_t block;
+} __packed;
+
+struct ext2_dx_countlimit {
+	uint16_t limit;
+	uint16_t count;
+} __packed;
+
+struct ext2_dx_root_info {
+	uint32_t reserved_zero;
+	uint8_t hash_version;
+	uint8_t info_length;
+	uint8_t indirect_levels;
+	uint8_t unused_flags;
+} __packed;
+
+/* offsets of the index entries in the root and interior index blocks */
+#define EXT2_DX_ROOT_ENTRIES (24 + sizeof(struct ext2_dx_root_info))
+#define EXT2_DX_NODE_ENTRIES 8
+
+struct ext2_dx_hash {
+	uint32_t hash;
+	uint32_t minor_hash;
+	int version;
+	uint32_t seed[4];
+};
+
+/* blocks to preallocate for regular files if the super block doesn't say */
+#define EXT2_DEFAULT_PREALLOC_BLOCKS 8
+
+/*
+ * We keep the ext2 super block and the block group descriptor table (which
+ * may span several blocks) in the buffer cache for as long as the file system
+ * is mounted.
+ */
+struct ext2_sb_private {
+	struct ext2_superblock *sb;
+	struct buffer *sb_buf;
+	struct buffer **bg_bufs;
+	unsigned long nr_bg_blocks;
+	unsigned long nr_groups;
+};
+
+/*
+ * We store the whole ext2 inode in i_private.  This wastes a bit of memory,
+ * but it's likely that the buffer will remain cached anyways.
+ *
+ * Blocks preallocated for a file (but not yet part of it) are described by
+ * prealloc_block and prealloc_count.
+ */
+struct ext2_inode_private {
+	struct ext2_inode *inode;
+	struct buffer *buf;
+	blkcnt_t prealloc_block;
+	unsigned int prealloc_count;
+};
+
 static inline uint32_t ext2_inode_blocks(struct ext2_superblock *sb,
 		struct ext2_inode *inode)
 {
 	return inode->blocks / (2 << sb->log_block_size);
 }
 
+static inline blksize_t ext2_block_size(struct ext2_superblock *sb)
+{
+	return 1024 << sb->log_block_size;
+}
+
+static inline unsigned int ext2_inode_size(struct ext2_superblock *sb)
+{
+	if (sb->rev_level == EXT2_GOOD_OLD_REV)
+		return EXT2_GOOD_OLD_INODE_SIZE;
+	return sb->inode_size;
+}
+
+static inline uint32_t ext2_first_ino(struct ext2_superblock *sb)
+{
+	if (sb->rev_level == EXT2_GOOD_OLD_REV)
+		return EXT2_GOOD_OLD_FIRST_INO;
+	return sb->first_ino;
+}
+
+/* i_blocks is counted in 512-byte units */
+static inline uint32_t ext2_block_sectors(struct ext2_superblock *sb)
+{
+	return 2 << sb->log_block_size;
+}
+
+/* rec_len needed for a directory entry with a name of length @len */
+static inline unsigned int ext2_rec_len(unsigned int len)
+{
+	return (8 + len + 3) & ~3;
+}
+
 struct ext2_dirent {
 	uint32_t ino;
 	uint16_t rec_len;
@@ -251,12 +400,51 @@ struct ext2_dirent {
 
 struct ext2_inode *ext2_inode(struct inode *vnode);
 struct ext2_superblock *ext2_superblock(struct super_block *sb);
+struct ext2_bg_descriptor *ext2_group_desc(struct super_block *vsb,
+		unsigned long group, struct buffer **buf);
+void ext2_mark_sb_dirty(struct super_block *vsb);
 
-void ext2_read_inode(struct inode *vnode);
+/* inode.c */
+int ext2_read_inode(struct inode *vnode);
+void ext2_write_inode(struct inode *vnode);
 void ext2_put_inode(struct inode *vnode);
 struct ext2_inode *ext2_iget(struct super_block *vsb, ino_t ino,
 		struct buffer **buf);
-struct bio_vec *ext2_inode_to_bio_vec(struct inode *vnode);
+struct block_map *ext2_alloc_block_map(struct inode *vnode);
+struct buffer *ext2_bread(struct inode *vnode, blkcnt_t lblk, bool create);
+int ext2_truncate(struct inode *vnode, size_t len);
+
+/* balloc.c */
+blkcnt_t ext2_new_block(struct inode *vnode, blkcnt_t goal);
+void ext2_free_blocks(struct super_block *vsb, blkcnt_t block,
+		unsigned long count);
+void ext2_discard_prealloc(struct inode *vnode);
+
+/* ialloc.c */
+int ext2_new_inode(struct inode *dir, mode_t mode, struct inode **result);
+void ext2_free_inode_nr(struct super_block *vsb, ino_t ino, bool dir);
+void ext2_free_inode(struct inode *vnode);
+unsigned char ext2_file_type(struct super_block *vsb, mode_t mode);
+
+/* dir.c */
+int ext2_add_entry(struct inode *dir, const char *name, int len,
+		struct inode *inode);
+bool ext2_search_dirblock(struct buffer *buf, blksize_t blksize,
+		const char *name, int len, long *res_off, long *res_prev);
+int ext2_insert_dirent(struct inode *dir, struct buffer *buf, const char *name,
+		int len, struct inode *inode);
+struct buffer *ext2_append_block(struct inode *dir, blkcnt_t *block);
+
+/* hash.c */
+int ext2_dirhash(const char *name, int len, struct ext2_dx_hash *hinfo);
+
+/* htree.c */
+bool ext2_dx_dir(struct inode *dir);
+int ext2_dx_find_entry(struct inode *dir, const char *name, int len,
+		struct buffer **res_buf, long *res_off, long *res_prev);
+int ext2_dx_add_entry(struct inode *dir, const char *name, int len,
+		struct inode *inode);
+int ext2_dx_make_indexed(struct inode *dir);
 
 extern struct file_operations ext2_reg_fops;
 extern struct file_operations ext2_dir_fops;
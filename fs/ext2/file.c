@@ -16,12 +16,65 @@
  */
 
 #include <kernel/fs.h>
+#include <kernel/time.h>
+#include <telos/fcntl.h>
 #include "ext2.h"
 
+/*
+ * Write to a regular file.  The block map is extended to cover the write, and
+ * holes are filled in by the allocator as bio_write reaches them.
+ */
+static ssize_t ext2_file_write(struct file *file, const char *buf, size_t len,
+		unsigned long *pos)
+{
+	struct inode *inode = file->f_inode;
+	struct block_map *map = inode->i_map;
+	blkcnt_t old_blkcnt = map->blkcnt;
+	blkcnt_t blkcnt;
+	ssize_t r;
+
+	if (!len)
+		return 0;
+	if (file->f_flags & O_APPEND)
+		*pos = inode->i_size;
+	if (*pos + len < *pos)
+		return -EFBIG;
+
+	blkcnt = (*pos + len + map->blksize - 1) / map->blksize;
+	if (blkcnt > map->blkcnt)
+		block_map_resize(map, blkcnt);
+
+	r = bio_write(map, buf, len, pos);
+	if (*pos > inode->i_size)
+		inode->i_size = *pos;
+	// trim the map back after a short write
+	blkcnt = MAX(old_blkcnt, (blkcnt_t) ((inode->i_size + map->blksize - 1)
+				/ map->blksize));
+	if (map->blkcnt > blkcnt)
+		block_map_resize(map, blkcnt);
+	if (r > 0) {
+		struct ext2_inode *raw = ext2_inode(inode);
+		raw->mtime = raw->ctime = system_clock;
+		ext2_write_inode(inode);
+	}
+	return r;
+}
+
+static int ext2_file_release(struct inode *inode, struct file *file)
+{
+	ext2_discard_prealloc(inode);
+	return 0;
+}
+
 struct file_operations ext2_reg_fops = {
 	.read = bio_file_read,
+	.readv = bio_file_readv,
+	.write = ext2_file_write,
+	.release = ext2_file_release,
+	.fsync = file_fsync,
 };
 
 struct inode_operations ext2_reg_iops = {
+	.truncate = ext2_truncate,
 	.default_file_ops = &ext2_reg_fops,
 };
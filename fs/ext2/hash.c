@@ -0,0 +1,204 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <kernel/bitops.h>
+#include <string.h>
+#include "ext2.h"
+
+/*
+ * Directory index hash functions.  These must produce exactly the same values
+ * as Linux's, since the hashes are stored on disk.  The "unsigned" variants
+ * differ only in how bytes of the name are sign-extended.
+ */
+
+#define DELTA 0x9E3779B9
+
+static void tea_transform(uint32_t buf[4], const uint32_t in[4])
+{
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+	int n = 16;
+
+	do {
+		sum += DELTA;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	} while (--n);
+
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+/* basic MD4 functions: selection, majority, parity */
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+
+#define ROUND(f, a, b, c, d, x, s) \
+	(a += f(b, c, d) + x, a = rol32(a, s))
+#define K1 0
+#define K2 013240474631UL
+#define K3 015666365641UL
+
+static void half_md4_transform(uint32_t buf[4], const uint32_t in[8])
+{
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	/* round 1 */
+	ROUND(F, a, b, c, d, in[0] + K1,  3);
+	ROUND(F, d, a, b, c, in[1] + K1,  7);
+	ROUND(F, c, d, a, b, in[2] + K1, 11);
+	ROUND(F, b, c, d, a, in[3] + K1, 19);
+	ROUND(F, a, b, c, d, in[4] + K1,  3);
+	ROUND(F, d, a, b, c, in[5] + K1,  7);
+	ROUND(F, c, d, a, b, in[6] + K1, 11);
+	ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+	/* round 2 */
+	ROUND(G, a, b, c, d, in[1] + K2,  3);
+	ROUND(G, d, a, b, c, in[3] + K2,  5);
+	ROUND(G, c, d, a, b, in[5] + K2,  9);
+	ROUND(G, b, c, d, a, in[7] + K2, 13);
+	ROUND(G, a, b, c, d, in[0] + K2,  3);
+	ROUND(G, d, a, b, c, in[2] + K2,  5);
+	ROUND(G, c, d, a, b, in[4] + K2,  9);
+	ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+	/* round 3 */
+	ROUND(H, a, b, c, d, in[3] + K3,  3);
+	ROUND(H, d, a, b, c, in[7] + K3,  9);
+	ROUND(H, c, d, a, b, in[2] + K3, 11);
+	ROUND(H, b, c, d, a, in[6] + K3, 15);
+	ROUND(H, a, b, c, d, in[1] + K3,  3);
+	ROUND(H, d, a, b, c, in[5] + K3,  9);
+	ROUND(H, c, d, a, b, in[0] + K3, 11);
+	ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+/* the original hash, used before half MD4 and TEA */
+static uint32_t legacy_hash(const char *name, int len, bool unsigned_chars)
+{
+	uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+	for (int i = 0; i < len; i++) {
+		int c = unsigned_chars ? (int) (unsigned char) name[i]
+			: (int) (signed char) name[i];
+		hash = hash1 + (hash0 ^ (c * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+/* pack up to @num words of @msg into @buf, padding with the length */
+static void str2hashbuf(const char *msg, int len, uint32_t *buf, int num,
+		bool unsigned_chars)
+{
+	uint32_t pad, val;
+
+	pad = (uint32_t) len | ((uint32_t) len << 8);
+	pad |= pad << 16;
+
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (int i = 0; i < len; i++) {
+		int c = unsigned_chars ? (int) (unsigned char) msg[i]
+			: (int) (signed char) msg[i];
+		val = c + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+/*
+ * Compute the hash of a name.  @hinfo->version and @hinfo->seed must be set;
+ * the major and minor hashes are returned in @hinfo.  Returns -EINVAL if the
+ * hash version is unknown.
+ */
+int ext2_dirhash(const char *name, int len, struct ext2_dx_hash *hinfo)
+{
+	uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	uint32_t in[8];
+	uint32_t hash, minor_hash = 0;
+	bool unsigned_chars = false;
+
+	// an all-zero seed means use the default
+	for (int i = 0; i < 4; i++) {
+		if (hinfo->seed[i]) {
+			memcpy(buf, hinfo->seed, sizeof(buf));
+			break;
+		}
+	}
+
+	switch (hinfo->version) {
+	case EXT2_HASH_LEGACY_UNSIGNED:
+		unsigned_chars = true;
+		// fall through
+	case EXT2_HASH_LEGACY:
+		hash = legacy_hash(name, len, unsigned_chars);
+		break;
+	case EXT2_HASH_HALF_MD4_UNSIGNED:
+		unsigned_chars = true;
+		// fall through
+	case EXT2_HASH_HALF_MD4:
+		for (const char *p = name; len > 0; len -= 32, p += 32) {
+			str2hashbuf(p, len, in, 8, unsigned_chars);
+			half_md4_transform(buf, in);
+		}
+		hash = buf[1];
+		minor_hash = buf[2];
+		break;
+	case EXT2_HASH_TEA_UNSIGNED:
+		unsigned_chars = true;
+		// fall through
+	case EXT2_HASH_TEA:
+		for (const char *p = name; len > 0; len -= 16, p += 16) {
+			str2hashbuf(p, len, in, 4, unsigned_chars);
+			tea_transform(buf, in);
+		}
+		hash = buf[0];
+		minor_hash = buf[1];
+		break;
+	default:
+		hinfo->hash = 0;
+		return -EINVAL;
+	}
+
+	// the low bit is reserved to mark hash collisions in the index
+	hash &= ~1;
+	if (hash == (EXT2_HTREE_EOF << 1))
+		hash = (EXT2_HTREE_EOF - 1) << 1;
+	hinfo->hash = hash;
+	hinfo->minor_hash = minor_hash;
+	return 0;
+}
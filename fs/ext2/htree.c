@@ -0,0 +1,519 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <kernel/fs.h>
+#include <kernel/mm/kmalloc.h>
+#include <string.h>
+#include "ext2.h"
+
+/*
+ * Hashed directory indexes.  See ext2.h for the on-disk format.
+ *
+ * A lookup hashes the name, walks down the index (at most EXT2_HTREE_LEVELS
+ * blocks) to the leaf covering that hash and searches only that leaf, so a
+ * lookup in a large directory costs a few block reads rather than a scan of
+ * the whole directory.  When a leaf fills up it is split in two by hash, and
+ * a new entry is added to the index; full index blocks are likewise split,
+ * or a level is added under the root.
+ */
+
+/* the path from the root of the index to a leaf */
+struct dx_frame {
+	struct buffer *buf;
+	struct ext2_dx_entry *entries;
+	struct ext2_dx_entry *at;
+};
+
+#define dx_countlimit(entries) ((struct ext2_dx_countlimit*)(entries))
+#define dx_count(entries) (dx_countlimit(entries)->count)
+#define dx_limit(entries) (dx_countlimit(entries)->limit)
+
+static inline uint32_t dx_block(struct ext2_dx_entry *entry)
+{
+	return entry->block & 0x00FFFFFF;
+}
+
+static inline struct ext2_dx_root_info *dx_root_info(struct buffer *buf)
+{
+	return (struct ext2_dx_root_info*) ((char*)buf->b_data + 24);
+}
+
+static inline struct ext2_dx_entry *dx_node_entries(struct buffer *buf,
+		size_t off)
+{
+	return (struct ext2_dx_entry*) ((char*)buf->b_data + off);
+}
+
+static inline unsigned int dx_root_limit(blksize_t blksize)
+{
+	return (blksize - EXT2_DX_ROOT_ENTRIES) / sizeof(struct ext2_dx_entry);
+}
+
+static inline unsigned int dx_node_limit(blksize_t blksize)
+{
+	return (blksize - EXT2_DX_NODE_ENTRIES) / sizeof(struct ext2_dx_entry);
+}
+
+bool ext2_dx_dir(struct inode *dir)
+{
+	struct ext2_superblock *sb = ext2_superblock(dir->i_sb);
+
+	return (sb->feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)
+		&& (ext2_inode(dir)->flags & EXT2_INDEX_FL);
+}
+
+static void dx_hash_init(struct super_block *vsb, unsigned int version,
+		struct ext2_dx_hash *hinfo)
+{
+	struct ext2_superblock *sb = ext2_superblock(vsb);
+
+	hinfo->version = version;
+	if (sb->flags & EXT2_FLAGS_UNSIGNED_HASH)
+		hinfo->version += EXT2_HASH_LEGACY_UNSIGNED;
+	for (int i = 0; i < 4; i++)
+		hinfo->seed[i] = sb->hash_seed[i];
+}
+
+static void dx_release(struct dx_frame *frames, int depth)
+{
+	for (int i = 0; i < depth; i++)
+		release_buffer(frames[i].buf);
+}
+
+/*
+ * Walk the index down to the leaf covering the hash of @name.  The path is
+ * returned in @frames, and its length in *@depth.  Returns -EINVAL if the
+ * index is not one we understand.
+ */
+static int dx_probe(struct inode *dir, const char *name, int len,
+		struct ext2_dx_hash *hinfo, struct dx_frame *frames, int *depth)
+{
+	const blksize_t blksize = dir->i_map->blksize;
+	struct ext2_dx_root_info *info;
+	struct ext2_dx_entry *entries, *p, *q, *m;
+	struct buffer *buf;
+	unsigned int limit, count;
+	int levels;
+
+	if (!(buf = ext2_bread(dir, 0, false)))
+		return -EIO;
+	info = dx_root_info(buf);
+	if (info->reserved_zero || info->info_length != sizeof(*info)
+			|| info->hash_version > EXT2_HASH_TEA
+			|| info->indirect_levels >= EXT2_HTREE_LEVELS) {
+		release_buffer(buf);
+		return -EINVAL;
+	}
+	levels = info->indirect_levels;
+	dx_hash_init(dir->i_sb, info->hash_version, hinfo);
+	ext2_dirhash(name, len, hinfo);
+
+	entries = dx_node_entries(buf, EXT2_DX_ROOT_ENTRIES);
+	limit = dx_root_limit(blksize);
+	for (int i = 0; ; i++) {
+		count = dx_count(entries);
+		if (dx_limit(entries) != limit || !count || count > limit) {
+			release_buffer(buf);
+			dx_release(frames, i);
+			return -EINVAL;
+		}
+
+		// find the last entry with a hash not greater than ours
+		p = entries + 1;
+		q = entries + count - 1;
+		while (p <= q) {
+			m = p + (q - p) / 2;
+			if (m->hash > hinfo->hash)
+				q = m - 1;
+			else
+				p = m + 1;
+		}
+		frames[i].buf = buf;
+		frames[i].entries = entries;
+		frames[i].at = p - 1;
+
+		if (i == levels) {
+			*depth = i + 1;
+			return 0;
+		}
+		if (!(buf = ext2_bread(dir, dx_block(p - 1), false))) {
+			dx_release(frames, i + 1);
+			return -EIO;
+		}
+		entries = dx_node_entries(buf, EXT2_DX_NODE_ENTRIES);
+		limit = dx_node_limit(blksize);
+	}
+}
+
+/*
+ * Advance the path to the next leaf, if that leaf may contain names with hash
+ * @hash (i.e. it continues a run of equal hashes).  Returns 1 if the path was
+ * advanced, 0 if not, or a negative error code.
+ */
+static int dx_next_block(struct inode *dir, uint32_t hash,
+		struct dx_frame *frames, int depth)
+{
+	struct dx_frame *frame = &frames[depth - 1];
+	int levels = 0;
+
+	while (frame->at + 1 >= frame->entries + dx_count(frame->entries)) {
+		if (frame == frames)
+			return 0;
+		frame--;
+		levels++;
+	}
+	frame->at++;
+	if ((frame->at->hash & ~1) != hash)
+		return 0;
+
+	// re-read the index blocks below the level that advanced
+	while (levels--) {
+		struct buffer *buf = ext2_bread(dir, dx_block(frame->at), false);
+		if (!buf)
+			return -EIO;
+		frame++;
+		release_buffer(frame->buf);
+		frame->buf = buf;
+		frame->entries = dx_node_entries(buf, EXT2_DX_NODE_ENTRIES);
+		frame->at = frame->entries;
+	}
+	return 1;
+}
+
+int ext2_dx_find_entry(struct inode *dir, const char *name, int len,
+		struct buffer **res_buf, long *res_off, long *res_prev)
+{
+	struct dx_frame frames[EXT2_HTREE_LEVELS];
+	struct ext2_dx_hash hinfo;
+	struct buffer *buf;
+	int depth, error;
+
+	if ((error = dx_probe(dir, name, len, &hinfo, frames, &depth)) < 0)
+		return error;
+	for (;;) {
+		buf = ext2_bread(dir, dx_block(frames[depth-1].at), false);
+		if (!buf) {
+			error = -EIO;
+			break;
+		}
+		if (ext2_search_dirblock(buf, dir->i_map->blksize, name, len,
+					res_off, res_prev)) {
+			*res_buf = buf;
+			error = 0;
+			break;
+		}
+		release_buffer(buf);
+		if ((error = dx_next_block(dir, hinfo.hash, frames, depth)) <= 0) {
+			error = error ? error : -ENOENT;
+			break;
+		}
+	}
+	dx_release(frames, depth);
+	return error;
+}
+
+/*
+ * Insert (@hash, @block) into an index block, after frame->at.
+ */
+static void dx_insert_entry(struct dx_frame *frame, uint32_t hash,
+		uint32_t block)
+{
+	struct ext2_dx_entry *entries = frame->entries;
+	struct ext2_dx_entry *new = frame->at + 1;
+	unsigned int count = dx_count(entries);
+
+	for (struct ext2_dx_entry *p = entries + count; p > new; p--)
+		*p = p[-1];
+	new->hash = hash;
+	new->block = block;
+	dx_count(entries) = count + 1;
+	mark_buffer_dirty(frame->buf);
+}
+
+/*
+ * Make room in the lowest index block of the path for one more entry, either
+ * by splitting it (and adding an entry to the root) or by moving the root's
+ * entries to a new block one level down.
+ */
+static int dx_grow_index(struct inode *dir, struct dx_frame *frames,
+		int *depth)
+{
+	const blksize_t blksize = dir->i_map->blksize;
+	struct dx_frame *frame = &frames[*depth - 1];
+	struct ext2_dx_entry *old = frame->entries, *new;
+	struct ext2_dirent *de;
+	struct buffer *buf;
+	blkcnt_t block;
+	unsigned int count = dx_count(old);
+
+	if (*depth > 1 && dx_count(frames[0].entries) == dx_limit(frames[0].entries))
+		return -ENOSPC; // the index is full
+
+	if (!(buf = ext2_append_block(dir, &block)))
+		return -ENOSPC;
+	de = buf->b_data;
+	de->ino = 0;
+	de->rec_len = blksize;
+	new = dx_node_entries(buf, EXT2_DX_NODE_ENTRIES);
+	// dirty the new block now: the branch below may release it
+	mark_buffer_dirty(buf);
+
+	if (*depth == 1) {
+		// move the root's entries down into the new block
+		for (unsigned int i = 0; i < count; i++)
+			new[i] = old[i];
+		dx_limit(new) = dx_node_limit(blksize);
+		dx_count(old) = 1;
+		old[0].block = block;
+		dx_root_info(frame->buf)->indirect_levels = 1;
+		mark_buffer_dirty(frame->buf);
+
+		frames[1].buf = buf;
+		frames[1].entries = new;
+		frames[1].at = new + (frame->at - old);
+		frame->at = old;
+		*depth = 2;
+	} else {
+		// move the upper half of the entries to the new block
+		unsigned int split = count / 2;
+		uint32_t hash = old[split].hash;
+
+		for (unsigned int i = 0; i < count - split; i++)
+			new[i] = old[split + i];
+		dx_limit(new) = dx_node_limit(blksize);
+		dx_count(new) = count - split;
+		dx_count(old) = split;
+		mark_buffer_dirty(frame->buf);
+		dx_insert_entry(&frames[0], hash, block);
+
+		if (frame->at >= old + split) {
+			release_buffer(frame->buf);
+			frame->buf = buf;
+			frame->entries = new;
+			frame->at = new + (frame->at - old - split);
+		} else {
+			release_buffer(buf);
+		}
+	}
+	return 0;
+}
+
+struct dx_map_entry {
+	uint32_t hash;
+	uint16_t off;
+	uint16_t size;
+};
+
+/*
+ * Copy the entries @map[0..@count) from @src into the directory block @dst,
+ * packed together.
+ */
+static void dx_move_entries(char *dst, const char *src, struct dx_map_entry *map,
+		unsigned int count, blksize_t blksize)
+{
+	struct ext2_dirent *de = NULL;
+	unsigned int off = 0;
+
+	for (unsigned int i = 0; i < count; i++) {
+		de = (struct ext2_dirent*) (dst + off);
+		memcpy(de, src + map[i].off, map[i].size);
+		de->rec_len = map[i].size;
+		off += map[i].size;
+	}
+	de->rec_len += blksize - off;
+}
+
+/*
+ * Split a full leaf in two by hash, adding the new leaf to the index.  The
+ * buffer holding the leaf that should receive the entry with hash
+ * @hinfo->hash is returned in *@bufp.
+ */
+static int dx_split_leaf(struct inode *dir, struct dx_frame *frame,
+		struct ext2_dx_hash *hinfo, struct buffer **bufp)
+{
+	const blksize_t blksize = dir->i_map->blksize;
+	struct buffer *obuf = *bufp, *nbuf;
+	struct dx_map_entry *map;
+	struct ext2_dx_hash h = *hinfo;
+	unsigned int count = 0, split;
+	uint32_t hash2;
+	blkcnt_t block;
+	char *copy;
+	int error = -ENOMEM;
+
+	if (!(map = kmalloc((blksize / 12 + 1) * sizeof(*map))))
+		return -ENOMEM;
+	if (!(copy = kmalloc(blksize)))
+		goto out_map;
+	memcpy(copy, obuf->b_data, blksize);
+
+	// collect and sort the live entries by hash
+	for (long off = 0; off < blksize; ) {
+		struct ext2_dirent *de = (struct ext2_dirent*) (copy + off);
+		if (de->rec_len < 8 || off + de->rec_len > blksize) {
+			error = -EIO;
+			goto out;
+		}
+		if (de->ino) {
+			unsigned int i = count++;
+			ext2_dirhash(de->name, de->name_len, &h);
+			for (; i > 0 && map[i-1].hash > h.hash; i--)
+				map[i] = map[i-1];
+			map[i].hash = h.hash;
+			map[i].off = off;
+			map[i].size = ext2_rec_len(de->name_len);
+		}
+		off += de->rec_len;
+	}
+	if (count < 2) {
+		error = -ENOSPC;
+		goto out;
+	}
+
+	if (!(nbuf = ext2_append_block(dir, &block))) {
+		error = -ENOSPC;
+		goto out;
+	}
+
+	// names with equal hashes may span the split: mark the continuation
+	split = count / 2;
+	hash2 = map[split].hash;
+	dx_move_entries(nbuf->b_data, copy, map + split, count - split, blksize);
+	dx_move_entries(obuf->b_data, copy, map, split, blksize);
+	mark_buffer_dirty(obuf);
+	mark_buffer_dirty(nbuf);
+	dx_insert_entry(frame, hash2 + (hash2 == map[split-1].hash), block);
+
+	if (hinfo->hash >= hash2) {
+		release_buffer(obuf);
+		*bufp = nbuf;
+	} else {
+		release_buffer(nbuf);
+	}
+	error = 0;
+out:
+	kfree(copy);
+out_map:
+	kfree(map);
+	return error;
+}
+
+/*
+ * Add an entry to an indexed directory.  The caller has already checked that
+ * the name does not exist.
+ */
+int ext2_dx_add_entry(struct inode *dir, const char *name, int len,
+		struct inode *inode)
+{
+	struct dx_frame frames[EXT2_HTREE_LEVELS];
+	struct ext2_dx_hash hinfo;
+	struct dx_frame *frame;
+	struct buffer *buf;
+	int depth, error;
+
+	if ((error = dx_probe(dir, name, len, &hinfo, frames, &depth)) < 0)
+		return error;
+	frame = &frames[depth - 1];
+	if (!(buf = ext2_bread(dir, dx_block(frame->at), false))) {
+		error = -EIO;
+		goto out;
+	}
+	if ((error = ext2_insert_dirent(dir, buf, name, len, inode)) != -ENOSPC)
+		goto out_buf;
+
+	// the leaf is full: split it, making room in the index first if needed
+	if (dx_count(frame->entries) == dx_limit(frame->entries)) {
+		if ((error = dx_grow_index(dir, frames, &depth)) < 0)
+			goto out_buf;
+		frame = &frames[depth - 1];
+	}
+	if ((error = dx_split_leaf(dir, frame, &hinfo, &buf)) < 0)
+		goto out_buf;
+	error = ext2_insert_dirent(dir, buf, name, len, inode);
+out_buf:
+	release_buffer(buf);
+out:
+	dx_release(frames, depth);
+	return error;
+}
+
+/*
+ * Convert a single-block linear directory to an indexed directory.  The
+ * entries following "." and ".." are moved to a new leaf block, and the root
+ * of the index is built in the space they occupied.
+ */
+int ext2_dx_make_indexed(struct inode *dir)
+{
+	const blksize_t blksize = dir->i_map->blksize;
+	struct ext2_superblock *sb = ext2_superblock(dir->i_sb);
+	struct ext2_dirent *dot, *dotdot, *de;
+	struct ext2_dx_root_info *info;
+	struct ext2_dx_entry *entries;
+	struct buffer *root, *leaf;
+	blkcnt_t block;
+	long start, off;
+
+	if (sb->def_hash_version > EXT2_HASH_TEA)
+		return -EINVAL;
+	if (!(root = ext2_bread(dir, 0, false)))
+		return -EIO;
+	dot = root->b_data;
+	dotdot = (struct ext2_dirent*) ((char*)root->b_data + ext2_rec_len(1));
+	start = ext2_rec_len(1) + dotdot->rec_len;
+	if (dot->rec_len != ext2_rec_len(1) || dot->name_len != 1
+			|| dotdot->name_len != 2 || start >= blksize) {
+		release_buffer(root);
+		return -EINVAL;
+	}
+	if (!(leaf = ext2_append_block(dir, &block))) {
+		release_buffer(root);
+		return -ENOSPC;
+	}
+
+	// move everything after ".." into the leaf, and extend the last entry
+	memcpy(leaf->b_data, (char*)root->b_data + start, blksize - start);
+	for (off = 0; ; off += de->rec_len) {
+		de = (struct ext2_dirent*) ((char*)leaf->b_data + off);
+		if (de->rec_len < 8 || off + de->rec_len >= blksize - start)
+			break;
+	}
+	de->rec_len = blksize - off;
+	mark_buffer_dirty(leaf);
+	release_buffer(leaf);
+
+	// build the root
+	dotdot->rec_len = blksize - ext2_rec_len(1);
+	info = dx_root_info(root);
+	memset(info, 0, sizeof(*info));
+	info->hash_version = sb->def_hash_version;
+	info->info_length = sizeof(*info);
+	entries = dx_node_entries(root, EXT2_DX_ROOT_ENTRIES);
+	dx_limit(entries) = dx_root_limit(blksize);
+	dx_count(entries) = 1;
+	entries[0].block = block;
+	mark_buffer_dirty(root);
+	release_buffer(root);
+
+	// we hash names as signed chars; record that if nobody has yet
+	if (!(sb->flags & (EXT2_FLAGS_SIGNED_HASH | EXT2_FLAGS_UNSIGNED_HASH))) {
+		sb->flags |= EXT2_FLAGS_SIGNED_HASH;
+		ext2_mark_sb_dirty(dir->i_sb);
+	}
+	ext2_inode(dir)->flags |= EXT2_INDEX_FL;
+	ext2_write_inode(dir);
+	return 0;
+}
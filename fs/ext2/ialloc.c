@@ -0,0 +1,215 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <kernel/bitmap.h>
+#include <kernel/fs.h>
+#include <kernel/time.h>
+#include <telos/stat.h>
+#include <string.h>
+#include "ext2.h"
+
+/*
+ * Inode allocation.
+ *
+ * New files are placed in their parent directory's group, so that a
+ * directory's files (and their data blocks) are close together.  New
+ * directories are spread out: they go in the group with the most free blocks
+ * among those with an above-average number of free inodes.
+ */
+
+static long find_dir_group(struct super_block *vsb)
+{
+	struct ext2_superblock *sb = ext2_superblock(vsb);
+	struct ext2_sb_private *sbp = vsb->s_private;
+	unsigned long avg = sb->free_inodes_count / sbp->nr_groups;
+	long best = -1;
+	unsigned long best_free = 0;
+
+	for (unsigned long g = 0; g < sbp->nr_groups; g++) {
+		struct ext2_bg_descriptor *gd = ext2_group_desc(vsb, g, NULL);
+		if (!gd->free_inodes_count || gd->free_inodes_count < avg)
+			continue;
+		if (best < 0 || gd->free_blocks_count > best_free) {
+			best = g;
+			best_free = gd->free_blocks_count;
+		}
+	}
+	return best;
+}
+
+static long find_file_group(struct super_block *vsb, unsigned long parent)
+{
+	struct ext2_sb_private *sbp = vsb->s_private;
+	struct ext2_bg_descriptor *gd;
+	unsigned long g;
+
+	// the parent's group, if it has room
+	gd = ext2_group_desc(vsb, parent, NULL);
+	if (gd->free_inodes_count && gd->free_blocks_count)
+		return parent;
+
+	// quadratic probe for a group with free inodes and blocks
+	g = parent;
+	for (unsigned long i = 1; i < sbp->nr_groups; i <<= 1) {
+		g = (g + i) % sbp->nr_groups;
+		gd = ext2_group_desc(vsb, g, NULL);
+		if (gd->free_inodes_count && gd->free_blocks_count)
+			return g;
+	}
+
+	// linear search for any group with a free inode
+	for (unsigned long i = 1; i < sbp->nr_groups; i++) {
+		g = (parent + i) % sbp->nr_groups;
+		if (ext2_group_desc(vsb, g, NULL)->free_inodes_count)
+			return g;
+	}
+	return -1;
+}
+
+static unsigned char mode_file_type(mode_t mode)
+{
+	switch (mode & S_IFMT) {
+	case S_IFREG: return EXT2_FT_REG_FILE;
+	case S_IFDIR: return EXT2_FT_DIR;
+	case S_IFCHR: return EXT2_FT_CHRDEV;
+	case S_IFBLK: return EXT2_FT_BLKDEV;
+	}
+	return EXT2_FT_UNKNOWN;
+}
+
+/*
+ * Allocate an inode, initialize it on disk with the given mode, and return
+ * the VFS inode (with a link count of 0) in *@result.
+ */
+int ext2_new_inode(struct inode *dir, mode_t mode, struct inode **result)
+{
+	struct super_block *vsb = dir->i_sb;
+	struct ext2_superblock *sb = ext2_superblock(vsb);
+	unsigned long parent = (dir->i_ino - 1) / sb->inodes_per_group;
+	unsigned long words = (sb->inodes_per_group + BITS_PER_LONG - 1)
+		/ BITS_PER_LONG;
+	struct ext2_bg_descriptor *gd;
+	struct ext2_inode *raw;
+	struct buffer *gbuf, *ibuf;
+	long group, bit;
+	ino_t ino;
+
+	*result = NULL;
+	group = S_ISDIR(mode) ? find_dir_group(vsb) : find_file_group(vsb, parent);
+	if (group < 0)
+		return -ENOSPC;
+
+	gd = ext2_group_desc(vsb, group, &gbuf);
+	if (!(ibuf = read_block(vsb->s_dev, gd->inode_bitmap,
+					ext2_block_size(sb))))
+		return -EIO;
+	// reserved inodes are never allocated
+	bit = bitmap_ffz_from(ibuf->b_data, words,
+			group ? 0 : ext2_first_ino(sb) - 1);
+	if (bit < 0 || (unsigned long) bit >= sb->inodes_per_group) {
+		release_buffer(ibuf);
+		return -ENOSPC;
+	}
+	bitmap_set(ibuf->b_data, bit);
+	mark_buffer_dirty(ibuf);
+	release_buffer(ibuf);
+
+	gd->free_inodes_count--;
+	sb->free_inodes_count--;
+	if (S_ISDIR(mode))
+		gd->used_dirs_count++;
+	mark_buffer_dirty(gbuf);
+	ext2_mark_sb_dirty(vsb);
+
+	ino = group * sb->inodes_per_group + bit + 1;
+	if (!(raw = ext2_iget(vsb, ino, &ibuf))) {
+		ext2_free_inode_nr(vsb, ino, S_ISDIR(mode));
+		return -EIO;
+	}
+	memset(raw, 0, ext2_inode_size(sb));
+	raw->mode = mode;
+	raw->atime = raw->ctime = raw->mtime = system_clock;
+	mark_buffer_dirty(ibuf);
+	release_buffer(ibuf);
+
+	if (!(*result = iget(vsb, ino))) {
+		ext2_free_inode_nr(vsb, ino, S_ISDIR(mode));
+		return -EIO;
+	}
+	(*result)->i_dirt = 1;
+	return 0;
+}
+
+/*
+ * Return an inode number to the free pool.
+ */
+void ext2_free_inode_nr(struct super_block *vsb, ino_t ino, bool dir)
+{
+	struct ext2_superblock *sb = ext2_superblock(vsb);
+	unsigned long group = (ino - 1) / sb->inodes_per_group;
+	unsigned long bit = (ino - 1) % sb->inodes_per_group;
+	struct ext2_bg_descriptor *gd;
+	struct buffer *gbuf, *ibuf;
+
+	if (ino < ext2_first_ino(sb) || ino > sb->inodes_count) {
+		warn("ext2: freeing reserved or nonexistent inode %lu",
+				(unsigned long) ino);
+		return;
+	}
+	gd = ext2_group_desc(vsb, group, &gbuf);
+	if (!(ibuf = read_block(vsb->s_dev, gd->inode_bitmap,
+					ext2_block_size(sb))))
+		return;
+	if (!bitmap_test(ibuf->b_data, bit)) {
+		warn("ext2: freeing free inode %lu", (unsigned long) ino);
+		release_buffer(ibuf);
+		return;
+	}
+	bitmap_clear(ibuf->b_data, bit);
+	mark_buffer_dirty(ibuf);
+	release_buffer(ibuf);
+
+	gd->free_inodes_count++;
+	sb->free_inodes_count++;
+	if (dir)
+		gd->used_dirs_count--;
+	mark_buffer_dirty(gbuf);
+	ext2_mark_sb_dirty(vsb);
+}
+
+/*
+ * Free the inode of a file which has been deleted (after its blocks have been
+ * freed).
+ */
+void ext2_free_inode(struct inode *vnode)
+{
+	struct ext2_inode *raw = ext2_inode(vnode);
+	struct ext2_inode_private *private = vnode->i_private;
+
+	raw->dtime = system_clock;
+	mark_buffer_dirty(private->buf);
+	ext2_free_inode_nr(vnode->i_sb, vnode->i_ino, S_ISDIR(vnode->i_mode));
+}
+
+unsigned char ext2_file_type(struct super_block *vsb, mode_t mode)
+{
+	if (ext2_superblock(vsb)->feature_incompat
+			& EXT2_FEATURE_INCOMPAT_FILETYPE)
+		return mode_file_type(mode);
+	return EXT2_FT_UNKNOWN;
+}
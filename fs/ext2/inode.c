@@ -16,19 +16,13 @@
  */
 
 #include <kernel/fs.h>
+#include <kernel/time.h>
 #include <kernel/mm/kmalloc.h>
 #include <kernel/mm/slab.h>
 #include <telos/stat.h>
+#include <string.h>
 #include "ext2.h"
 
-/*
- * We store the whole ext2 inode in i_private.  This wastes a bit of memory,
- * but it's likely that the buffer will remain cached anyways.
- */
-struct ext2_inode_private {
-	struct ext2_inode *inode;
-	struct buffer *buf;
-};
 static DEFINE_SLAB_CACHE(inode_private_cachep, sizeof(struct ext2_inode_private));
 
 /*
@@ -55,12 +49,22 @@ static struct inode_operations *ext2_mode_iops(mode_t mode)
 	panic("ext2: bad mode: %lx", mode); // FIXME
 }
 
-void ext2_read_inode(struct inode *vnode)
+/*
+ * Read an inode from the inode table.  Returns -EIO if the inode table block
+ * can't be read, in which case iget() fails.
+ */
+int ext2_read_inode(struct inode *vnode)
 {
-	// TODO: handle ENOMEM
 	struct ext2_inode_private *private = slab_alloc(inode_private_cachep);
+
+	if (!private)
+		return -ENOMEM;
 	private->inode = ext2_iget(vnode->i_sb, vnode->i_ino,
 			&private->buf);
+	if (!private->inode) {
+		slab_free(inode_private_cachep, private);
+		return -EIO;
+	}
 
 	// fill out VFS inode from ext2 inode
 	vnode->i_mode = private->inode->mode; // TODO: check these
@@ -70,110 +74,390 @@ void ext2_read_inode(struct inode *vnode)
 	vnode->i_nlink = private->inode->links_count;
 	vnode->i_op = ext2_mode_iops(vnode->i_mode);
 	vnode->i_private = private;
-	vnode->i_bio = ext2_inode_to_bio_vec(vnode);
+	private->prealloc_count = 0;
+	if (S_ISREG(vnode->i_mode) || S_ISDIR(vnode->i_mode))
+		vnode->i_map = ext2_alloc_block_map(vnode);
+	return 0;
 }
 
+/*
+ * Copy the VFS inode back into the ext2 inode.  The ext2 inode lives in the
+ * inode table buffer, so this just dirties the buffer.
+ */
+void ext2_write_inode(struct inode *vnode)
+{
+	struct ext2_inode_private *private = vnode->i_private;
+	struct ext2_inode *inode = private->inode;
+
+	inode->mode = vnode->i_mode;
+	inode->size = vnode->i_size;
+	inode->links_count = vnode->i_nlink;
+	if (S_ISCHR(vnode->i_mode) || S_ISBLK(vnode->i_mode))
+		inode->block[0] = vnode->i_rdev;
+	mark_buffer_dirty(private->buf);
+	vnode->i_dirt = 0;
+}
+
+/*
+ * Release an inode.  If the file has been deleted, its blocks and inode are
+ * freed.
+ */
 void ext2_put_inode(struct inode *vnode)
 {
 	struct ext2_inode_private *private = vnode->i_private;
+
+	if (vnode->i_map)
+		ext2_discard_prealloc(vnode);
+	if (!vnode->i_nlink && !IS_RDONLY(vnode)) {
+		if (vnode->i_map)
+			ext2_truncate(vnode, 0);
+		ext2_write_inode(vnode);
+		ext2_free_inode(vnode);
+	} else if (vnode->i_dirt) {
+		ext2_write_inode(vnode);
+	}
 	release_buffer(private->buf);
 	slab_free(inode_private_cachep, private);
-	free_bio_vec(vnode->i_bio);
+	if (vnode->i_map)
+		free_block_map(vnode->i_map);
 }
 
 /*
- * Read block numbers from an indirect block (given by @block) into the flat
- * array @blocks.
- *
+ * Convert a logical block number into a path through the inode's block
+ * array and its indirect blocks.  Returns the depth of the path (1 for a
+ * direct block, up to 4 for a triply-indirect block), or -1 if the block is
+ * beyond the maximum file size.
+ */
+static int ext2_block_to_path(unsigned long per_block, blkcnt_t lblk,
+		unsigned long offsets[4])
+{
+	const unsigned long per_block2 = per_block * per_block;
+
+	if (lblk < EXT2_NDIR_BLOCKS) {
+		offsets[0] = lblk;
+		return 1;
+	}
+	lblk -= EXT2_NDIR_BLOCKS;
+	if ((unsigned long) lblk < per_block) {
+		offsets[0] = EXT2_IND_BLOCK;
+		offsets[1] = lblk;
+		return 2;
+	}
+	lblk -= per_block;
+	if ((unsigned long) lblk < per_block2) {
+		offsets[0] = EXT2_DIND_BLOCK;
+		offsets[1] = lblk / per_block;
+		offsets[2] = lblk % per_block;
+		return 3;
+	}
+	lblk -= per_block2;
+	if ((unsigned long long) lblk < (unsigned long long) per_block2 * per_block) {
+		offsets[0] = EXT2_TIND_BLOCK;
+		offsets[1] = lblk / per_block2;
+		offsets[2] = (lblk / per_block) % per_block;
+		offsets[3] = lblk % per_block;
+		return 4;
+	}
+	return -1;
+}
+
+/*
+ * Number of logical blocks from the block at @offsets up to the end of the
+ * subtree rooted at level @level of the path.
  */
-static unsigned buffers_from_indirect(dev_t dev, uint32_t block,
-		unsigned blksize, blkcnt_t *blocks, unsigned len)
+static blkcnt_t ext2_subtree_remaining(unsigned long per_block,
+		unsigned long offsets[4], int level, int depth)
 {
-	len = MIN(len, blksize / sizeof(uint32_t));
+	blkcnt_t pos = 0, span = 1;
 
-	struct buffer *ibuf = read_block(dev, block, blksize); 
-	for (unsigned i = 0; i < len; i++) {
-		uint32_t block = ((uint32_t*)ibuf->b_data)[i];
-		blocks[i] = block;
+	for (int i = depth - 1; i > level; i--) {
+		pos += offsets[i] * span;
+		span *= per_block;
 	}
-	release_buffer(ibuf);
-	return len;
+	return span - pos;
 }
 
 /*
- * Read block numbers from a doubly-indirect block (given by @block) into the
- * flat array @blocks.
+ * Read an entry from a block array: either the inode's own array (if @table
+ * is NULL) or an indirect block.
  */
-static unsigned buffers_from_indirect2(dev_t dev, uint32_t block,
-		unsigned blksize, blkcnt_t *blocks, unsigned len)
+static uint32_t ext2_block_entry(struct ext2_inode *inode, uint32_t *table,
+		unsigned long i)
 {
-	const unsigned max_indirect = blksize / sizeof(uint32_t);
-	len = MIN(len, max_indirect*max_indirect);
+	return table ? table[i] : inode->block[i];
+}
 
-	struct buffer *i2buf = read_block(dev, block, blksize);
-	for (unsigned i = 0; i*max_indirect < len; i++) {
-		uint32_t block = ((uint32_t*)i2buf->b_data)[i];
-		buffers_from_indirect(dev, block, blksize,
-				blocks + i*max_indirect, len - i*max_indirect);
+/*
+ * Map a run of blocks starting at logical block @lblk.  Only the indirect
+ * blocks on the path to @lblk are read (through the buffer cache), and the
+ * run extends at most to the end of the array containing the entry for
+ * @lblk.  A zero entry at any level is a hole.
+ */
+static int ext2_get_extent(struct block_map *map, blkcnt_t lblk,
+		struct extent *ext)
+{
+	struct inode *vnode = map->private;
+	const unsigned long per_block = map->blksize / sizeof(uint32_t);
+	unsigned long offsets[4];
+	struct ext2_inode *inode = ext2_inode(vnode);
+	struct buffer *buf = NULL;
+	uint32_t *table = NULL;
+	unsigned long limit = EXT2_NDIR_BLOCKS;
+	int depth;
+
+	if ((depth = ext2_block_to_path(per_block, lblk, offsets)) < 0)
+		return -EFBIG;
+
+	ext->lblk = lblk;
+	for (int i = 0; i < depth - 1; i++) {
+		uint32_t block = ext2_block_entry(inode, table, offsets[i]);
+		if (buf)
+			release_buffer(buf);
+		if (!block) {
+			ext->pblk = 0;
+			ext->len = ext2_subtree_remaining(per_block, offsets, i,
+					depth);
+			return 0;
+		}
+		if (!(buf = read_block(map->dev, block, map->blksize)))
+			return -EIO;
+		table = buf->b_data;
+		limit = per_block;
+	}
+
+	// extend the run through the rest of the leaf array
+	ext->pblk = ext2_block_entry(inode, table, offsets[depth-1]);
+	ext->len = 1;
+	for (unsigned long i = offsets[depth-1] + 1; i < limit; i++) {
+		uint32_t want = ext->pblk ? ext->pblk + ext->len : 0;
+		if (ext2_block_entry(inode, table, i) != want)
+			break;
+		ext->len++;
 	}
-	release_buffer(i2buf);
-	return len;
+	if (buf)
+		release_buffer(buf);
+	return 0;
 }
 
 /*
- * Read block numbers from a triply-indirect block (given by @block) into the
- * flat array @blocks.
+ * Store a block number in an entry of a block array, and dirty the buffer
+ * holding the array.
  */
-static unsigned buffers_from_indirect3(dev_t dev, uint32_t block,
-		unsigned blksize, blkcnt_t *blocks, unsigned len)
+static void ext2_set_block_entry(struct inode *vnode, struct buffer *buf,
+		unsigned long i, uint32_t block)
 {
-	const unsigned max_indirect = blksize / sizeof(uint32_t);
-	const unsigned max_indirect2 = max_indirect*max_indirect;
-	len = MIN(len, max_indirect*max_indirect2);
+	struct ext2_inode_private *private = vnode->i_private;
 
-	struct buffer *i3buf = read_block(dev, block, blksize);
-	for (unsigned i = 0; i*max_indirect2 < len; i++) {
-		uint32_t block = ((uint32_t*)i3buf->b_data)[i];
-		buffers_from_indirect2(dev, block, blksize,
-				blocks + i*max_indirect2, len - i*max_indirect2);
+	if (buf) {
+		((uint32_t*)buf->b_data)[i] = block;
+		mark_buffer_dirty(buf);
+	} else {
+		private->inode->block[i] = block;
+		mark_buffer_dirty(private->buf);
 	}
-	release_buffer(i3buf);
-	return len;
 }
 
 /*
- * Flatten an ext2 inode block list into a bio_vec.
+ * Choose a goal for allocating logical block @lblk: the block following the
+ * previous logical block, if it is mapped.
  */
-struct bio_vec *ext2_inode_to_bio_vec(struct inode *vnode)
+static blkcnt_t ext2_find_goal(struct block_map *map, blkcnt_t lblk)
 {
-	struct ext2_superblock *sb = ext2_superblock(vnode->i_sb);
+	struct ext2_inode_private *private = ((struct inode*)map->private)->i_private;
+	blkcnt_t pblk, len;
+
+	if (lblk > 0 && (pblk = bmap(map, lblk - 1, &len)) > 0)
+		return pblk + 1;
+	if (private->prealloc_count)
+		return private->prealloc_block;
+	return -1;
+}
+
+/*
+ * Allocate a data block for the hole at logical block @lblk, along with any
+ * missing indirect blocks on the path to it.  New indirect blocks are zeroed.
+ */
+static blkcnt_t ext2_alloc_block(struct block_map *map, blkcnt_t lblk)
+{
+	struct inode *vnode = map->private;
 	struct ext2_inode *inode = ext2_inode(vnode);
+	const unsigned long per_block = map->blksize / sizeof(uint32_t);
+	unsigned long offsets[4];
+	struct buffer *buf = NULL, *next = NULL;
+	uint32_t *table = NULL;
+	blkcnt_t goal = ext2_find_goal(map, lblk);
+	int depth;
+
+	if ((depth = ext2_block_to_path(per_block, lblk, offsets)) < 0)
+		return -EFBIG;
+
+	for (int i = 0; ; i++) {
+		blkcnt_t block = ext2_block_entry(inode, table, offsets[i]);
+		bool leaf = i == depth - 1;
+
+		if (!block) {
+			if ((block = ext2_new_block(vnode, goal)) < 0)
+				goto out;
+			ext2_set_block_entry(vnode, buf, offsets[i], block);
+			goal = block + 1;
+			if (!leaf) {
+				if (!(next = get_buffer(map->dev, block, map->blksize))) {
+					block = -ENOMEM;
+					goto out;
+				}
+				memset(next->b_data, 0, map->blksize);
+				next->b_flags |= BUF_UPTODATE;
+				mark_buffer_dirty(next);
+			}
+		} else if (!leaf) {
+			if (!(next = read_block(map->dev, block, map->blksize))) {
+				block = -EIO;
+				goto out;
+			}
+		}
+		if (leaf) {
+out:
+			if (buf)
+				release_buffer(buf);
+			return block;
+		}
+		if (buf)
+			release_buffer(buf);
+		buf = next;
+		table = buf->b_data;
+	}
+}
+
+/*
+ * Create a block map for an ext2 inode.  No blocks are mapped until they are
+ * accessed.
+ */
+struct block_map *ext2_alloc_block_map(struct inode *vnode)
+{
 	const blksize_t blksize = blkdev_blksize(vnode->i_dev);
-	const uint32_t nr_blocks = ext2_inode_blocks(sb, inode);
-	struct bio_vec *bio = alloc_bio_vec(vnode->i_dev, nr_blocks, blksize);
-	unsigned i = 0;
-
-	// direct blocks
-	for (; i < 12 && i < nr_blocks; i++) {
-		bio->block[i] = inode->block[i];
-	}
-	if (i == nr_blocks)
-		return bio;
-
-	// indirect blocks
-	i += buffers_from_indirect(vnode->i_dev, inode->block[12], blksize,
-			&bio->block[i], nr_blocks - i);
-	if (i == nr_blocks)
-		return bio;
-
-	// doubly-indirect blocks
-	i += buffers_from_indirect2(vnode->i_dev, inode->block[13], blksize,
-			&bio->block[i], nr_blocks - i);
-	if (i == nr_blocks)
-		return bio;
-
-	// triply-indirect blocks
-	i += buffers_from_indirect3(vnode->i_dev, inode->block[14], blksize,
-			&bio->block[i], nr_blocks - i);
-	return bio;
+	blkcnt_t blkcnt = (vnode->i_size + blksize - 1) / blksize;
+	struct block_map *map;
+
+	map = alloc_block_map(vnode->i_dev, blkcnt, blksize, ext2_get_extent,
+			vnode);
+	if (map)
+		map->alloc_block = ext2_alloc_block;
+	return map;
+}
+
+/*
+ * Read logical block @lblk of a file.  If the block is a hole and @create is
+ * set, a zeroed block is allocated.
+ */
+struct buffer *ext2_bread(struct inode *vnode, blkcnt_t lblk, bool create)
+{
+	struct block_map *map = vnode->i_map;
+	struct buffer *buf;
+	blkcnt_t pblk, len;
+
+	if ((pblk = bmap(map, lblk, &len)) < 0)
+		return NULL;
+	if (pblk)
+		return read_block(map->dev, pblk, map->blksize);
+	if (!create || (pblk = bmap_alloc(map, lblk)) < 0)
+		return NULL;
+	if (!(buf = get_buffer(map->dev, pblk, map->blksize)))
+		return NULL;
+	memset(buf->b_data, 0, map->blksize);
+	buf->b_flags |= BUF_UPTODATE;
+	mark_buffer_dirty(buf);
+	return buf;
+}
+
+static void ext2_release_block(struct inode *vnode, uint32_t block)
+{
+	struct ext2_superblock *sb = ext2_superblock(vnode->i_sb);
+
+	ext2_free_blocks(vnode->i_sb, block, 1);
+	ext2_inode(vnode)->blocks -= ext2_block_sectors(sb);
+}
+
+/*
+ * Free the blocks of the subtree rooted at *@entry (of height @level, where 0
+ * is a data block) at or after logical offset @from within the subtree.  If
+ * the whole subtree is freed, *@entry is cleared.
+ */
+static void ext2_truncate_branch(struct inode *vnode, uint32_t *entry,
+		int level, blkcnt_t from)
+{
+	const blksize_t blksize = vnode->i_map->blksize;
+	const unsigned long per_block = blksize / sizeof(uint32_t);
+	struct buffer *buf;
+	blkcnt_t span = 1;
+	uint32_t *table;
+
+	if (!*entry)
+		return;
+	if (level > 0) {
+		for (int i = 1; i < level; i++)
+			span *= per_block;
+		if (!(buf = read_block(vnode->i_dev, *entry, blksize)))
+			return;
+		table = buf->b_data;
+		for (unsigned long i = from / span; i < per_block; i++) {
+			blkcnt_t sub = i == (unsigned long) (from / span) ? from % span : 0;
+			ext2_truncate_branch(vnode, &table[i], level - 1, sub);
+		}
+		mark_buffer_dirty(buf);
+		release_buffer(buf);
+	}
+	if (!from) {
+		ext2_release_block(vnode, *entry);
+		*entry = 0;
+	}
+}
+
+/*
+ * Change the size of a file, freeing any blocks beyond the new end.
+ */
+int ext2_truncate(struct inode *vnode, size_t len)
+{
+	struct ext2_inode_private *private = vnode->i_private;
+	struct ext2_inode *inode = private->inode;
+	struct block_map *map = vnode->i_map;
+	const unsigned long per_block = map->blksize / sizeof(uint32_t);
+	blkcnt_t keep = (len + map->blksize - 1) / map->blksize;
+	blkcnt_t base = EXT2_NDIR_BLOCKS, span = per_block;
+	struct buffer *buf;
+
+	ext2_discard_prealloc(vnode);
+	if (len >= vnode->i_size)
+		goto out;
+
+	// zero the tail of the new last block, in case the file grows again
+	if (len % map->blksize && (buf = ext2_bread(vnode, len / map->blksize,
+					false))) {
+		memset((char*)buf->b_data + len % map->blksize, 0,
+				map->blksize - len % map->blksize);
+		mark_buffer_dirty(buf);
+		release_buffer(buf);
+	}
+
+	for (blkcnt_t i = keep; i < EXT2_NDIR_BLOCKS; i++) {
+		if (inode->block[i]) {
+			ext2_release_block(vnode, inode->block[i]);
+			inode->block[i] = 0;
+		}
+	}
+	for (int level = 1; level <= 3; level++) {
+		if (keep < base + span) {
+			uint32_t entry = inode->block[EXT2_NDIR_BLOCKS + level - 1];
+			ext2_truncate_branch(vnode, &entry, level,
+					keep > base ? keep - base : 0);
+			inode->block[EXT2_NDIR_BLOCKS + level - 1] = entry;
+		}
+		base += span;
+		span *= per_block;
+	}
+out:
+	block_map_resize(map, keep);
+	vnode->i_size = len;
+	inode->mtime = inode->ctime = system_clock;
+	ext2_write_inode(vnode);
+	return 0;
 }
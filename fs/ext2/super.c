@@ -20,19 +20,6 @@
 #include <kernel/mm/slab.h>
 #include "ext2.h"
 
-/*
- * We store the whole ext2 super block and block group descriptor table in
- * memory.
- *
- * FIXME: block group descriptor table may span multiple blocks
- */
-struct ext2_sb_private {
-	struct ext2_superblock *sb;
-	struct ext2_bg_descriptor *bg_table;
-	struct buffer *sb_buf;
-	struct buffer *bg_buf;
-};
-
 /*
  * Get the ext2 super block from the VFS super block.
  */
@@ -46,7 +33,7 @@ struct ext2_superblock *ext2_superblock(struct super_block *sb)
  */
 static int inodes_per_block(struct ext2_superblock *sb)
 {
-	return (1024 << sb->log_block_size) / sizeof(struct ext2_inode);
+	return ext2_block_size(sb) / ext2_inode_size(sb);
 }
 
 /*
@@ -68,29 +55,40 @@ static uint32_t inode_local_index(struct ext2_superblock *sb, uint32_t ino)
 }
 
 /*
- * Get the filesystem block size.
+ * Get the number of blocks groups for a given filesystem.
  */
-static blksize_t ext2_block_size(struct ext2_superblock *sb)
+static blkcnt_t block_groups_count(struct ext2_superblock *sb)
 {
-	return 1024 << sb->log_block_size;
+	return (sb->blocks_count - sb->first_data_block) / sb->blocks_per_group
+		+ ((sb->blocks_count - sb->first_data_block)
+				% sb->blocks_per_group ? 1 : 0);
 }
 
 /*
- * Get the number of blocks groups for a given filesystem.
+ * Get the block group descriptor for a block group.  If @buf is not NULL, the
+ * buffer containing the descriptor is stored there so that the caller can
+ * mark it dirty.  The buffer remains owned by the super block.
  */
-static blkcnt_t block_groups_count(struct ext2_superblock *sb)
+struct ext2_bg_descriptor *ext2_group_desc(struct super_block *vsb,
+		unsigned long group, struct buffer **buf)
 {
-	return sb->blocks_count / sb->blocks_per_group 
-		+ (sb->blocks_count % sb->blocks_per_group ? 1 : 0);
+	struct ext2_sb_private *private = vsb->s_private;
+	unsigned long per_block = ext2_block_size(private->sb)
+		/ sizeof(struct ext2_bg_descriptor);
+	struct buffer *b = private->bg_bufs[group / per_block];
+
+	if (buf)
+		*buf = b;
+	return &((struct ext2_bg_descriptor*)b->b_data)[group % per_block];
 }
 
 /*
- * Get the block group descriptor for a given inode number.
+ * Mark the on-disk super block dirty, e.g. after changing a free count.
  */
-static struct ext2_bg_descriptor *ino_to_bg(struct ext2_sb_private *private,
-		uint32_t ino)
+void ext2_mark_sb_dirty(struct super_block *vsb)
 {
-	return &private->bg_table[inode_block_group_nr(private->sb, ino)];
+	struct ext2_sb_private *private = vsb->s_private;
+	mark_buffer_dirty(private->sb_buf);
 }
 
 struct ext2_inode *ext2_iget(struct super_block *vsb, ino_t ino,
@@ -99,10 +97,11 @@ struct ext2_inode *ext2_iget(struct super_block *vsb, ino_t ino,
 	// unpack ext2 private data
 	struct ext2_sb_private *private = vsb->s_private;
 	struct ext2_superblock *sb = private->sb;
-	struct ext2_bg_descriptor *bg = ino_to_bg(private, ino);
+	struct ext2_bg_descriptor *bg = ext2_group_desc(vsb,
+			inode_block_group_nr(sb, ino), NULL);
 
 	// number of inode structures per block of the inode table
-	uint32_t inodes_per_block = ext2_block_size(sb) / sizeof(struct ext2_inode);
+	uint32_t inodes_per_block = ext2_block_size(sb) / ext2_inode_size(sb);
 
 	// index into the block group's inode table
 	uint32_t local_index = inode_local_index(sb, ino);
@@ -114,19 +113,39 @@ struct ext2_inode *ext2_iget(struct super_block *vsb, ino_t ino,
 	uint32_t block_index = local_index % inodes_per_block;
 
 	// read the block containing the inode
-	// FIXME: check for IO error
 	struct buffer *ibuf = read_block(vsb->s_dev,
 			bg->inode_table + table_block,
 			ext2_block_size(sb));
+	if (!ibuf)
+		return NULL;
 
 	// index into inode table
-	struct ext2_inode *inode_table = ibuf->b_data;
-	return &inode_table[block_index];
+	*buf = ibuf;
+	return (void*)((char*)ibuf->b_data + block_index * ext2_inode_size(sb));
+}
+
+/*
+ * A file system with read-only compatible features that we don't implement
+ * may be read, but not written.
+ */
+static bool ext2_ro_compat_ok(struct ext2_superblock *sb)
+{
+	return !(sb->feature_ro_compat & ~EXT2_FEATURE_RO_COMPAT_SUPP);
+}
+
+static int ext2_remount_fs(struct super_block *sb, int *flags,
+		const void *data)
+{
+	if (!(*flags & MS_RDONLY) && !ext2_ro_compat_ok(ext2_superblock(sb)))
+		return -EROFS;
+	return 0;
 }
 
 struct super_operations ext2_super_ops = {
 	.read_inode = ext2_read_inode,
+	.write_inode = ext2_write_inode,
 	.put_inode = ext2_put_inode,
+	.remount_fs = ext2_remount_fs,
 };
 
 static struct ext2_sb_private *alloc_sb_private(void)
@@ -134,37 +153,54 @@ static struct ext2_sb_private *alloc_sb_private(void)
 	struct ext2_sb_private *p = kmalloc(sizeof(struct ext2_sb_private));
 	if (p) {
 		p->sb_buf = NULL;
-		p->bg_buf = NULL;
+		p->bg_bufs = NULL;
+		p->nr_bg_blocks = 0;
 	}
 	return p;
 }
 
 static void free_sb_private(struct ext2_sb_private *private)
 {
-	release_buffer(private->sb_buf);
-	release_buffer(private->bg_buf);
+	if (!private)
+		return;
+	for (unsigned long i = 0; i < private->nr_bg_blocks; i++)
+		release_buffer(private->bg_bufs[i]);
+	if (private->bg_bufs)
+		kfree(private->bg_bufs);
+	if (private->sb_buf)
+		release_buffer(private->sb_buf);
 	kfree(private);
 }
 
+/*
+ * The super block is always at byte offset 1024; the block group descriptor
+ * table starts in the block following the super block, and may span several
+ * blocks.
+ */
 static int do_read_super(struct super_block *sb, struct ext2_sb_private *private)
 {
 	blksize_t blksize = blkdev_blksize(sb->s_dev);
 	blkcnt_t sb_block = blksize == 1024 ? 1 : 0;
-	blkcnt_t bg_block = blksize == 1024 ? 2 : 1;
+	unsigned long per_block = blksize / sizeof(struct ext2_bg_descriptor);
 
-	// read the super block and block group descriptor table
-	private->sb_buf = read_block(sb->s_dev, sb_block, blksize);
-	private->bg_buf = read_block(sb->s_dev, bg_block, blksize);
-
-	if (!private->sb_buf || !private->bg_buf) {
-		release_buffer(private->sb_buf);
-		release_buffer(private->bg_buf);
+	if (!(private->sb_buf = read_block(sb->s_dev, sb_block, blksize)))
 		return -EIO;
-	}
-
-	private->sb = private->sb_buf->b_data;
-	private->bg_table = private->bg_buf->b_data;
+	private->sb = (void*)((char*)private->sb_buf->b_data
+			+ (blksize == 1024 ? 0 : 1024));
+	private->nr_groups = block_groups_count(private->sb);
 
+	private->nr_bg_blocks = 0;
+	private->bg_bufs = kmalloc(sizeof(struct buffer*)
+			* ((private->nr_groups + per_block - 1) / per_block));
+	if (!private->bg_bufs)
+		return -ENOMEM;
+	for (unsigned long i = 0; i * per_block < private->nr_groups; i++) {
+		struct buffer *buf = read_block(sb->s_dev, sb_block + 1 + i,
+				blksize);
+		if (!buf)
+			return -EIO;
+		private->bg_bufs[private->nr_bg_blocks++] = buf;
+	}
 	return 0;
 }
 
@@ -188,10 +224,28 @@ struct super_block *ext2_read_super(struct super_block *sb, void *data,
 			kprintf("error reading superblock\n");
 		goto fail;
 	}
+	if (private->sb->feature_incompat & ~EXT2_FEATURE_INCOMPAT_SUPP) {
+		if (!silent)
+			kprintf("ext2: unsupported features (%lx)\n",
+					(unsigned long) private->sb->feature_incompat
+					& ~EXT2_FEATURE_INCOMPAT_SUPP);
+		goto fail;
+	}
+	if (!ext2_ro_compat_ok(private->sb) && !(sb->s_flags & MS_RDONLY)) {
+		kprintf("ext2: unsupported features (%lx); mounting read-only\n",
+				(unsigned long) private->sb->feature_ro_compat
+				& ~EXT2_FEATURE_RO_COMPAT_SUPP);
+		sb->s_flags |= MS_RDONLY;
+	}
+	sb->s_private = private;
 
 	sb->s_op = &ext2_super_ops;
-	sb->s_private = private;
-	sb->s_mounted = iget(sb, EXT2_ROOT_INO);
+	if (!(sb->s_mounted = iget(sb, EXT2_ROOT_INO))) {
+		if (!silent)
+			kprintf("ext2: unable to read root inode\n");
+		sb->s_private = NULL;
+		goto fail;
+	}
 	return sb;
 fail:
 	free_sb_private(private);
@@ -15,13 +15,43 @@
  *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <kernel/cmdline.h>
 #include <kernel/fs.h>
 #include <kernel/hashtable.h>
+#include <kernel/mm/paging.h>
 #include <kernel/mm/slab.h>
 #include <telos/fcntl.h>
 #include <telos/stat.h>
 
-static DEFINE_HASHTABLE(inodes, 9);
+static u32 inode_hash_key(struct hlist_node *node);
+static DEFINE_HTABLE(inodes, 9, inode_hash_key);
+
+/*
+ * Inodes whose last reference is dropped stay in the hash table, on an LRU
+ * list, so that reopening a recently used file doesn't have to read the inode
+ * and rebuild the file system's private state.  At most inode_cache_max unused
+ * inodes are kept; beyond that, and under memory pressure, the least recently
+ * used are evicted.  Deleted inodes are evicted immediately.
+ */
+#define INODE_CACHE_DEFAULT 512
+
+static LIST_HEAD(inode_lru); // least recently used first
+static unsigned long nr_unused_inodes;
+static unsigned long inode_cache_max = INODE_CACHE_DEFAULT;
+
+static unsigned long shrink_inode_cache(unsigned long nr);
+
+static struct shrinker inode_shrinker = {
+	.shrink = shrink_inode_cache,
+};
+
+SYSINIT(inode_cache, SUB_VFS)
+{
+	unsigned long max;
+	if (!cmdline_ulong("icache", &max))
+		set_inode_cache_max(max);
+	register_shrinker(&inode_shrinker);
+}
 
 static DEFINE_SLAB_CACHE(file_cachep, sizeof(struct file));
 static DEFINE_SLAB_CACHE(inode_cachep, sizeof(struct inode));
@@ -33,6 +63,8 @@ struct file *get_empty_file(void)
 	struct file *filp = slab_alloc(file_cachep);
 	if (filp) {
 		filp->f_count = 1;
+		filp->f_ra = (struct file_ra) { 0 };
+		filp->f_private = NULL;
 		list_add(&filp->chain, &files);
 	}
 	return filp;
@@ -56,7 +88,10 @@ void file_unref(struct file *file)
 
 struct inode *get_empty_inode(void)
 {
-	return slab_alloc(inode_cachep);
+	struct inode *inode = slab_alloc(inode_cachep);
+	if (inode)
+		INIT_LIST_HEAD(&inode->i_lru);
+	return inode;
 }
 
 bool fs_may_remount_ro(dev_t dev)
@@ -82,15 +117,31 @@ static void write_inode(struct inode *inode)
 	inode->i_sb->s_op->write_inode(inode);
 }
 
-static void read_inode(struct inode *inode)
+static int read_inode(struct inode *inode)
 {
 	if (inode->i_sb && inode->i_sb->s_op && inode->i_sb->s_op->read_inode)
-		inode->i_sb->s_op->read_inode(inode);
+		return inode->i_sb->s_op->read_inode(inode);
+	return 0;
+}
+
+/*
+ * Inode numbers are only unique within a file system, and small numbers are
+ * common to all of them, so the super block is mixed into the key.
+ */
+static u32 inode_key(struct super_block *sb, ino_t ino)
+{
+	return hash_ptr(sb, 32) ^ hash_long(ino, 32);
+}
+
+static u32 inode_hash_key(struct hlist_node *node)
+{
+	struct inode *inode = hlist_entry(node, struct inode, i_hash);
+	return inode_key(inode->i_sb, inode->i_ino);
 }
 
 void insert_inode_hash(struct inode *inode)
 {
-	hash_add(inodes, &inode->i_hash, inode->i_ino);
+	htable_add(&inodes, &inode->i_hash, inode_key(inode->i_sb, inode->i_ino));
 }
 
 struct inode *iget(struct super_block *sb, ino_t ino)
@@ -105,9 +156,12 @@ struct inode *__iget(struct super_block *sb, ino_t ino, bool crossmntp)
 	if (!sb)
 		panic("VFS: iget with sb==NULL");
 
-	hash_for_each_possible(inodes, inode, i_hash, ino) {
+	htable_for_each_possible(&inodes, inode, i_hash, inode_key(sb, ino)) {
 		if (inode->i_ino == ino && inode->i_sb == sb) {
-			inode->i_count++;
+			if (!inode->i_count++ && !list_empty(&inode->i_lru)) {
+				list_del_init(&inode->i_lru);
+				nr_unused_inodes--;
+			}
 			if (crossmntp && inode->i_mount) {
 				struct inode *tmp = inode->i_mount;
 				tmp->i_count++;
@@ -126,21 +180,91 @@ struct inode *__iget(struct super_block *sb, ino_t ino, bool crossmntp)
 	inode->i_ino = ino;
 	inode->i_flags = sb->s_flags;
 	inode->i_count = 1;
-	inode->i_bio = NULL;
-	hash_add(inodes, &inode->i_hash, ino);
-	read_inode(inode);
+	inode->i_map = NULL;
+	INIT_LIST_HEAD(&inode->i_lru);
+	htable_add(&inodes, &inode->i_hash, inode_key(sb, ino));
+	if (read_inode(inode) < 0) {
+		htable_del(&inodes, &inode->i_hash);
+		slab_free(inode_cachep, inode);
+		return NULL;
+	}
 	return inode;
 }
 
+/*
+ * Free an unused inode.
+ */
+static void evict(struct inode *inode)
+{
+	struct super_operations *ops = inode->i_sb->s_op;
+
+	if (!list_empty(&inode->i_lru)) {
+		list_del(&inode->i_lru);
+		nr_unused_inodes--;
+	}
+	// a deleted directory's number may be reused
+	if (!inode->i_nlink && S_ISDIR(inode->i_mode))
+		dcache_purge_dir(inode->i_sb, inode->i_ino);
+	if (ops && ops->put_inode)
+		ops->put_inode(inode);
+	htable_del(&inodes, &inode->i_hash);
+	slab_free(inode_cachep, inode);
+}
+
+static void prune_inodes(unsigned long nr)
+{
+	while (nr-- && !list_empty(&inode_lru))
+		evict(list_first_entry(&inode_lru, struct inode, i_lru));
+}
+
 void iput(struct inode *inode)
 {
 	if (!inode)
 		return;
-	if (--inode->i_count == 0 && !(inode->i_flags & MS_MEMFS)) {
-		struct super_operations *ops = inode->i_sb->s_op;
-		if (ops && ops->put_inode)
-			ops->put_inode(inode);
-		hash_del(&inode->i_hash);
-		slab_free(inode_cachep, inode);
+	if (--inode->i_count || (inode->i_flags & MS_MEMFS))
+		return;
+	if (!inode->i_nlink) {
+		evict(inode);
+		return;
 	}
+	write_inode(inode);
+	list_add_tail(&inode->i_lru, &inode_lru);
+	if (++nr_unused_inodes > inode_cache_max)
+		prune_inodes(nr_unused_inodes - inode_cache_max);
+}
+
+/*
+ * Evict the unused inodes of a file system which is being unmounted.
+ */
+void evict_inodes(struct super_block *sb)
+{
+	struct inode *inode, *tmp;
+
+	list_for_each_entry_safe(inode, tmp, &inode_lru, i_lru) {
+		if (inode->i_sb == sb)
+			evict(inode);
+	}
+}
+
+/*
+ * Slab pages aren't returned to the frame pool, so evicting inodes frees no
+ * pages directly; but it releases the buffers and block maps they pin, for the
+ * buffer cache shrinker to reclaim.
+ */
+static unsigned long shrink_inode_cache(unsigned long nr)
+{
+	prune_inodes(nr * (FRAME_SIZE / sizeof(struct inode)));
+	return 0;
+}
+
+/*
+ * Set the maximum number of unused inodes kept in the cache, evicting inodes
+ * as needed to meet the new limit.
+ */
+int set_inode_cache_max(unsigned long max)
+{
+	inode_cache_max = max;
+	if (nr_unused_inodes > max)
+		prune_inodes(nr_unused_inodes - max);
+	return 0;
 }
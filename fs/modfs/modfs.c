@@ -17,7 +17,9 @@
 
 #include <kernel/fs.h>
 #include <kernel/ramfs.h>
+#include <kernel/mmap.h>
 #include <kernel/multiboot.h>
+#include <kernel/mm/paging.h>
 #include <telos/stat.h>
 #include <string.h>
 
@@ -32,8 +34,23 @@ static ssize_t modfs_read(struct file *file, char *buf, size_t len,
 	return len;
 }
 
+/*
+ * Modules are page aligned, so whole pages of a module can be mapped into
+ * user space directly.  The last page may be shared with whatever follows
+ * the module, so it's copied.
+ */
+static uintptr_t modfs_mmap_frame(struct file *file, unsigned long pos)
+{
+	struct multiboot_mod_list *mod = file->f_inode->i_private;
+
+	if (pos + FRAME_SIZE > file->f_inode->i_size)
+		return 0;
+	return kernel_to_phys(mod->start + pos);
+}
+
 static struct file_operations modfs_dir_fops = {
 	.readdir = ramfs_readdir,
+	.release = ramfs_dir_release,
 };
 
 static struct inode_operations modfs_dir_iops = {
@@ -43,6 +60,7 @@ static struct inode_operations modfs_dir_iops = {
 
 static struct file_operations modfs_reg_fops = {
 	.read = modfs_read,
+	.mmap_frame = modfs_mmap_frame,
 };
 
 static struct inode_operations modfs_reg_iops = {
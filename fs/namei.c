@@ -36,7 +36,9 @@ int lookup(struct inode *dir, const char *name, int len,
 		struct inode **result)
 {
 	struct super_block *sb;
-	int perm;
+	unsigned long seq;
+	ino_t ino;
+	int perm, error;
 
 	*result = NULL;
 	if (!dir)
@@ -71,7 +73,28 @@ int lookup(struct inode *dir, const char *name, int len,
 		*result = dir;
 		return 0;
 	}
-	return dir->i_op->lookup(dir, name, len, result);
+
+	if (dcache_lookup(dir, name, len, &ino)) {
+		if (!ino) {
+			iput(dir);
+			return -ENOENT;
+		}
+		if ((*result = iget(dir->i_sb, ino))) {
+			iput(dir);
+			return 0;
+		}
+	}
+
+	// the file system's lookup consumes dir
+	sb = dir->i_sb;
+	ino = dir->i_ino;
+	seq = dcache_sequence();
+	error = dir->i_op->lookup(dir, name, len, result);
+	if (!error)
+		dcache_add(sb, ino, name, len, *result, seq);
+	else if (error == -ENOENT)
+		dcache_add(sb, ino, name, len, NULL, seq);
+	return error;
 }
 
 int follow_link(struct inode *dir, struct inode *inode, int flag, int mode,
@@ -213,6 +236,7 @@ int open_namei(const char *pathname, int flag, int mode,
 			dir->i_count++;
 			error = dir->i_op->create(dir, basename, namelen,
 					mode, res_inode);
+			dcache_remove(dir->i_sb, dir->i_ino, basename, namelen);
 			iput(dir);
 			return error;
 		}
@@ -284,7 +308,11 @@ long sys_mknod(const char *filename, size_t name_len, int mode, dev_t dev)
 		iput(dir);
 		return -EPERM;
 	}
-	return dir->i_op->mknod(dir, basename, namelen, mode, dev);
+	dir->i_count++;
+	error = dir->i_op->mknod(dir, basename, namelen, mode, dev);
+	dcache_remove(dir->i_sb, dir->i_ino, basename, namelen);
+	iput(dir);
+	return error;
 }
 
 long sys_mkdir(const char *pathname, size_t name_len, int mode)
@@ -315,7 +343,11 @@ long sys_mkdir(const char *pathname, size_t name_len, int mode)
 		iput(dir);
 		return -EPERM;
 	}
-	return dir->i_op->mkdir(dir, basename, namelen, mode);
+	dir->i_count++;
+	error = dir->i_op->mkdir(dir, basename, namelen, mode);
+	dcache_remove(dir->i_sb, dir->i_ino, basename, namelen);
+	iput(dir);
+	return error;
 }
 
 long sys_rmdir(const char *pathname, size_t name_len)
@@ -346,7 +378,11 @@ long sys_rmdir(const char *pathname, size_t name_len)
 		iput(dir);
 		return -EPERM;
 	}
-	return dir->i_op->rmdir(dir, basename, namelen);
+	dir->i_count++;
+	error = dir->i_op->rmdir(dir, basename, namelen);
+	dcache_remove(dir->i_sb, dir->i_ino, basename, namelen);
+	iput(dir);
+	return error;
 }
 
 long sys_unlink(const char *pathname, size_t name_len)
@@ -377,7 +413,11 @@ long sys_unlink(const char *pathname, size_t name_len)
 		iput(dir);
 		return -EPERM;
 	}
-	return dir->i_op->unlink(dir, basename, namelen);
+	dir->i_count++;
+	error = dir->i_op->unlink(dir, basename, namelen);
+	dcache_remove(dir->i_sb, dir->i_ino, basename, namelen);
+	iput(dir);
+	return error;
 }
 
 long sys_link(const char *oldname, size_t oldname_len, const char *newname,
@@ -427,7 +467,11 @@ long sys_link(const char *oldname, size_t oldname_len, const char *newname,
 		iput(oldinode);
 		return -EPERM;
 	}
-	return dir->i_op->link(oldinode, dir, basename, namelen);
+	dir->i_count++;
+	error = dir->i_op->link(oldinode, dir, basename, namelen);
+	dcache_remove(dir->i_sb, dir->i_ino, basename, namelen);
+	iput(dir);
+	return error;
 }
 
 static inline int is_dotlink(const char *name, int len)
@@ -489,6 +533,13 @@ long sys_rename(const char *oldname, size_t oldname_len, const char *newname,
 		iput(new_dir);
 		return -EPERM;
 	}
-	return old_dir->i_op->rename(old_dir, old_base, old_len, new_dir,
+	old_dir->i_count++;
+	new_dir->i_count++;
+	error = old_dir->i_op->rename(old_dir, old_base, old_len, new_dir,
 			new_base, new_len);
+	dcache_remove(old_dir->i_sb, old_dir->i_ino, old_base, old_len);
+	dcache_remove(new_dir->i_sb, new_dir->i_ino, new_base, new_len);
+	iput(old_dir);
+	iput(new_dir);
+	return error;
 }
@@ -53,6 +53,35 @@ ssize_t pipe_read(struct file *file, char *dst, size_t len, unsigned long *pos)
 	return nr_bytes;
 }
 
+/*
+ * Read into each segment in turn, until the pipe is empty.  Writers are woken
+ * once, after the whole read.
+ */
+ssize_t pipe_readv(struct file *file, const struct iovec *iov,
+		unsigned long nr_segs, unsigned long *pos)
+{
+	ssize_t nr_bytes = 0;
+	struct pipe_private *pipe = file->f_private;
+
+	while (!pipe->buf->size) {
+		if (!pipe->write_end)
+			return 0;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_interruptible(&pipe->read_wait))
+			return -EINTR;
+	}
+	for (unsigned long i = 0; i < nr_segs; i++) {
+		ssize_t n = flexbuf_dequeue(pipe->buf, iov[i].iov_base,
+				iov[i].iov_len);
+		nr_bytes += n;
+		if ((size_t) n < iov[i].iov_len)
+			break;
+	}
+	wake_all(&pipe->write_wait, 0);
+	return nr_bytes;
+}
+
 static size_t pipe_headroom(struct pipe_private *pipe)
 {
 	return PIPE_BUF - pipe->buf->size;
@@ -110,6 +139,50 @@ ssize_t pipe_write(struct file *file, const char *src, size_t len, unsigned long
 	return nr_bytes;
 }
 
+/*
+ * A vectored write of up to PIPE_BUF bytes is written atomically as a single
+ * record, and wakes readers once.  Larger writes are done a segment at a
+ * time.
+ */
+ssize_t pipe_writev(struct file *file, const struct iovec *iov,
+		unsigned long nr_segs, unsigned long *pos)
+{
+	struct pipe_private *pipe = file->f_private;
+	size_t total = 0;
+	ssize_t nr_bytes = 0;
+
+	for (unsigned long i = 0; i < nr_segs; i++)
+		total += iov[i].iov_len;
+
+	if (total > PIPE_BUF) {
+		for (unsigned long i = 0; i < nr_segs; i++) {
+			ssize_t n = pipe_write(file, iov[i].iov_base,
+					iov[i].iov_len, pos);
+			if (n < 0)
+				return nr_bytes ? nr_bytes : n;
+			nr_bytes += n;
+			if ((size_t) n < iov[i].iov_len)
+				break;
+		}
+		return nr_bytes;
+	}
+
+	while (pipe_headroom(pipe) < total) {
+		if (!pipe->read_end)
+			return -EPIPE;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_interruptible(&pipe->write_wait))
+			return -EINTR;
+	}
+	for (unsigned long i = 0; i < nr_segs; i++)
+		nr_bytes += flexbuf_enqueue(&pipe->buf, iov[i].iov_base,
+				iov[i].iov_len);
+	if (nr_bytes)
+		wake_all(&pipe->read_wait, 0);
+	return nr_bytes;
+}
+
 int pipe_release(struct inode *inode, struct file *file)
 {
 	struct pipe_private *pipe = file->f_private;
@@ -129,12 +202,14 @@ int pipe_release(struct inode *inode, struct file *file)
 struct file_operations pipe_read_operations = {
 	.lseek = pipe_lseek,
 	.read = pipe_read,
+	.readv = pipe_readv,
 	.release = pipe_release
 };
 
 struct file_operations pipe_write_operations = {
 	.lseek = pipe_lseek,
 	.write = pipe_write,
+	.writev = pipe_writev,
 	.release = pipe_release
 };
 
@@ -17,34 +17,92 @@
 
 #include <kernel/list.h>
 #include <kernel/fs.h>
+#include <kernel/hashtable.h>
 #include <kernel/ramfs.h>
 #include <kernel/mm/kmalloc.h>
 #include <kernel/mm/paging.h>
 #include <kernel/mm/slab.h>
+#include <kernel/mm/vma.h>
 #include <telos/stat.h>
 
 #include <string.h>
 
+/*
+ * Directory entries are kept on the directory's i_list in creation order,
+ * and in a hash table shared by all ramfs directories for lookup.  Each
+ * entry gets a position (off) when it is added, which only ever increases
+ * along a directory's list; readdir uses these as stable file positions.
+ *
+ * An open directory has a cursor on its list (an entry with len == 0), so
+ * that readdir can continue where it left off even if entries are added or
+ * removed in between.
+ */
 struct ramfs_dirent {
 	struct list_head chain;
+	struct hlist_node hash;
+	struct inode *dir;
 	unsigned long ino;
-	char name[256];
+	unsigned long off;
+	u32 key;
+	unsigned char len;
+	char name[];
 };
 
 struct ramfs_superblock {
 	unsigned long next_ino;
+	unsigned long next_off;
+};
+
+static u32 ramfs_dirent_hash_key(struct hlist_node *node);
+static DEFINE_HTABLE(ramfs_names, 10, ramfs_dirent_hash_key);
+
+/*
+ * Entries are allocated from a few size classes, according to name length.
+ */
+static DEFINE_SLAB_CACHE(ramfs_dirent_64,  64);
+static DEFINE_SLAB_CACHE(ramfs_dirent_128, 128);
+static DEFINE_SLAB_CACHE(ramfs_dirent_256, 256);
+static DEFINE_SLAB_CACHE(ramfs_dirent_512, 512);
+
+static struct slab_cache **ramfs_dirent_caches[] = {
+	&ramfs_dirent_64,
+	&ramfs_dirent_128,
+	&ramfs_dirent_256,
+	&ramfs_dirent_512,
 };
 
-static DEFINE_SLAB_CACHE(ramfs_dirent_cachep, sizeof(struct ramfs_dirent));
 static struct inode_operations ramfs_dir_iops;
 static struct inode_operations ramfs_reg_iops;
 
+static inline unsigned int ramfs_dirent_class(int len)
+{
+	size_t size = sizeof(struct ramfs_dirent) + len + 1;
+	unsigned int class = 0;
+
+	while ((64U << class) < size)
+		class++;
+	return class;
+}
+
+static u32 ramfs_name_key(struct inode *dir, const char *name, int len)
+{
+	return name_hash(hash32_ptr(dir), name, len);
+}
+
+static u32 ramfs_dirent_hash_key(struct hlist_node *node)
+{
+	return hlist_entry(node, struct ramfs_dirent, hash)->key;
+}
+
 static inline struct ramfs_dirent *__lookup(struct inode *dir,
 		const char *name, int len)
 {
 	struct ramfs_dirent *ent;
-	list_for_each_entry(ent, &dir->i_list, chain) {
-		if (ent->name[len] == '\0' && !memcmp(name, ent->name, len))
+	u32 key = ramfs_name_key(dir, name, len);
+
+	htable_for_each_possible(&ramfs_names, ent, hash, key) {
+		if (ent->key == key && ent->dir == dir && ent->len == len
+				&& !memcmp(name, ent->name, len))
 			return ent;
 	}
 	return NULL;
@@ -84,6 +142,7 @@ static struct inode *ramfs_new_inode(struct inode *dir)
 	inode->i_dirt = 0;
 	inode->i_flags = dir->i_sb->s_flags;
 	inode->i_sb = dir->i_sb;
+	inode->i_private = NULL;
 	INIT_LIST_HEAD(&inode->i_list);
 	insert_inode_hash(inode);
 	return inode;
@@ -94,14 +153,47 @@ static struct ramfs_dirent *ramfs_new_dirent(const char *name, int len,
 {
 	struct ramfs_dirent *fsnode;
 
-	if (!(fsnode = slab_alloc(ramfs_dirent_cachep)))
+	if (len > NAME_MAX)
+		return NULL;
+	if (!(fsnode = slab_alloc(*ramfs_dirent_caches[ramfs_dirent_class(len)])))
 		return NULL;
 	memcpy(fsnode->name, name, len);
+	fsnode->name[len] = '\0';
+	fsnode->len = len;
 	fsnode->ino = ino;
-
+	fsnode->dir = NULL;
+	INIT_HLIST_NODE(&fsnode->hash);
 	return fsnode;
 }
 
+static void ramfs_free_dirent(struct ramfs_dirent *fsnode)
+{
+	slab_free(*ramfs_dirent_caches[ramfs_dirent_class(fsnode->len)], fsnode);
+}
+
+/*
+ * Add an entry to the end of a directory.
+ */
+static void ramfs_add_dirent(struct inode *dir, struct ramfs_dirent *ent)
+{
+	struct ramfs_superblock *sb = dir->i_sb->s_private;
+
+	ent->dir = dir;
+	ent->off = sb->next_off++;
+	ent->key = ramfs_name_key(dir, ent->name, ent->len);
+	list_add_tail(&ent->chain, &dir->i_list);
+	htable_add(&ramfs_names, &ent->hash, ent->key);
+	dir->i_size++;
+}
+
+static void ramfs_del_dirent(struct ramfs_dirent *ent)
+{
+	list_del(&ent->chain);
+	htable_del(&ramfs_names, &ent->hash);
+	ent->dir->i_size--;
+	ramfs_free_dirent(ent);
+}
+
 int ramfs_do_mknod(struct inode *dir, const char *name, int len,
 		struct inode **res_inode)
 {
@@ -121,180 +213,220 @@ int ramfs_do_mknod(struct inode *dir, const char *name, int len,
 	inode->i_sb = dir->i_sb;
 	inode->i_size = 0;
 
-	list_add_tail(&ent->chain, &dir->i_list);
-	dir->i_size++;
+	ramfs_add_dirent(dir, ent);
 	*res_inode = inode;
 	return 0;
 }
 
-static int grow_file(struct inode *inode, size_t amount)
+/*
+ * Regular file data is kept in an array of frames indexed by page number, so
+ * that the page backing any offset is found in constant time.  Empty slots
+ * are holes, which read as zeros; pages are only allocated when written.
+ */
+struct ramfs_pages {
+	unsigned long nr_slots;
+	struct pf_info *page[];
+};
+
+static inline struct pf_info *ramfs_page(struct inode *inode, unsigned long i)
 {
-	unsigned int nr_pages;
+	struct ramfs_pages *pages = inode->i_private;
 
-	nr_pages = (((inode->i_size % FRAME_SIZE) + amount) / FRAME_SIZE) + 1;
-	if (nr_pages == 0) {
-		inode->i_size += amount;
-		return 0;
-	}
+	if (!pages || i >= pages->nr_slots)
+		return NULL;
+	return pages->page[i];
+}
 
-	for (unsigned int i = 0; i < nr_pages; i++) {
-		struct pf_info *frame = kalloc_frame(0);
-		if (frame == NULL)
-			return -ENOSPC; // TODO: free frames!!!
-		list_add_tail(&frame->chain, &inode->i_list);
+/*
+ * Make sure the page array has a slot for page @i, growing it by at least
+ * half each time so that extending a file a page at a time is amortized O(1).
+ */
+static int ramfs_grow_slots(struct inode *inode, unsigned long i)
+{
+	struct ramfs_pages *pages, *old = inode->i_private;
+	unsigned long nr = old ? old->nr_slots : 0;
+
+	if (i < nr)
+		return 0;
+	nr = MAX(i + 1, MAX(nr + nr / 2, 8));
+	if (!(pages = kmalloc(sizeof(*pages) + nr * sizeof(*pages->page))))
+		return -ENOSPC;
+	pages->nr_slots = nr;
+	if (old) {
+		memcpy(pages->page, old->page, old->nr_slots * sizeof(*old->page));
+		memset(pages->page + old->nr_slots, 0,
+				(nr - old->nr_slots) * sizeof(*pages->page));
+		kfree(old);
+	} else {
+		memset(pages->page, 0, nr * sizeof(*pages->page));
 	}
-	inode->i_size += amount;
+	inode->i_private = pages;
 	return 0;
 }
 
-ssize_t ramfs_read(struct file *file, char *buf, size_t len, unsigned long *pos)
+/*
+ * Get the page at index @i of a file, allocating it if it's a hole.
+ */
+static struct pf_info *ramfs_get_page(struct inode *inode, unsigned long i)
 {
-	char *fbuf;
-	struct pf_info *frame;
-	unsigned long offset = *pos % FRAME_SIZE;
-	unsigned int frame_nr = *pos / FRAME_SIZE;
-	unsigned int i = 0;
+	struct ramfs_pages *pages;
 
-	if (!len || *pos >= file->f_inode->i_size)
-		return 0;
-	len = MIN(len, file->f_inode->i_size - *pos);
+	if (ramfs_grow_slots(inode, i))
+		return NULL;
+	pages = inode->i_private;
+	if (!pages->page[i])
+		pages->page[i] = kalloc_frame(VM_ZERO);
+	return pages->page[i];
+}
+
+/*
+ * Free the pages from index @start to the end of the file.
+ */
+static void ramfs_free_pages(struct inode *inode, unsigned long start)
+{
+	struct ramfs_pages *pages = inode->i_private;
 
-	list_for_each_entry(frame, &file->f_inode->i_list, chain) {
-		if (i++ < frame_nr)
+	if (!pages)
+		return;
+	for (unsigned long i = start; i < pages->nr_slots; i++) {
+		if (!pages->page[i])
 			continue;
+		kfree_frame(pages->page[i]);
+		pages->page[i] = NULL;
+	}
+	if (!start) {
+		kfree(pages);
+		inode->i_private = NULL;
+	}
+}
 
-		fbuf = kmap_tmp_page(frame->addr);
-		memcpy(buf, fbuf+offset, MIN(FRAME_SIZE-offset, len));
-		kunmap_page(fbuf);
+ssize_t ramfs_read(struct file *file, char *buf, size_t len, unsigned long *pos)
+{
+	struct inode *inode = file->f_inode;
+	size_t done = 0;
 
-		if (len <= FRAME_SIZE)
-			break;
-		buf += FRAME_SIZE - offset;
-		len -= FRAME_SIZE - offset;
-		offset = 0;
+	if (*pos >= inode->i_size)
+		return 0;
+	len = MIN(len, inode->i_size - *pos);
+
+	while (done < len) {
+		struct pf_info *frame = ramfs_page(inode, *pos / FRAME_SIZE);
+		unsigned long offset = *pos % FRAME_SIZE;
+		size_t n = MIN(FRAME_SIZE - offset, len - done);
+
+		if (frame) {
+			char *fbuf = kmap_tmp_page(frame->addr);
+			memcpy(buf + done, fbuf + offset, n);
+			kunmap_tmp_page(fbuf);
+		} else {
+			memset(buf + done, 0, n);
+		}
+		done += n;
+		*pos += n;
 	}
-	*pos += len;
-	return len;
+	return done;
 }
 
-static int ramfs_do_write(struct file *f, const char *buf, size_t len,
-		unsigned long pos)
+ssize_t ramfs_write(struct file *file, const char *buf, size_t len,
+		unsigned long *pos)
 {
-	char *fbuf;
-	struct pf_info *frame;
-	unsigned long offset = pos % FRAME_SIZE;
-	unsigned int frame_nr = pos / FRAME_SIZE;
-	unsigned int i = 0;
-
-	list_for_each_entry(frame, &f->f_inode->i_list, chain) {
-		if (i++ < frame_nr)
-			continue;
+	struct inode *inode = file->f_inode;
+	size_t done = 0;
 
-		fbuf = kmap_tmp_page(frame->addr);
-		memcpy(fbuf+offset, buf, MIN(FRAME_SIZE-offset, len));
-		kunmap_page(fbuf);
+	while (done < len) {
+		struct pf_info *frame = ramfs_get_page(inode, *pos / FRAME_SIZE);
+		unsigned long offset = *pos % FRAME_SIZE;
+		size_t n = MIN(FRAME_SIZE - offset, len - done);
+		char *fbuf;
 
-		if (len <= FRAME_SIZE)
+		if (!frame)
 			break;
-		buf += FRAME_SIZE - offset;
-		len -= FRAME_SIZE - offset;
-		offset = 0;
+		fbuf = kmap_tmp_page(frame->addr);
+		memcpy(fbuf + offset, buf + done, n);
+		kunmap_tmp_page(fbuf);
+		done += n;
+		*pos += n;
 	}
-	return len;
+	if (*pos > inode->i_size)
+		inode->i_size = *pos;
+	return done ? (ssize_t) done : (len ? -ENOSPC : 0);
 }
 
-static void zero_fill(struct inode *inode, unsigned long start, size_t len)
+int ramfs_truncate(struct inode *inode, size_t len)
 {
-	char *fbuf;
 	struct pf_info *frame;
-	unsigned long offset = start % FRAME_SIZE;
-	unsigned long frame_nr = start / FRAME_SIZE;
-	unsigned int i = 0;
 
-	list_for_each_entry(frame, &inode->i_list, chain) {
-		if (i++ < frame_nr)
-			continue;
+	// growing just adds a hole
+	if (len >= inode->i_size) {
+		inode->i_size = len;
+		return 0;
+	}
 
-		fbuf = kmap_tmp_page(frame->addr);
-		memset(fbuf+offset, 0, MIN(FRAME_SIZE-offset, len));
-		kunmap_page(fbuf);
+	if (!len) {
+		ramfs_free_pages(inode, 0);
+		inode->i_size = 0;
+		return 0;
+	}
 
-		if (len <= FRAME_SIZE)
-			break;
-		len -= FRAME_SIZE - offset;
-		offset = 0;
+	ramfs_free_pages(inode, pages_in_range(0, len));
+	if ((frame = ramfs_page(inode, len / FRAME_SIZE))) {
+		// clear the tail of the last page, in case the file grows again
+		char *fbuf = kmap_tmp_page(frame->addr);
+		memset(fbuf + len % FRAME_SIZE, 0, FRAME_SIZE - len % FRAME_SIZE);
+		kunmap_tmp_page(fbuf);
 	}
+	inode->i_size = len;
+	return 0;
 }
 
-ssize_t ramfs_write(struct file *file, const char *buf, size_t len,
-		unsigned long *pos)
+int ramfs_readdir(struct inode *dir, struct file *file, void *dirent,
+		filldir_t filldir)
 {
-	int error, rc;
-	unsigned long next_pos = *pos + len;
-	unsigned long prev_size = file->f_inode->i_size;
-
-	if (next_pos > file->f_inode->i_size) {
-		error = grow_file(file->f_inode, next_pos - file->f_inode->i_size);
-		if (error)
-			return error;
+	struct ramfs_dirent *ent, *cursor = file->f_private;
+	struct list_head *p;
+
+	if (!cursor) {
+		if (!(cursor = ramfs_new_dirent("", 0, 0)))
+			return -ENOMEM;
+		cursor->dir = dir;
+		cursor->off = 0;
+		list_add(&cursor->chain, &dir->i_list);
+		file->f_private = cursor;
 	}
 
-	// fill gap with zeros if we've seeked past EOF
-	if (*pos > prev_size)
-		zero_fill(file->f_inode, prev_size, *pos - prev_size);
-
-	rc = ramfs_do_write(file, buf, len, *pos);
-	if (rc > 0)
-		*pos += rc;
-	return rc;
-}
+	// f_pos is the position of the next entry; reposition after lseek
+	if (cursor->off != file->f_pos) {
+		list_del(&cursor->chain);
+		list_for_each(p, &dir->i_list) {
+			ent = list_entry(p, struct ramfs_dirent, chain);
+			if (ent->len && ent->off >= file->f_pos)
+				break;
+		}
+		list_add_tail(&cursor->chain, p);
+		cursor->off = file->f_pos;
+	}
 
-int ramfs_truncate(struct inode *inode, size_t len)
-{
-	unsigned int nr_pages = pages_in_range(0, len);
-	unsigned int old_nr_pages = pages_in_range(0, inode->i_size);
-	int page_diff = nr_pages - old_nr_pages;
-	ssize_t diff = len - inode->i_size;
-
-	if (diff > 0) {
-		unsigned long prev_size = inode->i_size;
-		int error = grow_file(inode, diff);
-		if (error)
-			return error;
-		zero_fill(inode, prev_size, len);
-		return 0;
-	} else for (; page_diff < 0; page_diff++) {
-		struct pf_info *frame;
-		if (list_empty(&inode->i_list)) {
-			warn("ramfs: expected more frames in truncate");
+	while ((p = cursor->chain.next) != &dir->i_list) {
+		ent = list_entry(p, struct ramfs_dirent, chain);
+		if (ent->len && filldir(dirent, ent->name, ent->len, ent->off + 1,
+					ent->ino, DT_UNKNOWN))
 			break;
-		}
-		frame = list_entry(inode->i_list.prev, struct pf_info, chain);
-		list_del(&frame->chain);
-		kfree_frame(frame);
+		list_move(&cursor->chain, p);
+		if (ent->len)
+			cursor->off = file->f_pos = ent->off + 1;
 	}
 	return 0;
-
 }
 
-int ramfs_readdir(struct inode *dir, struct file *file, struct dirent *dirent,
-		int count)
+int ramfs_dir_release(struct inode *dir, struct file *file)
 {
-	struct ramfs_dirent *ent;
-	unsigned long i = 0;
+	struct ramfs_dirent *cursor = file->f_private;
 
-	if (dirent->d_off >= dir->i_size)
-		return -ENOENT; // ???
-
-	list_for_each_entry(ent, &dir->i_list, chain) {
-		if (i == dirent->d_off)
-			break;
-		i++;
+	if (cursor) {
+		list_del(&cursor->chain);
+		ramfs_free_dirent(cursor);
+		file->f_private = NULL;
 	}
-
-	dirent->d_off++;
-	dirent->d_ino = ent->ino;
-	memcpy(dirent->d_name, ent->name, 256);
 	return 0;
 }
 
@@ -346,15 +478,14 @@ static int mkdir_links(struct inode *parent_dir, struct inode *dir)
 {
 	struct ramfs_dirent *this, *parent;
 
-	if (!(this = ramfs_new_dirent(".", 2, dir->i_ino)))
+	if (!(this = ramfs_new_dirent(".", 1, dir->i_ino)))
 		return -ENOSPC;
-	if (!(parent = ramfs_new_dirent("..", 3, parent_dir->i_ino))) {
-		slab_free(ramfs_dirent_cachep, this);
+	if (!(parent = ramfs_new_dirent("..", 2, parent_dir->i_ino))) {
+		ramfs_free_dirent(this);
 		return -ENOSPC;
 	}
-	list_add(&parent->chain, &dir->i_list);
-	list_add(&this->chain, &dir->i_list);
-	dir->i_size += 2;
+	ramfs_add_dirent(dir, this);
+	ramfs_add_dirent(dir, parent);
 	return 0;
 }
 
@@ -411,9 +542,7 @@ int ramfs_rmdir(struct inode *dir, const char *name, int len)
 		goto end;
 	}
 
-	list_del(&ent->chain);
-	slab_free(ramfs_dirent_cachep, ent);
-	dir->i_size--;
+	ramfs_del_dirent(ent);
 	inode->i_count--;
 	retval = 0;
 end:
@@ -438,9 +567,7 @@ int ramfs_unlink(struct inode *dir, const char *name, int len)
 		goto end;
 	if (--inode->i_nlink == 0)
 		inode->i_flags &= ~MS_MEMFS; // inode may be freed
-	dir->i_size--;
-	list_del(&ent->chain);
-	slab_free(ramfs_dirent_cachep, ent);
+	ramfs_del_dirent(ent);
 	// FIXME-MAYBE: should dirent free wait for iput()?
 	retval = 0;
 end:
@@ -466,8 +593,7 @@ int ramfs_link(struct inode *oldinode, struct inode *dir, const char *name,
 		return -ENOSPC;
 	}
 
-	list_add_tail(&dirent->chain, &dir->i_list);
-	dir->i_size++;
+	ramfs_add_dirent(dir, dirent);
 	oldinode->i_nlink++;
 	iput(dir);
 	iput(oldinode);
@@ -477,18 +603,17 @@ int ramfs_link(struct inode *oldinode, struct inode *dir, const char *name,
 int ramfs_rename(struct inode *old_dir, const char *old_name, int old_len,
 		struct inode *new_dir, const char *new_name, int new_len)
 {
-	struct ramfs_dirent *fsnode;
+	struct ramfs_dirent *fsnode, *new;
 
 	if (!(fsnode = __lookup(old_dir, old_name, old_len)))
 		return -ENOENT;
 	if (__lookup(new_dir, new_name, new_len))
 		return -EEXIST;
+	if (!(new = ramfs_new_dirent(new_name, new_len, fsnode->ino)))
+		return -ENOSPC;
 
-	list_del(&fsnode->chain);
-	list_add_tail(&fsnode->chain, &new_dir->i_list);
-	memcpy(fsnode->name, new_name, new_len);
-	old_dir->i_size--;
-	new_dir->i_size++;
+	ramfs_add_dirent(new_dir, new);
+	ramfs_del_dirent(fsnode);
 	iput(old_dir);
 	iput(new_dir);
 	return 0;
@@ -496,6 +621,7 @@ int ramfs_rename(struct inode *old_dir, const char *old_name, int old_len,
 
 struct file_operations ramfs_dir_fops = {
 	.readdir = ramfs_readdir,
+	.release = ramfs_dir_release,
 };
 
 static struct inode_operations ramfs_dir_iops = {
@@ -520,15 +646,24 @@ static struct inode_operations ramfs_reg_iops = {
 	.default_file_ops = &ramfs_reg_fops,
 };
 
+/*
+ * Called when an unlinked inode is freed.
+ */
+static void ramfs_put_inode(struct inode *inode)
+{
+	if (S_ISREG(inode->i_mode))
+		ramfs_free_pages(inode, 0);
+}
+
 struct super_operations ramfs_super_ops = {
 	.read_inode = NULL,
+	.put_inode = ramfs_put_inode,
 };
 
 struct super_block *ramfs_read_super(struct super_block *sb, void *data,
 		int silent)
 {
 	struct inode *root;
-	struct ramfs_dirent *fsroot;
 	struct ramfs_superblock *fsblock;
 
 	if (!(fsblock = kmalloc(sizeof(struct ramfs_superblock))))
@@ -539,13 +674,9 @@ struct super_block *ramfs_read_super(struct super_block *sb, void *data,
 		return NULL;
 	}
 
-	if (!(fsroot = slab_alloc(ramfs_dirent_cachep))) {
-		kfree(fsblock);
-		iput(root);
-		return NULL;
-	}
-
 	fsblock->next_ino = 1;
+	fsblock->next_off = 0;
+	sb->s_private = fsblock;
 
 	sb->s_flags |= MS_MEMFS;
 	root->i_flags = sb->s_flags;
@@ -555,21 +686,18 @@ struct super_block *ramfs_read_super(struct super_block *sb, void *data,
 	root->i_dev = sb->s_dev;
 	root->i_count = 1;
 	root->i_dirt = 0;
+	root->i_size = 0;
 	root->i_sb = sb;
 	root->i_op = &ramfs_dir_iops;
+	root->i_private = NULL;
 	INIT_LIST_HEAD(&root->i_list);
 	insert_inode_hash(root);
 
-	fsroot->name[0] = '/';
-	fsroot->name[1] = '\0';
-	fsroot->ino = root->i_ino;
-
 	if (mkdir_links(root, root))
 		return NULL;
 
 	sb->s_mounted = root;
 	sb->s_op = &ramfs_super_ops;
-	sb->s_private = fsblock;
 	return sb;
 }
 
@@ -23,24 +23,110 @@
 
 #include <kernel/dispatch.h>
 #include <kernel/fs.h>
+#include <kernel/mm/kmalloc.h>
 #include <kernel/mm/vma.h>
 #include <telos/fcntl.h>
 #include <telos/stat.h>
+#include <string.h>
 
+struct readdir_buf {
+	struct dirent *dirent;
+	int count;
+};
+
+static int fillonedir(void *__buf, const char *name, int len,
+		unsigned long off, ino_t ino, unsigned int type)
+{
+	struct readdir_buf *buf = __buf;
+
+	if (buf->count)
+		return -EINVAL;
+	buf->count++;
+	len = MIN(len, NAME_MAX);
+	buf->dirent->d_ino = ino;
+	buf->dirent->d_off = off;
+	memcpy(buf->dirent->d_name, name, len);
+	buf->dirent->d_name[len] = '\0';
+	return 0;
+}
+
+/*
+ * Read a single directory entry.  Returns -ENOENT at the end of the
+ * directory.  See sys_getdents for reading many entries at once.
+ */
 long sys_readdir(unsigned int fd, struct dirent *dirent, unsigned int count)
 {
+	struct readdir_buf buf = { .dirent = dirent, .count = 0 };
 	struct file *file;
 	struct inode *inode;
+	int error;
 
 	if (vm_verify(&current->mm, dirent, sizeof(*dirent), VM_WRITE))
 		return -EFAULT;
 	if (fd >= NR_FILES || !(file = current->filp[fd]) ||
 			!(inode = file->f_inode))
 		return -EBADF;
+	if (!file->f_op || !file->f_op->readdir)
+		return -ENOTDIR;
 
-	if (file->f_op && file->f_op->readdir)
-		return file->f_op->readdir(inode, file, dirent, count);
-	return -ENOTDIR;
+	if ((error = file->f_op->readdir(inode, file, &buf, fillonedir)) < 0)
+		return error;
+	return buf.count ? 0 : -ENOENT;
+}
+
+struct getdents_buf {
+	char *pos;
+	size_t left;
+	int error;
+};
+
+static int filldir(void *__buf, const char *name, int len, unsigned long off,
+		ino_t ino, unsigned int type)
+{
+	struct getdents_buf *buf = __buf;
+	struct dirent_rec *rec = (struct dirent_rec*) buf->pos;
+	size_t reclen = offsetof(struct dirent_rec, d_name) + len + 1;
+
+	reclen = (reclen + sizeof(long) - 1) & ~(sizeof(long) - 1);
+	if (reclen > buf->left)
+		return buf->error = -EINVAL;
+	rec->d_ino = ino;
+	rec->d_off = off;
+	rec->d_reclen = reclen;
+	rec->d_type = type;
+	memcpy(rec->d_name, name, len);
+	rec->d_name[len] = '\0';
+	buf->pos += reclen;
+	buf->left -= reclen;
+	return 0;
+}
+
+/*
+ * Read as many directory entries as will fit into @dirp, as a sequence of
+ * struct dirent_rec.  Returns the number of bytes filled in, or 0 at the end
+ * of the directory.
+ */
+long sys_getdents(unsigned int fd, void *dirp, size_t count)
+{
+	struct getdents_buf buf = { .pos = dirp, .left = count, .error = 0 };
+	struct file *file;
+	struct inode *inode;
+	int error;
+
+	if (vm_verify(&current->mm, dirp, count, VM_WRITE))
+		return -EFAULT;
+	if (fd >= NR_FILES || !(file = current->filp[fd]) ||
+			!(inode = file->f_inode))
+		return -EBADF;
+	if (!file->f_op || !file->f_op->readdir)
+		return -ENOTDIR;
+
+	error = file->f_op->readdir(inode, file, &buf, filldir);
+	if (buf.left != count)
+		return count - buf.left;
+	if (error < 0)
+		return error;
+	return buf.error; // -EINVAL if the first entry didn't fit
 }
 
 long sys_lseek(unsigned int fd, off_t offset, unsigned int whence)
@@ -74,7 +160,7 @@ long sys_lseek(unsigned int fd, off_t offset, unsigned int whence)
 	return filp->f_pos;
 }
 
-static long do_read(struct file *file, char *buf, size_t count,
+long do_read(struct file *file, char *buf, size_t count,
 		unsigned long *pos)
 {
 	if (!(file->f_mode & O_READ))
@@ -109,7 +195,7 @@ long sys_pread(unsigned int fd, char *buf, size_t count, unsigned long pos)
 	return do_read(file, buf, count, &pos);
 }
 
-static long do_write(struct file *file, char *buf, size_t count,
+long do_write(struct file *file, char *buf, size_t count,
 		unsigned long *pos)
 {
 	if (!(file->f_mode & O_WRITE))
@@ -145,3 +231,222 @@ long sys_pwrite(unsigned int fd, char *buf, size_t count, unsigned long pos)
 		return -EBADF;
 	return do_write(file, buf, count, &pos);
 }
+
+/* iovecs with up to this many segments are copied onto the stack */
+#define UIO_FASTIOV 8
+
+/*
+ * Copy a user iovec into the kernel and verify the memory it describes.  The
+ * segments are only read from the copy from then on, so user space can't
+ * change them after they have been checked.  On success, *@iovp points to
+ * @fast if the iovec fits in it, or to an array that the caller must kfree().
+ * Returns the total length of the segments.
+ */
+static long import_iovec(const struct iovec *uiov, unsigned long nr_segs,
+		int flags, struct iovec *fast, struct iovec **iovp)
+{
+	struct iovec *iov = fast;
+	size_t total = 0;
+	long error;
+
+	if (nr_segs > IOV_MAX)
+		return -EINVAL;
+	if (vm_verify(&current->mm, uiov, nr_segs * sizeof(*uiov), VM_READ))
+		return -EFAULT;
+	if (nr_segs > UIO_FASTIOV && !(iov = kmalloc(nr_segs * sizeof(*iov))))
+		return -ENOMEM;
+	memcpy(iov, uiov, nr_segs * sizeof(*iov));
+
+	for (unsigned long i = 0; i < nr_segs; i++) {
+		error = -EINVAL;
+		if (iov[i].iov_len > (size_t) LONG_MAX - total)
+			goto abort;
+		error = -EFAULT;
+		if (vm_verify(&current->mm, iov[i].iov_base, iov[i].iov_len,
+					flags))
+			goto abort;
+		total += iov[i].iov_len;
+	}
+	*iovp = iov;
+	return total;
+abort:
+	if (iov != fast)
+		kfree(iov);
+	return error;
+}
+
+/*
+ * Fallback for files without a readv/writev operation: transfer each segment
+ * in turn, stopping at the first short transfer.
+ */
+static long iov_loop(struct file *file, const struct iovec *iov,
+		unsigned long nr_segs, unsigned long *pos, int rw)
+{
+	long ret = 0;
+
+	for (unsigned long i = 0; i < nr_segs; i++) {
+		long n;
+		if (!iov[i].iov_len)
+			continue;
+		if (rw == READ)
+			n = file->f_op->read(file, iov[i].iov_base,
+					iov[i].iov_len, pos);
+		else
+			n = file->f_op->write(file, iov[i].iov_base,
+					iov[i].iov_len, pos);
+		if (n < 0)
+			return ret ? ret : n;
+		ret += n;
+		if ((size_t) n < iov[i].iov_len)
+			break;
+	}
+	return ret;
+}
+
+/*
+ * Vectored I/O on a file.  @iov must be a kernel copy of the iovec, already
+ * verified by import_iovec().
+ */
+long do_readv(struct file *file, const struct iovec *iov, unsigned long nr_segs,
+		unsigned long *pos)
+{
+	if (!(file->f_mode & O_READ))
+		return -EBADF;
+	if (!file->f_op)
+		return -EINVAL;
+	if (file->f_op->readv)
+		return file->f_op->readv(file, iov, nr_segs, pos);
+	if (file->f_op->read)
+		return iov_loop(file, iov, nr_segs, pos, READ);
+	return -EINVAL;
+}
+
+long do_writev(struct file *file, const struct iovec *iov, unsigned long nr_segs,
+		unsigned long *pos)
+{
+	if (!(file->f_mode & O_WRITE))
+		return -EBADF;
+	if (file->f_inode && IS_RDONLY(file->f_inode))
+		return -ENOSPC;
+	if (!file->f_op)
+		return -EINVAL;
+	if (file->f_op->writev)
+		return file->f_op->writev(file, iov, nr_segs, pos);
+	if (file->f_op->write)
+		return iov_loop(file, iov, nr_segs, pos, WRITE);
+	return -EINVAL;
+}
+
+static long rw_iovec(struct file *file, const struct iovec *uiov,
+		unsigned long nr_segs, unsigned long *pos, int rw)
+{
+	struct iovec fast[UIO_FASTIOV], *iov;
+	long total;
+
+	total = import_iovec(uiov, nr_segs, rw == READ ? VM_WRITE : VM_READ,
+			fast, &iov);
+	if (total < 0)
+		return total;
+	if (total && rw == READ)
+		total = do_readv(file, iov, nr_segs, pos);
+	else if (total)
+		total = do_writev(file, iov, nr_segs, pos);
+	if (iov != fast)
+		kfree(iov);
+	return total;
+}
+
+long sys_readv(unsigned int fd, const struct iovec *iov, unsigned long iovcnt)
+{
+	struct file *file;
+
+	if (fd >= NR_FILES || !(file = current->filp[fd]))
+		return -EBADF;
+	return rw_iovec(file, iov, iovcnt, &file->f_pos, READ);
+}
+
+long sys_writev(unsigned int fd, const struct iovec *iov, unsigned long iovcnt)
+{
+	struct file *file;
+
+	if (fd >= NR_FILES || !(file = current->filp[fd]))
+		return -EBADF;
+	return rw_iovec(file, iov, iovcnt, &file->f_pos, WRITE);
+}
+
+long sys_preadv(unsigned int fd, const struct iovec *iov, unsigned long iovcnt,
+		unsigned long pos)
+{
+	struct file *file;
+
+	if (fd >= NR_FILES || !(file = current->filp[fd]) || !file->f_inode)
+		return -EBADF;
+	return rw_iovec(file, iov, iovcnt, &pos, READ);
+}
+
+long sys_pwritev(unsigned int fd, const struct iovec *iov, unsigned long iovcnt,
+		unsigned long pos)
+{
+	struct file *file;
+
+	if (fd >= NR_FILES || !(file = current->filp[fd]) || !file->f_inode)
+		return -EBADF;
+	return rw_iovec(file, iov, iovcnt, &pos, WRITE);
+}
+
+#define SENDFILE_CHUNK (16 * 1024)
+
+/*
+ * Copy up to @count bytes from one file to another, without passing the data
+ * through user space.  If @offset is not NULL, input starts at *offset, which
+ * is updated, and the input file's position is left alone.
+ */
+long sys_sendfile(unsigned int out_fd, unsigned int in_fd,
+		unsigned long *offset, size_t count)
+{
+	struct file *in, *out;
+	unsigned long pos;
+	size_t done = 0;
+	long error = 0;
+	char *chunk;
+
+	if (offset && vm_verify(&current->mm, offset, sizeof(*offset),
+				VM_READ | VM_WRITE))
+		return -EFAULT;
+	if (in_fd >= NR_FILES || !(in = current->filp[in_fd]))
+		return -EBADF;
+	if (out_fd >= NR_FILES || !(out = current->filp[out_fd]))
+		return -EBADF;
+	if (!(chunk = kmalloc(SENDFILE_CHUNK)))
+		return -ENOMEM;
+
+	pos = offset ? *offset : in->f_pos;
+	while (done < count) {
+		long r, w;
+
+		r = do_read(in, chunk, MIN(count - done, SENDFILE_CHUNK), &pos);
+		if (r <= 0) {
+			error = r;
+			break;
+		}
+		w = do_write(out, chunk, r, &out->f_pos);
+		if (w < 0) {
+			pos -= r;
+			error = w;
+			break;
+		}
+		done += w;
+		if (w < r) {
+			// give back what couldn't be written
+			pos -= r - w;
+			break;
+		}
+	}
+	kfree(chunk);
+
+	if (offset)
+		*offset = pos;
+	else
+		in->f_pos = pos;
+	return done ? (long) done : error;
+}
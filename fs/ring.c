@@ -0,0 +1,171 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <kernel/dispatch.h>
+#include <kernel/fs.h>
+#include <kernel/log2.h>
+#include <kernel/mm/paging.h>
+#include <kernel/mm/vma.h>
+#include <telos/ring.h>
+
+/*
+ * Batched system call ring.  The ring is an anonymous mapping shared between
+ * the kernel and the process: the process queues requests in the submission
+ * queue, and SYS_RING_ENTER executes them through the usual file_operations,
+ * posting a completion for each.  See <telos/ring.h>.
+ */
+
+#define RING_FLAGS (VM_READ | VM_WRITE | VM_KEEP | VM_KEEPEXEC)
+
+static size_t ring_sq_off(void)
+{
+	return sizeof(struct ring);
+}
+
+static size_t ring_cq_off(unsigned int entries)
+{
+	return ring_sq_off() + entries * sizeof(struct ring_sqe);
+}
+
+static size_t ring_size(unsigned int entries)
+{
+	return ring_cq_off(entries) + 2 * entries * sizeof(struct ring_cqe);
+}
+
+/*
+ * Map a ring with @entries submission queue entries (and twice as many
+ * completion queue entries) into the current process.  A process has at most
+ * one ring; if it already exists, its address is stored in *ringp and -EBUSY
+ * is returned.  The ring is inherited across fork, and stays mapped across
+ * exec (VM_KEEPEXEC), so a new image can find it this way.
+ */
+long sys_ring_setup(unsigned int entries, struct ring **ringp)
+{
+	int error;
+	void *addr = NULL;
+	struct ring *ring;
+
+	if (vm_verify(&current->mm, ringp, sizeof(*ringp), VM_WRITE))
+		return -EFAULT;
+	if (current->ring) {
+		*ringp = current->ring;
+		return -EBUSY;
+	}
+	if (!entries || entries > RING_MAX_ENTRIES || !is_power_of_2(entries))
+		return -EINVAL;
+
+	error = do_mmap_anon(&addr, ring_size(entries), RING_FLAGS, 0);
+	if (error)
+		return error;
+
+	ring = addr;
+	ring->sq_head = ring->sq_tail = 0;
+	ring->sq_mask = entries - 1;
+	ring->sq_entries = entries;
+	ring->cq_head = ring->cq_tail = 0;
+	ring->cq_mask = 2 * entries - 1;
+	ring->cq_entries = 2 * entries;
+	ring->sq_off = ring_sq_off();
+	ring->cq_off = ring_cq_off(entries);
+
+	current->ring = ring;
+	current->ring_entries = entries;
+	*ringp = ring;
+	return 0;
+}
+
+static long ring_do_sqe(struct ring_sqe *sqe)
+{
+	int vm_flags;
+	struct file *file;
+	unsigned long *pos;
+
+	if (sqe->opcode == RING_OP_NOP)
+		return 0;
+	if (!(file = fd_file(current, sqe->fd)))
+		return -EBADF;
+
+	switch (sqe->opcode) {
+	case RING_OP_READ:
+	case RING_OP_WRITE:
+		pos = &file->f_pos;
+		break;
+	case RING_OP_PREAD:
+	case RING_OP_PWRITE:
+		if (!file->f_inode)
+			return -EBADF;
+		pos = &sqe->off;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	vm_flags = (sqe->opcode == RING_OP_READ || sqe->opcode == RING_OP_PREAD)
+		? VM_WRITE : VM_READ;
+	if (vm_verify(&current->mm, sqe->buf, sqe->len, vm_flags))
+		return -EFAULT;
+	if (vm_flags == VM_WRITE)
+		return do_read(file, sqe->buf, sqe->len, pos);
+	return do_write(file, sqe->buf, sqe->len, pos);
+}
+
+/*
+ * Execute up to @to_submit queued requests.  Stops early if the completion
+ * queue fills up, or if a request is interrupted by a signal.  Returns the
+ * number of requests consumed.
+ */
+long sys_ring_enter(unsigned int to_submit)
+{
+	long res;
+	unsigned int n;
+	unsigned long sq_mask, cq_entries;
+	struct ring_sqe sqe, *sqes;
+	struct ring_cqe *cqe, *cqes;
+	struct ring *ring = current->ring;
+
+	if (!ring)
+		return -EINVAL;
+
+	/* use the kernel's idea of the layout, not the (writable) header's */
+	sq_mask = current->ring_entries - 1;
+	cq_entries = 2 * current->ring_entries;
+	sqes = (void*) ((char*) ring + ring_sq_off());
+	cqes = (void*) ((char*) ring + ring_cq_off(current->ring_entries));
+
+	for (n = 0; n < to_submit && ring->sq_head != ring->sq_tail; n++) {
+		if (ring->cq_tail - ring->cq_head >= cq_entries)
+			break;
+
+		/* copy the request so the process can't change it under us */
+		sqe = sqes[ring->sq_head & sq_mask];
+		ring->sq_head++;
+
+		res = ring_do_sqe(&sqe);
+
+		cqe = &cqes[ring->cq_tail & (cq_entries - 1)];
+		cqe->user_data = sqe.user_data;
+		cqe->res = res;
+		ring->cq_tail++;
+
+		if (res == -EINTR) {
+			n++;
+			break;
+		}
+	}
+	return n;
+}
@@ -62,6 +62,8 @@ void put_super(dev_t dev)
 		return;
 	if (sb->s_covered)
 		return;
+	dcache_purge_sb(sb);
+	evict_inodes(sb);
 	if (sb->s_op && sb->s_op->put_super)
 		sb->s_op->put_super(sb);
 }
@@ -224,7 +226,7 @@ long sys_umount(const char *name, size_t name_len)
 		iput(inode);
 	if (retval)
 		return retval;
-	//fsync_dev(dev);
+	fsync_dev(dev);
 	return 0;
 }
 
@@ -0,0 +1,131 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <kernel/dispatch.h>
+#include <kernel/fs.h>
+#include <kernel/timer.h>
+#include <kernel/wait.h>
+#include <telos/stat.h>
+#include <telos/syscall.h>
+
+/*
+ * Buffer write-back.
+ *
+ * The bdflush kernel process periodically writes back buffers which have been
+ * dirty for longer than DIRTY_EXPIRE ticks.  It is woken early when too much
+ * of the buffer cache is dirty, in which case all dirty buffers are written.
+ */
+
+#define BDFLUSH_INTERVAL 500	/* 5 seconds */
+#define DIRTY_EXPIRE     3000	/* 30 seconds */
+
+static struct wait_queue bdflush_wait = WAIT_QUEUE_INIT(bdflush_wait);
+static struct timer bdflush_timer;
+
+void wakeup_bdflush(void)
+{
+	wake_all(&bdflush_wait, 0);
+}
+
+static void bdflush_timeout(void *data)
+{
+	wakeup_bdflush();
+}
+
+/*
+ * Sleep until the next write-back interval (or until woken early), then do a
+ * round of write-back.  Only kernel processes may call this.
+ */
+long sys_bdflush(void)
+{
+	if (!(current->flags & PFLAG_SUPER))
+		return -EPERM;
+
+	if (!buffers_over_dirty_limit()) {
+		ktimer_init(&bdflush_timer, bdflush_timeout, NULL, TF_STATIC);
+		ktimer_start(&bdflush_timer, BDFLUSH_INTERVAL);
+		wait_interruptible(&bdflush_wait);
+		ktimer_remove(&bdflush_timer);
+	}
+
+	if (buffers_over_dirty_limit())
+		sync_buffers();
+	else
+		writeback_buffers(DIRTY_EXPIRE);
+	return 0;
+}
+
+static _Noreturn void bdflush(void *unused)
+{
+	for (;;)
+		syscall0(SYS_BDFLUSH);
+}
+
+void start_bdflush(void)
+{
+	if (create_kernel_process(bdflush, NULL, 0) < 0)
+		warn("failed to start bdflush");
+}
+
+/*
+ * Generic fsync: write back the file's data blocks and, unless @datasync is
+ * set, its inode and the rest of the device's metadata.
+ */
+int file_fsync(struct inode *inode, struct file *file, int datasync)
+{
+	struct super_block *sb = inode->i_sb;
+
+	if (S_ISBLK(inode->i_mode))
+		return fsync_dev(inode->i_rdev);
+	if (inode->i_map)
+		fsync_block_map(inode->i_map);
+	if (datasync)
+		return 0;
+	if (inode->i_dirt && sb && sb->s_op && sb->s_op->write_inode)
+		sb->s_op->write_inode(inode);
+	return fsync_dev(inode->i_dev);
+}
+
+static long do_fsync(unsigned int fd, int datasync)
+{
+	struct file *file;
+	struct inode *inode;
+
+	if (fd >= NR_FILES || !(file = current->filp[fd]) ||
+			!(inode = file->f_inode))
+		return -EBADF;
+	if (file->f_op && file->f_op->fsync)
+		return file->f_op->fsync(inode, file, datasync);
+	return file_fsync(inode, file, datasync);
+}
+
+long sys_sync(void)
+{
+	sync_buffers();
+	return 0;
+}
+
+long sys_fsync(unsigned int fd)
+{
+	return do_fsync(fd, 0);
+}
+
+long sys_fdatasync(unsigned int fd)
+{
+	return do_fsync(fd, 1);
+}
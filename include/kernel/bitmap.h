@@ -50,6 +50,31 @@ static inline long bitmap_ffz(unsigned long *bitmap, unsigned len)
 	return -1;
 }
 
+/*
+ * Find the first zero bit at or after bit @start.  As with bitmap_ffz, @len
+ * is the length of the bitmap in words.
+ */
+static inline long bitmap_ffz_from(unsigned long *bitmap, unsigned len,
+		unsigned start)
+{
+	unsigned word = start / BITS_PER_LONG;
+	unsigned long first;
+	long bit;
+
+	if (word >= len)
+		return -1;
+	first = bitmap[word] | ((1UL << (start % BITS_PER_LONG)) - 1);
+	if (first != ~0UL)
+		return ffz(first) + word * BITS_PER_LONG;
+	bit = bitmap_ffz(bitmap + word + 1, len - word - 1);
+	return bit < 0 ? -1 : (long) (bit + (word + 1) * BITS_PER_LONG);
+}
+
+static inline bool bitmap_test(unsigned long *bitmap, unsigned idx)
+{
+	return bitmap[idx / BITS_PER_LONG] & (1UL << (idx % BITS_PER_LONG));
+}
+
 static inline long bitmap_ffs(unsigned long *bitmap, unsigned len)
 {
 	for (unsigned i = 0; i < len; i++) {
@@ -0,0 +1,31 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _KERNEL_CMDLINE_H_
+#define _KERNEL_CMDLINE_H_
+
+/*
+ * Kernel command line (boot parameters).  Parameters are separated by spaces
+ * and take the form "name=value", or just "name" for boolean flags.
+ */
+
+const char *cmdline_param(const char *name);
+bool cmdline_flag(const char *name);
+int cmdline_ulong(const char *name, unsigned long *val);
+
+#endif
@@ -33,6 +33,7 @@
 
 #define ULLONG_MAX (~0ULL)
 #define INT_MAX ((int)(~0U>>1))
+#define LONG_MAX ((long)(~0UL>>1))
 #define USHRT_MAX ((u16)(~0U))
 #define SHRT_MAX ((s16)(USHRT_MAX>>1))
 
@@ -48,6 +49,15 @@ int _kprintf(unsigned char attr, const char *fmt, ...) __printf(2,3);
 _Noreturn void _panic(const char *fmt, ...) __printf(1,2);
 #define panic(fmt, ...) _panic("panic! "fmt"\n", ## __VA_ARGS__)
 
+/* lib/kstrtox.c */
+int kstrtoull(const char *s, unsigned int base, unsigned long long *res);
+int _kstrtoul(const char *s, unsigned int base, unsigned long *res);
+
+static inline int kstrtoul(const char *s, unsigned int base, unsigned long *res)
+{
+	return _kstrtoul(s, base, res);
+}
+
 /* initialization order */
 enum {
 	SUB_MEMORY,
@@ -31,8 +31,10 @@ struct stat;
 struct mount;
 struct exec_args;
 struct __mmap_args;
+struct iovec;
 
 struct dirent;
+struct ring;
 
 struct ucontext;
 
@@ -84,8 +86,17 @@ long sys_read(unsigned int fd, char *buf, size_t nbyte);
 long sys_pread(unsigned int fd, char *buf, size_t nbyte, unsigned long pos);
 long sys_write(unsigned int fd, char *buf, size_t nbyte);
 long sys_pwrite(unsigned int fd, char *buf, size_t nbyte, unsigned long pos);
+long sys_sendfile(unsigned int out_fd, unsigned int in_fd,
+		unsigned long *offset, size_t count);
+long sys_readv(unsigned int fd, const struct iovec *iov, unsigned long iovcnt);
+long sys_writev(unsigned int fd, const struct iovec *iov, unsigned long iovcnt);
+long sys_preadv(unsigned int fd, const struct iovec *iov, unsigned long iovcnt,
+		unsigned long pos);
+long sys_pwritev(unsigned int fd, const struct iovec *iov, unsigned long iovcnt,
+		unsigned long pos);
 long sys_lseek(unsigned int fd, off_t offset, unsigned int whence);
 long sys_readdir(unsigned int fd, struct dirent *dirent, unsigned int count);
+long sys_getdents(unsigned int fd, void *buf, size_t count);
 long sys_ioctl(unsigned int fd, unsigned int cmd, unsigned long arg);
 long sys_mknod(const char *filename, size_t name_len, int mode, dev_t dev);
 long sys_mkdir(const char *pathname, size_t name_len, int mode);
@@ -103,6 +114,12 @@ long sys_fstat(int fd, struct stat *s);
 long sys_truncate(const char *pathname, size_t name_len, size_t length);
 long sys_fcntl(int fd, int cmd, int arg);
 long sys_pipe(int *read_end, int *write_end, int flags);
+long sys_ring_setup(unsigned int entries, struct ring **ringp);
+long sys_ring_enter(unsigned int to_submit);
+long sys_sync(void);
+long sys_fsync(unsigned int fd);
+long sys_fdatasync(unsigned int fd);
+long sys_bdflush(void);
 long sys_time(time_t *t);
 long sys_clock_getres(clockid_t clockid, struct timespec *res);
 long sys_clock_gettime(clockid_t clockid, struct timespec *tp);
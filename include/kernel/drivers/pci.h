@@ -0,0 +1,58 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _DRIVERS_PCI_H_
+#define _DRIVERS_PCI_H_
+
+/* configuration space registers */
+#define PCI_VENDOR_ID      0x00
+#define PCI_COMMAND        0x04
+#define PCI_CLASS_REVISION 0x08
+#define PCI_HEADER_TYPE    0x0C
+#define PCI_BAR(n)         (0x10 + (n) * 4)
+#define PCI_INTERRUPT_LINE 0x3C
+
+/* command register bits */
+#define PCI_COMMAND_IO     0x1
+#define PCI_COMMAND_MEMORY 0x2
+#define PCI_COMMAND_MASTER 0x4
+
+/* base address register bits */
+#define PCI_BAR_IO      0x1
+#define PCI_BAR_IO_MASK (~0x3UL)
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE  0x01
+
+struct pci_dev {
+	unsigned char bus;
+	unsigned char slot;
+	unsigned char func;
+	unsigned short vendor;
+	unsigned short device;
+	unsigned char class;
+	unsigned char subclass;
+	unsigned char prog_if;
+};
+
+unsigned long pci_read_config(struct pci_dev *dev, unsigned int off);
+void pci_write_config(struct pci_dev *dev, unsigned int off, unsigned long val);
+int pci_find_class(unsigned char class, unsigned char subclass,
+		struct pci_dev *dev);
+
+#endif
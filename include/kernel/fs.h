@@ -23,6 +23,7 @@
 #include <kernel/wait.h>
 #include <telos/dirent.h>
 #include <telos/mount.h>
+#include <telos/uio.h>
 
 enum {
 	SEEK_SET,
@@ -80,10 +81,13 @@ struct super_block;
 enum {
 	BUF_UPTODATE = 1,
 	BUF_DIRTY    = 2,
+	BUF_ERROR    = 4,
 };
 
 struct buffer {
 	struct list_head b_chain;
+	struct list_head b_lru;
+	struct list_head b_dirty;
 	struct hlist_node b_hash;
 	struct wait_queue b_wait;
 	void *b_data;
@@ -91,29 +95,98 @@ struct buffer {
 	blksize_t b_size;
 	blkcnt_t b_blocknr;
 	unsigned long b_flags;
+	unsigned long b_dirtied;
+	void (*b_end_io)(struct buffer *, void *);
+	void *b_end_io_data;
 	unsigned short b_count;
 	bool b_lock;
 };
 
 /*
- * Block I/O vectors: scatter/gather I/O on block devices.
+ * Block maps: the mapping from a file's logical blocks to device blocks, for
+ * scatter/gather I/O on block devices.  Mappings are cached as extents (runs
+ * of contiguous blocks).  On a cache miss, get_extent() is called to map a run
+ * of blocks starting at the given logical block; a hole is mapped to device
+ * block 0.  If the map has an alloc_block() method, writes to holes allocate
+ * a device block for the hole.  A map without get_extent() is the identity
+ * mapping, as used for raw block device I/O.
  */
 
-struct bio_vec {
+struct extent {
+	blkcnt_t lblk;
+	blkcnt_t pblk;
+	blkcnt_t len;
+};
+
+struct block_map {
 	dev_t dev;
 	blkcnt_t blkcnt;
 	blksize_t blksize;
-	blkcnt_t block[];
+	int (*get_extent)(struct block_map *, blkcnt_t, struct extent *);
+	blkcnt_t (*alloc_block)(struct block_map *, blkcnt_t);
+	void *private;
+	unsigned int nr_extents;
+	unsigned int max_extents;
+	unsigned int hint;
+	struct extent *extents;
 };
 
+static inline void INIT_IDENTITY_MAP(struct block_map *map, dev_t dev,
+		blkcnt_t blkcnt, blksize_t blksize)
+{
+	map->dev = dev;
+	map->blkcnt = blkcnt;
+	map->blksize = blksize;
+	map->get_extent = NULL;
+	map->alloc_block = NULL;
+	map->private = NULL;
+	map->nr_extents = 0;
+	map->max_extents = 0;
+	map->hint = 0;
+	map->extents = NULL;
+}
+
+static inline bool bmap_hole(struct block_map *map, blkcnt_t pblk)
+{
+	return !pblk && map->get_extent;
+}
+
+/*
+ * A file system's readdir operation passes each entry at or after f_pos to a
+ * filldir callback, advancing f_pos past each entry the callback accepts.  The
+ * callback returns nonzero when it can take no more entries.  @off is the
+ * directory position following the entry.
+ */
+typedef int (*filldir_t)(void *buf, const char *name, int len,
+		unsigned long off, ino_t ino, unsigned int type);
+
 struct file_operations {
 	off_t (*lseek)(struct inode *, struct file *, off_t, int);
 	ssize_t (*read)(struct file *, char *, size_t, unsigned long *pos);
 	ssize_t (*write)(struct file *, const char *, size_t, unsigned long *pos);
-	int (*readdir)(struct inode *, struct file *, struct dirent *, int);
+	int (*readdir)(struct inode *, struct file *, void *, filldir_t);
 	int (*open)(struct inode *, struct file *);
 	int (*release)(struct inode *, struct file *);
 	int (*ioctl)(struct inode *, struct file *, unsigned int, unsigned long);
+	int (*fsync)(struct inode *, struct file *, int datasync);
+	/* vectored I/O; the iovec is a verified kernel copy.  Optional:
+	 * read/write are called for each segment otherwise. */
+	ssize_t (*readv)(struct file *, const struct iovec *, unsigned long,
+			unsigned long *pos);
+	ssize_t (*writev)(struct file *, const struct iovec *, unsigned long,
+			unsigned long *pos);
+	/* physical address of the page at (page aligned) pos, or 0 */
+	uintptr_t (*mmap_frame)(struct file *, unsigned long pos);
+};
+
+/*
+ * Per-file read-ahead state.  The window grows on sequential access and
+ * collapses on random access.
+ */
+struct file_ra {
+	blkcnt_t next; /* block following the last read */
+	blkcnt_t end;  /* end of the blocks submitted for read-ahead */
+	blkcnt_t size; /* current window size, in blocks */
 };
 
 struct file {
@@ -124,6 +197,7 @@ struct file {
 	unsigned long f_pos;
 	unsigned short f_flags;
 	unsigned short f_count;
+	struct file_ra f_ra;
 	void *f_private;
 	struct file_operations *f_op;
 };
@@ -146,6 +220,7 @@ struct inode_operations {
 struct inode {
 	struct list_head	i_list;
 	struct hlist_node	i_hash;
+	struct list_head	i_lru;
 	unsigned long		i_ino;
 	mode_t			i_mode;
 	nlink_t			i_nlink;
@@ -155,7 +230,7 @@ struct inode {
 	unsigned short		i_count;
 	unsigned short		i_flags;
 	bool			i_dirt;
-	struct bio_vec          *i_bio;
+	struct block_map	*i_map;
 	struct inode		*i_mount;
 	struct inode_operations	*i_op;
 	struct super_block	*i_sb;
@@ -163,7 +238,7 @@ struct inode {
 };
 
 struct super_operations {
-	void(*read_inode)(struct inode *);
+	int(*read_inode)(struct inode *);
 	void(*write_inode)(struct inode *);
 	void(*put_inode)(struct inode *);
 	void(*put_super)(struct super_block *);
@@ -205,6 +280,8 @@ void mount_root(void);
 struct inode *iget(struct super_block *sb, unsigned long ino);
 struct inode *__iget(struct super_block *sb, ino_t ino, bool crossmntp);
 void insert_inode_hash(struct inode *inode);
+void evict_inodes(struct super_block *sb);
+int set_inode_cache_max(unsigned long max);
 
 static void ifree(struct inode *inode)
 {
@@ -213,6 +290,15 @@ static void ifree(struct inode *inode)
 }
 
 int permission(struct inode *inode, int mask);
+
+bool dcache_lookup(struct inode *dir, const char *name, int len, ino_t *ino);
+unsigned long dcache_sequence(void);
+void dcache_add(struct super_block *sb, ino_t dir, const char *name, int len,
+		struct inode *inode, unsigned long seq);
+void dcache_remove(struct super_block *sb, ino_t dir, const char *name,
+		int len);
+void dcache_purge_dir(struct super_block *sb, ino_t dir);
+void dcache_purge_sb(struct super_block *sb);
 bool fs_may_mount(dev_t dev);
 bool fs_may_umount(dev_t dev, struct inode * mount_root);
 bool fs_may_remount_ro(dev_t dev);
@@ -223,6 +309,13 @@ int register_filesystem(
 struct file_system_type *get_fs_type(const char *name);
 
 int fsync_dev(dev_t dev);
+int fsync_block_map(struct block_map *map);
+int file_fsync(struct inode *inode, struct file *file, int datasync);
+void sync_buffers(void);
+void writeback_buffers(unsigned long age);
+bool buffers_over_dirty_limit(void);
+void wakeup_bdflush(void);
+void start_bdflush(void);
 
 extern int namei(const char * pathname, struct inode ** res_inode);
 extern int lnamei(const char * pathname, struct inode ** res_inode);
@@ -237,32 +330,53 @@ int register_blkdev(unsigned int major, const char * name, struct file_operation
 int unregister_chrdev(unsigned int major, const char * name);
 int unregister_blkdev(unsigned int major, const char * name);
 
+struct buffer *get_buffer(dev_t dev, blkcnt_t block, blksize_t size);
 struct buffer *read_block(dev_t dev, blkcnt_t block, blksize_t size);
+void release_buffer(struct buffer *buf);
+void mark_buffer_dirty(struct buffer *buf);
+int set_buffer_cache_max(unsigned long max);
 int free_device_buffers(dev_t dev);
 void clear_buffer_cache(void);
 int submit_block(int rw, struct buffer *buf);
+int submit_block_async(int rw, struct buffer *buf,
+		void (*end_io)(struct buffer *, void *), void *data);
+int submit_blocks(int rw, struct buffer **bufs, unsigned int nr,
+		void (*end_io)(struct buffer *, void *), void *data);
 void buffer_wait(struct buffer *buf);
+void start_plug(void);
+void finish_plug(void);
 ssize_t blkdev_read(dev_t dev, void *dst, size_t len, unsigned long pos);
 blksize_t blkdev_blksize(dev_t devno);
 int set_blocksize(dev_t devno, blksize_t size);
 
-struct bio_vec *alloc_bio_vec(dev_t dev, blkcnt_t blkcnt, blksize_t blksize);
-void free_bio_vec(struct bio_vec *bio);
-ssize_t bio_read(struct bio_vec *vec, char *iobuf, size_t len,
+struct block_map *alloc_block_map(dev_t dev, blkcnt_t blkcnt,
+		blksize_t blksize,
+		int (*get_extent)(struct block_map *, blkcnt_t, struct extent *),
+		void *private);
+void free_block_map(struct block_map *map);
+void block_map_invalidate(struct block_map *map);
+void block_map_resize(struct block_map *map, blkcnt_t blkcnt);
+blkcnt_t bmap(struct block_map *map, blkcnt_t lblk, blkcnt_t *len);
+blkcnt_t bmap_alloc(struct block_map *map, blkcnt_t lblk);
+ssize_t bio_read(struct block_map *map, char *iobuf, size_t len,
 		unsigned long *pos);
-ssize_t bio_write(struct bio_vec *vec, const char *iobuf, size_t len,
+ssize_t bio_write(struct block_map *map, const char *iobuf, size_t len,
 		unsigned long *pos);
 ssize_t bio_file_read(struct file *file, char *buf, size_t len,
 		unsigned long *pos);
+ssize_t bio_file_readv(struct file *file, const struct iovec *iov,
+		unsigned long nr_segs, unsigned long *pos);
 
-static inline void release_buffer(struct buffer *buf)
-{
-	if (buf)
-		buf->b_count--;
-}
+long do_read(struct file *file, char *buf, size_t count, unsigned long *pos);
+long do_write(struct file *file, char *buf, size_t count, unsigned long *pos);
+long do_readv(struct file *file, const struct iovec *iov, unsigned long nr_segs,
+		unsigned long *pos);
+long do_writev(struct file *file, const struct iovec *iov, unsigned long nr_segs,
+		unsigned long *pos);
 
 // FIXME: doesn't belong here...
 int do_mmap(struct file *file, void **addr, size_t len, int prot, int flags,
 		unsigned long off);
+int do_mmap_anon(void **addr, size_t len, int prot, int flags);
 
 #endif
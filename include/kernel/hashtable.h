@@ -143,5 +143,136 @@ static inline void hash_del(struct hlist_node *node)
 	hlist_for_each_entry_safe(obj, tmp,\
 		&name[hash_min(key, HASH_BITS(name))], member)
 
+/**
+ * name_hash - hash a file name
+ * @salt: initial value, e.g. a hash of the directory the name is in
+ * @name: the name (not necessarily NUL-terminated)
+ * @len: length of the name
+ */
+static inline u32 name_hash(u32 salt, const char *name, int len)
+{
+	u32 hash = salt;
+
+	while (len--)
+		hash = (hash + (*name << 4) + (*name >> 4)) * 11, name++;
+	return hash;
+}
+
+/*
+ * Resizable hash tables.
+ *
+ * A struct htable starts out with a statically allocated array of buckets
+ * and doubles in size whenever the average chain length exceeds
+ * HTABLE_MAX_LOAD.  Resizing is incremental: the old bucket array is kept
+ * alongside the new one, and each insertion moves a few old buckets across,
+ * so that no single operation pays for rehashing the whole table.  Lookups
+ * check both arrays while a resize is in progress.
+ *
+ * Keys are 32-bit values which should already be well mixed (e.g. built
+ * with hash_32); the table takes bucket indices from their high bits.  The
+ * table needs to recompute the key of an entry when moving it, so it is
+ * given a function to do so.
+ */
+
+#define HTABLE_MAX_LOAD 2UL
+
+struct htable {
+	struct hlist_head *buckets;
+	struct hlist_head *old;       /* buckets being migrated from, or NULL */
+	unsigned int bits;
+	unsigned int old_bits;
+	unsigned int initial_bits;    /* size of the static (never freed) buckets */
+	unsigned long migrated;       /* old buckets [0, migrated) are empty */
+	unsigned long nr_entries;
+	u32 (*key)(struct hlist_node *node);
+};
+
+struct htable_stats {
+	unsigned long entries;
+	unsigned long buckets;
+	unsigned long used_buckets;   /* buckets with at least one entry */
+	unsigned long max_chain;      /* length of the longest chain */
+	bool resizing;
+};
+
+#define DEFINE_HTABLE(name, nbits, keyfn)				\
+	struct htable name = {						\
+		.buckets = (struct hlist_head[1 << (nbits)]) { },	\
+		.bits = nbits,						\
+		.initial_bits = nbits,					\
+		.key = keyfn,						\
+	}
+
+static inline struct hlist_head *htable_head(struct hlist_head *buckets,
+		unsigned int bits, u32 key)
+{
+	return &buckets[hash_32(key, bits)];
+}
+
+/*
+ * Get the next bucket which may contain entries with key @key, after @head
+ * (or the first, if @head is NULL).
+ */
+static inline struct hlist_head *htable_next_head(struct htable *ht, u32 key,
+		struct hlist_head *head)
+{
+	struct hlist_head *old;
+
+	if (!head)
+		return htable_head(ht->buckets, ht->bits, key);
+	if (!ht->old || head != htable_head(ht->buckets, ht->bits, key))
+		return NULL;
+	old = htable_head(ht->old, ht->old_bits, key);
+	return (unsigned long) (old - ht->old) >= ht->migrated ? old : NULL;
+}
+
+static inline unsigned long htable_nr_buckets(struct htable *ht)
+{
+	return (1UL << ht->bits) + (ht->old ? 1UL << ht->old_bits : 0);
+}
+
+/* Buckets of both arrays, for iterating over the whole table. */
+static inline struct hlist_head *htable_bucket(struct htable *ht,
+		unsigned long bkt)
+{
+	if (bkt < (1UL << ht->bits))
+		return &ht->buckets[bkt];
+	return &ht->old[bkt - (1UL << ht->bits)];
+}
+
+void htable_add(struct htable *ht, struct hlist_node *node, u32 key);
+void htable_del(struct htable *ht, struct hlist_node *node);
+void htable_stats(struct htable *ht, struct htable_stats *stats);
+
+/**
+ * htable_for_each_possible - iterate over all possible objects with a key
+ * @ht: struct htable to iterate
+ * @obj: the type * to use as a loop cursor for each entry
+ * @member: the name of the hlist_node within the struct
+ * @key: the key of the objects to iterate over
+ *
+ * Note that a break statement only ends the current chain; use return or
+ * goto to leave the loop.
+ */
+#define htable_for_each_possible(ht, obj, member, key)			\
+	for (struct hlist_head *__head = htable_next_head(ht, key, NULL);\
+			__head; __head = htable_next_head(ht, key, __head))	\
+		hlist_for_each_entry(obj, __head, member)
+
+/**
+ * htable_for_each_safe - iterate over a resizable hash table, safe against
+ * removal of entries (htable_del never moves entries between buckets)
+ * @ht: struct htable to iterate
+ * @bkt: unsigned long to use as bucket loop cursor
+ * @tmp: a &struct used for temporary storage
+ * @obj: the type * to use as a loop cursor for each entry
+ * @member: the name of the hlist_node within the struct
+ *
+ * The body must not sleep: the table may be resized meanwhile.  Callers that
+ * block should start the iteration over afterwards.
+ */
+#define htable_for_each_safe(ht, bkt, tmp, obj, member)			\
+	for ((bkt) = 0; (bkt) < htable_nr_buckets(ht); (bkt)++)		\
+		hlist_for_each_entry_safe(obj, tmp, htable_bucket(ht, bkt), member)
 
 #endif
@@ -56,6 +56,11 @@
 #define INTR_KBD     0x21
 #define INTR_SYSCALL 0x80
 
+/* hardware IRQs are mapped to vectors 0x20-0x2F */
+#define NR_IRQS     16
+#define INTR_IRQ(n) (0x20 + (n))
+#define IRQ_CASCADE 2
+
 #define EBX 0x00
 #define ECX 0x04
 #define EDX 0x08
@@ -69,10 +74,23 @@
 #define FS  0x28
 #define GS  0x2C
 
+/* struct ucontext offsets */
+#define IRET_EIP 0x30
+#define IRET_CS  0x34
+#define IRET_FL  0x38
+#define IRET_ESP 0x3C
+#define IRET_SS  0x40
+
+#define EFLAGS_IF 0x0200
+
+/* model-specific registers */
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
 #ifndef __ASSEMBLER__
 
 #define EFLAGS_IOPL(x) ((x) << 12)
-#define EFLAGS_IF 0x0200
 
 /* general purpose registers (SAVE_ALL ordering) */
 struct gp_regs {
@@ -116,6 +134,14 @@ struct ucontext {
 	unsigned long stack[];
 };
 
+#define assert_ucontext_offset(member, offset) \
+	assert_struct_offset(struct ucontext, member, offset)
+assert_ucontext_offset(iret_eip, IRET_EIP);
+assert_ucontext_offset(iret_cs,  IRET_CS);
+assert_ucontext_offset(eflags,   IRET_FL);
+assert_ucontext_offset(iret_esp, IRET_ESP);
+assert_ucontext_offset(iret_ss,  IRET_SS);
+
 struct kcontext {
 	struct gp_regs reg;
 	unsigned long iret_eip;
@@ -173,6 +199,69 @@ static inline unsigned char inb(port_t port)
 	return ret;
 }
 
+static inline void outw(port_t port, unsigned short data)
+{
+	asm volatile("outw %1, %0" : : "d" (port), "a" (data));
+}
+
+static inline unsigned short inw(port_t port)
+{
+	unsigned short ret;
+	asm volatile("inw %1, %0" : "=a" (ret) : "d" (port));
+	return ret;
+}
+
+static inline void outl(port_t port, unsigned long data)
+{
+	asm volatile("outl %1, %0" : : "d" (port), "a" (data));
+}
+
+static inline unsigned long inl(port_t port)
+{
+	unsigned long ret;
+	asm volatile("inl %1, %0" : "=a" (ret) : "d" (port));
+	return ret;
+}
+
+/* string I/O: transfer @count 16-bit words between a port and memory */
+static inline void insw(port_t port, void *addr, unsigned long count)
+{
+	asm volatile("rep insw"
+		: "+D" (addr), "+c" (count)
+		: "d" (port)
+		: "memory");
+}
+
+static inline void outsw(port_t port, const void *addr, unsigned long count)
+{
+	asm volatile("rep outsw"
+		: "+S" (addr), "+c" (count)
+		: "d" (port));
+}
+
+static inline void cpuid(unsigned long leaf, unsigned long *eax,
+		unsigned long *ebx, unsigned long *ecx, unsigned long *edx)
+{
+	asm volatile("cpuid"
+		: "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+		: "a" (leaf), "c" (0));
+}
+
+#define CPUID_EDX_TSC (1 << 4)
+#define CPUID_EDX_SEP (1 << 11)
+
+static inline void wrmsr(unsigned long msr, unsigned long long val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+static inline unsigned long long rdtsc(void)
+{
+	unsigned long long tsc;
+	asm volatile("rdtsc" : "=A" (tsc));
+	return tsc;
+}
+
 static inline _Noreturn void halt(void)
 {
 	asm volatile("_halt: hlt\njmp _halt");
@@ -255,10 +344,14 @@ static inline void put_iret_kframe(struct kcontext *f, unsigned long eip)
 }
 
 extern void gdt_install(void);
+extern void vsyscall(void);
 extern void idt_install(void);
 extern void pic_init(u16 off1, u16 off2);
 extern void enable_irq(unsigned char irq, bool disable);
 extern void pic_eoi(void);
+extern int request_irq(unsigned int irq, void (*handler)(unsigned int, void*),
+		void *data);
+extern void free_irq(unsigned int irq);
 extern void pit_init(int div);
 
 struct tm;
@@ -30,6 +30,7 @@
 #define PE_U  0x4
 #define PE_A  0x20
 #define PE_D  0x40
+#define PE_COW 0x200 /* (available bit) kernel page shared copy-on-write */
 
 /* page frame info */
 struct pf_info {
@@ -38,12 +39,27 @@ struct pf_info {
 	unsigned int ref;
 };
 
+/*
+ * Shrinkers are called by the page allocator when it runs out of frames.  The
+ * shrink function should try to free up to nr_pages pages, without sleeping,
+ * and return the number of pages actually freed.
+ */
+struct shrinker {
+	struct list_head chain;
+	unsigned long (*shrink)(unsigned long nr_pages);
+};
+
 struct vma;
 
+void register_shrinker(struct shrinker *shrinker);
+
 struct pf_info *kalloc_frame(int flags);
 void *kalloc_pages(unsigned int n);
 void kfree_pages(void *addr, unsigned int n);
+void *kmap_phys(uintptr_t phys);
+uintptr_t kvirt_to_phys(void *addr);
 void _kfree_frame(struct pf_info *page);
+unsigned long nr_free_frames(void);
 void *kmap_tmp_page(uintptr_t addr);
 void kunmap_tmp_page(void *addr);
 void kunmap_page(void *addr);
@@ -55,6 +71,9 @@ uintptr_t new_pgdir(void);
 int free_pgdir(uintptr_t phys_pgdir);
 int map_pages(uintptr_t phys_pgdir, uintptr_t dst, unsigned int pages, int flags);
 int map_frame(struct pf_info *frame, void *addr, int flags);
+int map_phys(uintptr_t phys, void *addr, int flags);
+int kshare_page(void *kaddr, void *uaddr, int flags);
+int kunshare_page(void *kaddr);
 int map_page(void *addr, int flags);
 int copy_page(void *addr, int flags);
 int pm_unmap(struct vma *vma);
@@ -95,6 +95,7 @@ static inline size_t vma_size(const struct vma *vma)
 }
 
 int vm_map_page(struct vma *vma, void *addr);
+int vm_share_page(void *uaddr, void *kaddr);
 int vm_writeback(struct vma *vma, void *addr, size_t len);
 int vm_read_perm(struct vma *vma, void *addr);
 int vm_write_perm(struct vma *vma, void *addr);
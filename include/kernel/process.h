@@ -30,8 +30,7 @@
 #include <kernel/timer.h>
 #include <kernel/mm/vma.h>
 
-#define PT_SIZE  256
-#define PID_MASK (PT_SIZE - 1)
+#define PID_MAX 32768
 
 #define NR_FILES 8
 
@@ -54,6 +53,7 @@ enum {
 
 struct inode;
 struct file;
+struct ring;
 
 /* process control block */
 struct pcb {
@@ -64,6 +64,7 @@ struct pcb {
 	struct mm_struct  mm;
 	/* metadata */
 	pid_t             pid;
+	struct hlist_node pid_chain;
 	pid_t             parent_pid;
 	unsigned long     flags;
 	unsigned int      state;
@@ -83,6 +84,8 @@ struct pcb {
 	struct file       *filp[NR_FILES];
 	struct inode      *pwd;
 	struct inode      *root;
+	struct ring       *ring;
+	unsigned int      ring_entries;
 };
 
 #define assert_pcb_offset(member, offset) \
@@ -93,9 +96,11 @@ assert_pcb_offset(ifp,   PCB_IFP);
 assert_pcb_offset(mm,    PCB_PGD);
 assert_struct_offset(struct mm_struct, pgdir, 0);
 
-extern struct pcb proctab[PT_SIZE];
 extern struct pcb *current;
 
+struct pcb *get_pcb(pid_t pid);
+void free_pcb(struct pcb *p);
+
 int create_user_process(void(*func)(void*), void *arg, unsigned long flags);
 int create_kernel_process(void(*func)(void*), void *arg, ulong flags);
 
@@ -107,14 +112,6 @@ void reap(struct pcb *p);
 void wake(struct pcb *p, long rc);
 long schedule(void);
 
-static inline struct pcb *get_pcb(pid_t pid)
-{
-	struct pcb *p = &proctab[pid & PID_MASK];
-	if (p->state != PROC_DEAD && p->pid == pid)
-		return p;
-	return NULL;
-}
-
 static inline struct file *fd_file(struct pcb *p, int fd)
 {
 	return (fd >= 0 && fd < NR_FILES && p->filp[fd]) ? p->filp[fd] : NULL;
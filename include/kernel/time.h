@@ -19,9 +19,11 @@
 #define _KERNEL_TIME_H_
 
 #include <telos/time.h>
+#include <telos/vclock.h>
 
 extern unsigned long tick_count;
 extern unsigned long system_clock;
+extern struct __vclock vclock;
 
 struct clock {
 	int (*get)(struct timespec*);
@@ -56,7 +56,9 @@ static inline void wake_all(struct wait_queue *q, int rc)
 {
 	struct pcb *p;
 	list_for_each_entry(p, &q->waiting, wait_chain) {
-		wake(p, rc);
+		// skip processes already woken but not yet run
+		if (p->state == PROC_INTERRUPTIBLE)
+			wake(p, rc);
 	}
 }
 
@@ -0,0 +1,52 @@
+/* Copyright (c) 2013-2015, Drew Thoreson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _TELOS_BLKDEV_H_
+#define _TELOS_BLKDEV_H_
+
+/* I/O schedulers, for BLKGETSCHED/BLKSETSCHED */
+#define IOSCHED_NOOP     0
+#define IOSCHED_DEADLINE 1
+#define IOSCHED_FAIR     2
+#define __NR_IOSCHED     3
+
+/* per-device queue statistics, for BLKGETSTATS */
+struct blkdev_stats {
+	unsigned long reads;         /* read requests completed */
+	unsigned long writes;        /* write requests completed */
+	unsigned long read_sectors;  /* sectors read */
+	unsigned long write_sectors; /* sectors written */
+	unsigned long merges;        /* buffers merged into pending requests */
+	unsigned long queued;        /* requests currently waiting */
+	unsigned long max_queued;    /* high water mark of queued */
+	unsigned long wait_ticks;    /* total ticks from submission to completion */
+};
+
+#endif
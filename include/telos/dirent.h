@@ -46,4 +46,28 @@ struct dirent {
 	char d_name[NAME_MAX+1];
 };
 
+/* values for d_type */
+#define DT_UNKNOWN 0
+#define DT_FIFO    1
+#define DT_CHR     2
+#define DT_DIR     4
+#define DT_BLK     6
+#define DT_REG     8
+#define DT_LNK     10
+#define DT_SOCK    12
+
+/*
+ * Variable-length directory entry, as returned in batches by getdents().
+ * d_reclen is the length of the whole record (the name is NUL-terminated and
+ * the record padded to a multiple of sizeof(long)); d_off is the directory
+ * position following the entry.
+ */
+struct dirent_rec {
+	ino_t d_ino;
+	unsigned long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
 #endif
@@ -46,4 +46,9 @@
 #define TCSETSW 0xFFFFFFFD /* tcsetattr(fd, TCSADRAIN, argp) */
 #define TCSETSF 0xFFFFFFFC /* tcsetattr(fd, TCSAFLUSH, argp) */
 
+/* block device ioctls */
+#define BLKGETSCHED 0xFFFFFEFF /* return I/O scheduler (IOSCHED_*) */
+#define BLKSETSCHED 0xFFFFFEFE /* set I/O scheduler to arg */
+#define BLKGETSTATS 0xFFFFFEFD /* get struct blkdev_stats in argp */
+
 #endif
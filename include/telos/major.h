@@ -40,6 +40,7 @@
 #define HD_MAJOR      3
 #define TTY_MAJOR     4
 #define MOD_MAJOR     5
+#define RAMDISK_MAJOR 6
 
 #ifndef __ASSEMBLER__
 #include <telos/type_defs.h>
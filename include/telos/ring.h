@@ -0,0 +1,92 @@
+/* Copyright (c) 2013-2015, Drew Thoreson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _TELOS_RING_H_
+#define _TELOS_RING_H_
+
+/*
+ * Batched system call ring.  A process maps a ring with SYS_RING_SETUP and
+ * queues I/O requests in the submission queue; a single SYS_RING_ENTER then
+ * executes them all, posting one completion per request.
+ *
+ * The submission queue is produced by the user (sq_tail) and consumed by the
+ * kernel (sq_head); the completion queue is produced by the kernel (cq_tail)
+ * and consumed by the user (cq_head).  Indices increase monotonically and are
+ * reduced modulo the queue size with the corresponding mask.
+ */
+
+#define RING_MAX_ENTRIES 256
+
+#define RING_OP_NOP    0
+#define RING_OP_READ   1 /* read at the file position */
+#define RING_OP_WRITE  2 /* write at the file position */
+#define RING_OP_PREAD  3 /* read at sqe->off */
+#define RING_OP_PWRITE 4 /* write at sqe->off */
+
+#ifndef __ASSEMBLER__
+#define __need_size_t
+#include <stddef.h>
+
+struct ring_sqe {
+	unsigned char opcode;
+	unsigned char flags;
+	unsigned short __pad;
+	int fd;
+	void *buf;
+	size_t len;
+	unsigned long off;
+	unsigned long user_data;
+};
+
+struct ring_cqe {
+	unsigned long user_data;
+	long res;
+};
+
+struct ring {
+	unsigned long sq_head;
+	unsigned long sq_tail;
+	unsigned long sq_mask;
+	unsigned long sq_entries;
+	unsigned long cq_head;
+	unsigned long cq_tail;
+	unsigned long cq_mask;
+	unsigned long cq_entries;
+	unsigned long sq_off; /* offset of the sqe array from the ring */
+	unsigned long cq_off; /* offset of the cqe array from the ring */
+};
+
+#define RING_SQE(r, i) \
+	(&((struct ring_sqe*)((char*)(r) + (r)->sq_off))[(i) & (r)->sq_mask])
+#define RING_CQE(r, i) \
+	(&((struct ring_cqe*)((char*)(r) + (r)->cq_off))[(i) & (r)->cq_mask])
+
+#endif /* !__ASSEMBLER__ */
+#endif
@@ -66,6 +66,12 @@
 #define SYS_CLOCK_GETTIME 28
 #define SYS_CLOCK_SETTIME 29
 #define SYS_SBRK          30
+#define SYS_RING_SETUP    31
+#define SYS_RING_ENTER    32
+#define SYS_SYNC          33
+#define SYS_FSYNC         34
+#define SYS_FDATASYNC     35
+#define SYS_BDFLUSH       36
 #define SYS_MMAP          40
 #define SYS_MUNMAP        41
 #define SYS_MOUNT         42
@@ -85,7 +91,13 @@
 #define SYS_EXECVE        56
 #define SYS_FSTAT         57
 #define SYS_PIPE          58
-#define SYSCALL_MAX       59
+#define SYS_GETDENTS      59
+#define SYS_SENDFILE      60
+#define SYS_READV         61
+#define SYS_WRITEV        62
+#define SYS_PREADV        63
+#define SYS_PWRITEV       64
+#define SYSCALL_MAX       65
 
 #ifndef __ASSEMBLER__
 static inline int syscall0(int call)
@@ -207,5 +219,134 @@ static inline int __syscall5(int call, unsigned long arg0, unsigned long arg1,
 	);
 	return rc;
 }
+
+/*
+ * Fast system call variants.  These call through the kernel's system call
+ * trampoline, which uses sysenter when the CPU supports it and falls back to
+ * int 0x80 otherwise.  The address of the trampoline is passed to a new
+ * process image on its initial stack, after the vclock page address.
+ */
+static inline int vsyscall0(void *entry, int call)
+{
+	int rc;
+	__asm__ volatile(
+	"movl %[call], %%eax	\n"
+	"call *%[entry]		\n"
+	"movl %%eax,   %[rc]	\n"
+	: [rc] "=g" (rc)
+	: [call] "g" (call), [entry] "rm" (entry)
+	: "%eax", "memory"
+	);
+	return rc;
+}
+
+#define vsyscall1(entry, call, arg0) \
+	__vsyscall1(entry, call, (unsigned long) arg0)
+static inline int __vsyscall1(void *entry, int call, unsigned long arg0)
+{
+	int rc;
+	__asm__ volatile(
+	"movl %[call], %%eax	\n"
+	"movl %[arg0], %%ebx	\n"
+	"call *%[entry]		\n"
+	"movl %%eax, %[rc]	\n"
+	: [rc] "=g" (rc)
+	: [call] "g" (call), [arg0] "g" (arg0), [entry] "rm" (entry)
+	: "%eax", "%ebx", "memory"
+	);
+	return rc;
+}
+
+#define vsyscall2(entry, call, arg0, arg1) \
+	__vsyscall2(entry, call, (unsigned long) arg0, (unsigned long) arg1)
+static inline int __vsyscall2(void *entry, int call, unsigned long arg0,
+		unsigned long arg1)
+{
+	int rc;
+	__asm__ volatile(
+	"movl %[call], %%eax	\n"
+	"movl %[arg0], %%ebx	\n"
+	"movl %[arg1], %%ecx	\n"
+	"call *%[entry]		\n"
+	"movl %%eax, %[rc]	\n"
+	: [rc] "=g" (rc)
+	: [call] "g" (call), [arg0] "g" (arg0), [arg1] "g" (arg1),
+	  [entry] "rm" (entry)
+	: "%eax", "%ebx", "%ecx", "memory"
+	);
+	return rc;
+}
+
+#define vsyscall3(entry, call, arg0, arg1, arg2) \
+	__vsyscall3(entry, call, (unsigned long) arg0, (unsigned long) arg1, \
+			(unsigned long) arg2)
+static inline int __vsyscall3(void *entry, int call, unsigned long arg0,
+		unsigned long arg1, unsigned long arg2)
+{
+	int rc;
+	__asm__ volatile(
+	"movl %[call], %%eax	\n"
+	"movl %[arg0], %%ebx	\n"
+	"movl %[arg1], %%ecx	\n"
+	"movl %[arg2], %%edx	\n"
+	"call *%[entry]		\n"
+	"movl %%eax, %[rc]	\n"
+	: [rc] "=g" (rc)
+	: [call] "g" (call), [arg0] "g" (arg0), [arg1] "g" (arg1),
+	  [arg2] "g" (arg2), [entry] "rm" (entry)
+	: "%eax", "%ebx", "%ecx", "%edx", "memory"
+	);
+	return rc;
+}
+
+#define vsyscall4(entry, call, arg0, arg1, arg2, arg3) \
+	__vsyscall4(entry, call, (unsigned long) arg0, (unsigned long) arg1, \
+			(unsigned long) arg2, (unsigned long) arg3)
+static inline int __vsyscall4(void *entry, int call, unsigned long arg0,
+		unsigned long arg1, unsigned long arg2, unsigned long arg3)
+{
+	int rc;
+	__asm__ volatile(
+	"movl %[call], %%eax	\n"
+	"movl %[arg0], %%ebx	\n"
+	"movl %[arg1], %%ecx	\n"
+	"movl %[arg2], %%edx	\n"
+	"movl %[arg3], %%edi	\n"
+	"call *%[entry]		\n"
+	"movl %%eax, %[rc]	\n"
+	: [rc] "=g" (rc)
+	: [call] "g" (call), [arg0] "g" (arg0), [arg1] "g" (arg1),
+	  [arg2] "g" (arg2), [arg3] "g" (arg3), [entry] "rm" (entry)
+	: "%eax", "%ebx", "%ecx", "%edx", "%edi", "memory"
+	);
+	return rc;
+}
+
+#define vsyscall5(entry, call, arg0, arg1, arg2, arg3, arg4) \
+	__vsyscall5(entry, call, (unsigned long) arg0, (unsigned long) arg1, \
+			(unsigned long) arg2, (unsigned long) arg3, \
+			(unsigned long) arg4)
+static inline int __vsyscall5(void *entry, int call, unsigned long arg0,
+		unsigned long arg1, unsigned long arg2, unsigned long arg3,
+		unsigned long arg4)
+{
+	int rc;
+	__asm__ volatile(
+	"movl %[call], %%eax	\n"
+	"movl %[arg0], %%ebx	\n"
+	"movl %[arg1], %%ecx	\n"
+	"movl %[arg2], %%edx	\n"
+	"movl %[arg3], %%edi	\n"
+	"movl %[arg4], %%esi	\n"
+	"call *%[entry]		\n"
+	"movl %%eax, %[rc]	\n"
+	: [rc] "=g" (rc)
+	: [call] "g" (call), [arg0] "g" (arg0), [arg1] "g" (arg1),
+	  [arg2] "g" (arg2), [arg3] "g" (arg3), [arg4] "g" (arg4),
+	  [entry] "rm" (entry)
+	: "%eax", "%ebx", "%ecx", "%edx", "%edi", "%esi", "memory"
+	);
+	return rc;
+}
 #endif /* !__ASSEMBLER__ */
 #endif
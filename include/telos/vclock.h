@@ -0,0 +1,142 @@
+/* Copyright (c) 2013-2015, Drew Thoreson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _TELOS_VCLOCK_H_
+#define _TELOS_VCLOCK_H_
+
+#include <telos/time.h>
+
+#ifndef __ASSEMBLER__
+
+/*
+ * The vclock page is a read-only page of kernel memory which is mapped into
+ * every process.  The kernel updates it on every timer tick, so that the time
+ * can be read without entering the kernel.  The address of the page is passed
+ * to a new process image on its initial stack, after the envp pointer.
+ *
+ * Updates are protected by a sequence counter: the counter is odd while an
+ * update is in progress, and readers retry if it changed while they were
+ * reading.
+ */
+struct __vclock {
+	volatile unsigned long seq;
+	unsigned long ticks;          /* ticks since boot */
+	time_t realtime_sec;          /* seconds since the Epoch */
+	long realtime_nsec;           /* sub-second part of the real time */
+	unsigned long long tsc_base;  /* TSC value at the last tick */
+	unsigned long tsc_per_tick;   /* TSC calibration; 0 if no usable TSC */
+};
+
+#define __vclock_barrier() __asm__ __volatile__("" : : : "memory")
+
+static inline unsigned long __vclock_read_begin(const struct __vclock *vc)
+{
+	unsigned long seq;
+
+	while ((seq = vc->seq) & 1)
+		/* update in progress */;
+	__vclock_barrier();
+	return seq;
+}
+
+static inline int __vclock_read_retry(const struct __vclock *vc,
+		unsigned long seq)
+{
+	__vclock_barrier();
+	return vc->seq != seq;
+}
+
+static inline unsigned long long __vclock_rdtsc(void)
+{
+	unsigned long long tsc;
+	__asm__ __volatile__("rdtsc" : "=A" (tsc));
+	return tsc;
+}
+
+/*
+ * Nanoseconds elapsed since the last tick, interpolated using the TSC.  The
+ * result is clamped to less than one tick so that the clock never runs ahead
+ * of the next update.
+ */
+static inline long __vclock_tick_nsec(const struct __vclock *vc)
+{
+	unsigned long long delta;
+
+	if (!vc->tsc_per_tick)
+		return 0;
+	delta = __vclock_rdtsc() - vc->tsc_base;
+	if (delta >= vc->tsc_per_tick)
+		delta = vc->tsc_per_tick - 1;
+	return (long) (delta * __NSEC_PER_TICK / vc->tsc_per_tick);
+}
+
+static inline unsigned long __vclock_ticks(const struct __vclock *vc)
+{
+	return vc->ticks;
+}
+
+static inline time_t __vclock_time(const struct __vclock *vc)
+{
+	return vc->realtime_sec;
+}
+
+/*
+ * Read CLOCK_REALTIME or CLOCK_MONOTONIC from the vclock page.  Returns -1
+ * for clocks which must be read through the clock_gettime system call.
+ */
+static inline int __vclock_gettime(const struct __vclock *vc, clockid_t clock,
+		struct timespec *tp)
+{
+	unsigned long seq;
+	long nsec;
+
+	do {
+		seq = __vclock_read_begin(vc);
+		switch (clock) {
+		case CLOCK_REALTIME:
+			tp->tv_sec = vc->realtime_sec;
+			nsec = vc->realtime_nsec;
+			break;
+		case CLOCK_MONOTONIC:
+			tp->tv_sec = vc->ticks / __TICKS_PER_SEC;
+			nsec = (vc->ticks % __TICKS_PER_SEC) * __NSEC_PER_TICK;
+			break;
+		default:
+			return -1;
+		}
+		nsec += __vclock_tick_nsec(vc);
+	} while (__vclock_read_retry(vc, seq));
+
+	tp->tv_nsec = nsec;
+	return 0;
+}
+
+#endif /* !__ASSEMBLER__ */
+#endif
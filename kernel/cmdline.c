@@ -0,0 +1,105 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <kernel/cmdline.h>
+#include <kernel/multiboot.h>
+#include <string.h>
+
+static const char *get_cmdline(void)
+{
+	if (!MULTIBOOT_CMDLINE_VALID(mb_info))
+		return "";
+	return (const char*) mb_info->cmdline;
+}
+
+/*
+ * Find a parameter on the command line.  Returns a pointer to its value
+ * (which is terminated by a space or the end of the string), or an empty
+ * string if the parameter has no value.  Returns NULL if the parameter is not
+ * present.
+ */
+const char *cmdline_param(const char *name)
+{
+	size_t len = strlen(name);
+	const char *s = get_cmdline();
+
+	while (*s) {
+		size_t word = strcspn(s, " ");
+		if (word >= len && !strncmp(s, name, len)) {
+			if (s[len] == '=')
+				return s + len + 1;
+			if (word == len)
+				return s + len;
+		}
+		s += word;
+		s += strspn(s, " ");
+	}
+	return NULL;
+}
+
+/*
+ * A flag is set if it is present without a value, or with a value other than
+ * "0".
+ */
+bool cmdline_flag(const char *name)
+{
+	const char *val = cmdline_param(name);
+	return val && *val != '0';
+}
+
+/*
+ * Parse a numeric parameter.  The value may be given in decimal or (with a
+ * "0x" prefix) hexadecimal, and may be followed by one of the suffixes K, M or
+ * G to multiply it by 2^10, 2^20 or 2^30.
+ */
+int cmdline_ulong(const char *name, unsigned long *val)
+{
+	char buf[24];
+	int error;
+	unsigned long n;
+	unsigned int shift = 0;
+	size_t len;
+	const char *s = cmdline_param(name);
+
+	if (!s || !(len = strcspn(s, " ")))
+		return -EINVAL;
+	switch (s[len-1]) {
+	case 'G': case 'g':
+		shift += 10;
+		/* fall through */
+	case 'M': case 'm':
+		shift += 10;
+		/* fall through */
+	case 'K': case 'k':
+		shift += 10;
+		len--;
+	}
+	if (len >= sizeof(buf))
+		return -EINVAL;
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+
+	error = kstrtoul(buf, buf[0] == '0' && (buf[1] == 'x' || buf[1] == 'X')
+			? 16 : 10, &n);
+	if (error)
+		return error;
+	if ((n << shift) >> shift != n)
+		return -ERANGE;
+	*val = n << shift;
+	return 0;
+}
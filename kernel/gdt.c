@@ -95,6 +95,38 @@ static inline void load_gdt(void *base, unsigned short size)
 	);
 }
 
+/* read by the user-visible system call trampoline in entry.S */
+unsigned long sysenter_enabled __user_data;
+
+extern void sysenter_entry(void);
+
+/*
+ * Enable the sysenter/sysexit fast system call path, if the CPU supports it.
+ * The GDT layout (kernel code, kernel data, user code, user data) is the one
+ * sysenter and sysexit expect relative to MSR_SYSENTER_CS.
+ */
+static void sysenter_init(void)
+{
+	unsigned long eax, ebx, ecx, edx;
+	unsigned long family, model, stepping;
+
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	if (!(edx & CPUID_EDX_SEP))
+		return;
+
+	/* the Pentium Pro reports SEP but does not implement it */
+	family = (eax >> 8) & 0xF;
+	model = (eax >> 4) & 0xF;
+	stepping = eax & 0xF;
+	if (family == 6 && model < 3 && stepping < 3)
+		return;
+
+	wrmsr(MSR_SYSENTER_CS, SEG_KCODE);
+	wrmsr(MSR_SYSENTER_ESP, (unsigned long) &tss.esp0);
+	wrmsr(MSR_SYSENTER_EIP, (unsigned long) sysenter_entry);
+	sysenter_enabled = 1;
+}
+
 static inline void load_tss(unsigned short val)
 {
 	asm volatile(
@@ -115,4 +147,5 @@ void gdt_install(void)
 
 	load_gdt(&gdt, sizeof gdt); // -1?
 	load_tss(SEG_TSS | 3); // load tss with RPL 3
+	sysenter_init();
 }
@@ -0,0 +1,114 @@
+/*  Copyright 2013-2015 Drew Thoreson
+ *
+ *  This file is part of Telos.
+ *  
+ *  Telos is free software: you can redistribute it and/or modify it under the
+ *  terms of the GNU General Public License as published by the Free Software
+ *  Foundation, version 2 of the License.
+ *
+ *  Telos is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Telos.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <kernel/hashtable.h>
+#include <kernel/mm/kmalloc.h>
+
+/* number of old buckets to migrate per insertion while resizing */
+#define HTABLE_MIGRATE_BATCH 8
+
+static void htable_migrate(struct htable *ht)
+{
+	struct hlist_node *node, *tmp;
+	unsigned long nr_old = 1UL << ht->old_bits;
+	unsigned long end = ht->migrated + HTABLE_MIGRATE_BATCH;
+
+	if (end > nr_old)
+		end = nr_old;
+
+	for (; ht->migrated < end; ht->migrated++) {
+		hlist_for_each_safe(node, tmp, &ht->old[ht->migrated]) {
+			hlist_del(node);
+			hlist_add_head(node, htable_head(ht->buckets, ht->bits,
+						ht->key(node)));
+		}
+	}
+
+	if (ht->migrated < nr_old)
+		return;
+	if (ht->old_bits != ht->initial_bits)
+		kfree(ht->old);
+	ht->old = NULL;
+}
+
+static void htable_grow(struct htable *ht)
+{
+	struct hlist_head *buckets;
+	unsigned long nr = 1UL << (ht->bits + 1);
+
+	if (!(buckets = kmalloc(nr * sizeof(*buckets))))
+		return;
+	for (unsigned long i = 0; i < nr; i++)
+		INIT_HLIST_HEAD(&buckets[i]);
+
+	ht->old = ht->buckets;
+	ht->old_bits = ht->bits;
+	ht->migrated = 0;
+	ht->buckets = buckets;
+	ht->bits++;
+}
+
+/*
+ * Add an entry to a resizable hash table.  If a resize is in progress, part
+ * of the old table is migrated first; otherwise the table is grown if the
+ * load factor is too high.
+ */
+void htable_add(struct htable *ht, struct hlist_node *node, u32 key)
+{
+	if (ht->old)
+		htable_migrate(ht);
+	else if (ht->nr_entries >= HTABLE_MAX_LOAD << ht->bits && ht->bits < 31)
+		htable_grow(ht);
+
+	hlist_add_head(node, htable_head(ht->buckets, ht->bits, key));
+	ht->nr_entries++;
+}
+
+/*
+ * Remove an entry from a resizable hash table.  This never moves other
+ * entries, so it may be used while iterating over the table.
+ */
+void htable_del(struct htable *ht, struct hlist_node *node)
+{
+	if (hlist_unhashed(node))
+		return;
+	hlist_del_init(node);
+	ht->nr_entries--;
+}
+
+void htable_stats(struct htable *ht, struct htable_stats *stats)
+{
+	struct hlist_node *node;
+	unsigned long bkt;
+
+	stats->entries = ht->nr_entries;
+	stats->buckets = htable_nr_buckets(ht);
+	stats->used_buckets = 0;
+	stats->max_chain = 0;
+	stats->resizing = ht->old != NULL;
+
+	for (bkt = 0; bkt < htable_nr_buckets(ht); bkt++) {
+		unsigned long len = 0;
+		hlist_for_each(node, htable_bucket(ht, bkt))
+			len++;
+		if (len)
+			stats->used_buckets++;
+		if (len > stats->max_chain)
+			stats->max_chain = len;
+	}
+}
@@ -56,6 +56,8 @@ _Noreturn void _panic(const char *fmt, ...)
 	halt();
 }
 
+#include <kernel/mmap.h>
+#include <kernel/mm/paging.h>
 #include <kernel/mm/vma.h>
 
 #define PGF_PERM  1
@@ -90,6 +92,7 @@ static void segfault(int code, unsigned long error, void *addr)
 
 void exn_page_fault(void)
 {
+	int rc;
 	void *addr;
 	struct vma *vma;
 	unsigned long error;
@@ -97,6 +100,15 @@ void exn_page_fault(void)
 	error = get_error_code(current->esp);
 	MOV("cr2", addr);
 
+	// kernel pages shared with user space are copy-on-write
+	if ((error & (PGF_WRITE | PGF_USER)) == PGF_WRITE
+			&& (uintptr_t)addr >= kernel_base) {
+		if (!(rc = kunshare_page(addr)))
+			return;
+		if (rc == -ENOMEM)
+			panic("No memory to unshare kernel page at 0x%p", addr);
+	}
+
 	// address not mapped in process address space
 	if (!(vma = vma_get(&current->mm, addr))) {
 		segfault(SEGV_MAPERR, error, addr);
@@ -158,6 +170,20 @@ extern void ill_entry(void);
 extern void pgf_entry(void);
 extern void timer_entry(void);
 extern void kbd_entry(void);
+extern void irq2(void);
+extern void irq3(void);
+extern void irq4(void);
+extern void irq5(void);
+extern void irq6(void);
+extern void irq7(void);
+extern void irq8(void);
+extern void irq9(void);
+extern void irq10(void);
+extern void irq11(void);
+extern void irq12(void);
+extern void irq13(void);
+extern void irq14(void);
+extern void irq15(void);
 extern void syscall_entry(void);
 extern void schedule_entry(void);
 
@@ -256,6 +282,12 @@ static const struct exn exns[] = {
 };
 #define NR_EXNS (sizeof(exns)/sizeof(*exns))
 
+/* entry points for IRQs, indexed by IRQ number */
+static void (*const irqs[NR_IRQS])(void) = {
+	timer_entry, kbd_entry, irq2,  irq3,  irq4,  irq5,  irq6,  irq7,
+	irq8,        irq9,      irq10, irq11, irq12, irq13, irq14, irq15,
+};
+
 /*
  * Generic interrupt handler: prints some useful info, then either panics
  * (if in-kernel) or kills the current process.
@@ -318,8 +350,8 @@ void idt_install(void)
 	memset(idt, 0, sizeof(struct idt_entry) * 256);
 	for (unsigned int i = 0; i < NR_EXNS; i++)
 		set_gate(i, (unsigned long) exns[i].handler, SEG_KCODE, 2);
-	set_gate(INTR_TIMER,    (ulong) timer_entry,    SEG_KCODE, 2);
-	set_gate(INTR_KBD,      (ulong) kbd_entry,      SEG_KCODE, 2);
+	for (unsigned int i = 0; i < NR_IRQS; i++)
+		set_gate(INTR_IRQ(i), (unsigned long) irqs[i], SEG_KCODE, 2);
 	set_gate(INTR_SYSCALL,  (ulong) syscall_entry,  SEG_KCODE, 3);
 	load_idt(&idt, sizeof(struct idt_entry) * 256);
 }
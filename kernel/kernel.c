@@ -84,6 +84,7 @@ void kmain(struct multiboot_info *info, unsigned long magic)
 	bprintf("Total:     %lx bytes\n", MULTIBOOT_MEM_MAX(mb_info));
 
 	mount_root();
+	start_bdflush();
 
 	bprintf("Starting Telos...\n\n");
 	sched_start();
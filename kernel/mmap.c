@@ -92,6 +92,25 @@ abort:
 	return error;
 }
 
+/*
+ * Private mappings of files which live in memory that isn't part of the frame
+ * pool (i.e. boot modules) map that memory directly, read-only.  A write
+ * fault then copies the page as it would after fork.
+ */
+static int mmap_private_map(struct vma *vma, void *addr)
+{
+	uintptr_t phys;
+	struct mmap_private *private = vma->private;
+	struct file *file = private->file;
+	uintptr_t base = page_base((uintptr_t)addr);
+	unsigned long pos = private->off + (base - vma->start);
+
+	if (file->f_op->mmap_frame && !(pos % FRAME_SIZE)
+			&& (phys = file->f_op->mmap_frame(file, pos)))
+		return map_phys(phys, addr, vma->flags & ~VM_WRITE);
+	return mmap_map(vma, addr);
+}
+
 static int mmap_writeback(struct vma *vma, void *addr, size_t len)
 {
 	ssize_t bytes;
@@ -134,7 +153,7 @@ static int mmap_split(struct vma *new, struct vma *old)
 }
 
 struct vma_operations mmap_vma_ops = {
-	.map = mmap_map,
+	.map = mmap_private_map,
 	.unmap = mmap_unmap,
 	.clone = mmap_clone,
 	.split = mmap_split,
@@ -174,7 +193,7 @@ int do_mmap(struct file *file, void **addr, size_t len, int prot, int flags,
 	return 0;
 }
 
-static int do_mmap_anon(void **addr, size_t len, int prot, int flags)
+int do_mmap_anon(void **addr, size_t len, int prot, int flags)
 {
 	struct vma *vma = mmap_create_vma(*addr, len, prot | VM_ZERO, flags);
 	if (!vma)
@@ -44,6 +44,7 @@ static PAGE_TABLE(_tmp_pgtab);
 
 /* free list for page heap */
 static LIST_HEAD(frame_pool);
+static unsigned long frame_pool_size;
 static struct pf_info *frame_table;
 static uintptr_t fp_start;
 static unsigned int first_free;
@@ -82,6 +83,27 @@ static struct pf_info *phys_to_info(uintptr_t addr)
 	return &frame_table[(addr - fp_start) / FRAME_SIZE];
 }
 
+/*
+ * Frames below the frame pool (e.g. multiboot modules) may be mapped into user
+ * space with map_phys().  These aren't reference counted, and never freed.
+ */
+static inline bool frame_managed(pte_t pte)
+{
+	return (pte & ~0xFFF) >= fp_start;
+}
+
+static inline void pte_get(pte_t pte)
+{
+	if (frame_managed(pte))
+		phys_to_info(pte & ~0xFFF)->ref++;
+}
+
+static inline void pte_put(pte_t pte)
+{
+	if (frame_managed(pte))
+		kfree_frame(phys_to_info(pte & ~0xFFF));
+}
+
 /*
  * Get the page table entry associated with a given address in a given
  * address space.  Assumes a page table exists mapping the region containing
@@ -286,7 +308,7 @@ static pmap_t clone_pgtab(uintptr_t phys_pgtab)
 	for (unsigned int i = 0; i < 1024; i++) {
 		if (!(original[i] & PE_P))
 			continue;
-		phys_to_info(original[i] & ~0xFFF)->ref++;
+		pte_get(original[i]);
 		copy[i] = original[i];
 	}
 	return (pmap_t) f_pgtab->addr;
@@ -394,7 +416,7 @@ static int del_pgtab(uintptr_t phys_pgtab)
 	for (int i = 0; i < 1024; i++) {
 		if (!(pgtab[i] & PE_P))
 			continue;
-		kfree_frame(phys_to_info(pgtab[i] & ~0xFFF));
+		pte_put(pgtab[i]);
 	}
 	kunmap_tmp_page(pgtab);
 	kfree_frame(phys_to_info(phys_pgtab));
@@ -423,7 +445,7 @@ static int del_pgdir(uintptr_t phys_pgdir)
 
 static inline void free_pte(pte_t pte)
 {
-	kfree_frame(phys_to_info(pte & ~0xFFF));
+	pte_put(pte);
 }
 
 static int free_husk(uintptr_t phys_pgdir)
@@ -515,7 +537,7 @@ static pte_t pm_unmap_fn(struct vma *vma, void *addr, pte_t pte)
 {
 	if (pte & PE_D)
 		vm_writeback(vma, addr, FRAME_SIZE);
-	kfree_frame(phys_to_info(pte & ~0xFFF));
+	pte_put(pte);
 	return 0;
 }
 
@@ -545,7 +567,7 @@ static pte_t pm_copy_fn(struct vma *vma, void *addr, pte_t pte)
 	memcpy(tmp, addr, FRAME_SIZE);
 	kunmap_tmp_page(tmp);
 
-	kfree_frame(phys_to_info(pte & ~0xFFF));
+	pte_put(pte);
 	return frame->addr | (pte & 0xFFF);
 }
 
@@ -564,6 +586,31 @@ int pm_copy_to(uintptr_t phys_pgdir, void *dst, const void *src, size_t len)
 	return 0;
 }
 
+/*
+ * Caches that can give memory back when the frame pool runs dry.
+ */
+static LIST_HEAD(shrinkers);
+
+#define SHRINK_BATCH 32
+
+void register_shrinker(struct shrinker *shrinker)
+{
+	list_add_tail(&shrinker->chain, &shrinkers);
+}
+
+static unsigned long shrink_caches(unsigned long nr)
+{
+	struct shrinker *s;
+	unsigned long freed = 0;
+
+	list_for_each_entry(s, &shrinkers, chain) {
+		freed += s->shrink(nr - freed);
+		if (freed >= nr)
+			break;
+	}
+	return freed;
+}
+
 /*
  * Allocate a page from the frame pool.
  */
@@ -573,10 +620,13 @@ struct pf_info *kalloc_frame(int flags)
 	struct pf_info *page;
 
 	if (list_empty(&frame_pool))
-		panic("out of memory!"); // TODO: try to free some memory
+		shrink_caches(SHRINK_BATCH);
+	if (list_empty(&frame_pool))
+		panic("out of memory!");
 
 	page = list_pop(&frame_pool, struct pf_info, chain);
 	page->ref = 1;
+	frame_pool_size--;
 
 	if (flags & VM_ZERO) {
 		vaddr = kmap_tmp_page(page->addr);
@@ -592,6 +642,16 @@ struct pf_info *kalloc_frame(int flags)
 void _kfree_frame(struct pf_info *page)
 {
 	list_push(&page->chain, &frame_pool);
+	frame_pool_size++;
+}
+
+/*
+ * Get the number of frames in the frame pool.  Memory held by caches which can
+ * be shrunk is not counted.
+ */
+unsigned long nr_free_frames(void)
+{
+	return frame_pool_size;
 }
 
 /*
@@ -609,38 +669,18 @@ static pmap_t umap_page_table(pmap_t pgdir, uintptr_t addr)
 	return kmap_tmp_page(*pde & ~0xFFF);
 }
 
-static void do_map_pgtab(uintptr_t phys_pgdir, uintptr_t phys_pgtab,
-		uintptr_t addr)
-{
-	pmap_t pgdir = kmap_tmp_page(phys_pgdir);
-	*(addr_to_pde(pgdir, addr)) = phys_pgtab | PE_P | PE_RW;
-	kunmap_tmp_page(pgdir);
-}
-
 /*
- * Map the page table for the given (kernel) address.  If the page table does
- * not yet exist, it is allocated and added to all process page directories.
+ * Map the page table for the given (kernel) address.  All kernel page tables
+ * are allocated at boot (see SYSINIT(mem)), so that every page directory
+ * shares them and a new kernel mapping never has to be propagated to each
+ * process.
  */
 static pmap_t kmap_page_table(uintptr_t addr)
 {
 	pte_t *pde = addr_to_pde(kernel_pgdir, addr);
 
-	// allocate page table if one does not already exist
-	if (!(*pde & PE_P)) {
-		struct pf_info *husk;
-		struct pf_info *frame = kalloc_frame(VM_ZERO);
-		*pde = frame->addr | PE_P | PE_RW;
-		// update process page direcories
-		for (unsigned int i = 0; i < PT_SIZE; i++) {
-			struct pcb *p = &proctab[i];
-			if (p->state == PROC_DEAD)
-				continue;
-			do_map_pgtab(p->mm.pgdir, frame->addr, addr);
-		}
-		list_for_each_entry(husk, &husk_list, chain) {
-			do_map_pgtab(husk->addr, frame->addr, addr);
-		}
-	}
+	if (!(*pde & PE_P))
+		panic("missing kernel page table for %lx", (unsigned long) addr);
 
 	return kmap_tmp_page(*pde & ~0xFFF);
 }
@@ -653,6 +693,20 @@ static pmap_t knext_page_table(unsigned int i, pmap_t pgtab)
 	return kmap_page_table(i * FRAME_SIZE);
 }
 
+/*
+ * Get the physical address backing a kernel virtual address, by looking it up
+ * in the kernel page tables.  Unlike kernel_to_phys(), this works for memory
+ * from kalloc_pages(), which is not direct-mapped.
+ */
+uintptr_t kvirt_to_phys(void *addr)
+{
+	pmap_t pgtab = kmap_page_table((uintptr_t)addr);
+	pte_t pte = pgtab[addr_to_pti((uintptr_t)addr)];
+
+	kunmap_tmp_page(pgtab);
+	return page_base(pte) | ((uintptr_t)addr & 0xFFF);
+}
+
 static pmap_t unext_page_table(unsigned i, pmap_t pgdir, pmap_t pgtab)
 {
 	if (i % 1024 != 0)
@@ -698,6 +752,90 @@ int map_frame(struct pf_info *frame, void *addr, int flags)
 	return 0;
 }
 
+/*
+ * Map a frame outside of the frame pool into the current address space.
+ */
+int map_phys(uintptr_t phys, void *addr, int flags)
+{
+	pmap_t pgtab;
+	unsigned char attr = vma_to_page_flags(flags);
+
+	if (frame_managed(phys))
+		return -EINVAL;
+	pgtab = umap_page_table(current_pgdir, (uintptr_t) addr);
+	pgtab[addr_to_pti((uintptr_t)addr)] = page_base(phys) | PE_P | attr;
+	kunmap_tmp_page(pgtab);
+	return 0;
+}
+
+/*
+ * Share a page of kernel memory with user space: the frame is mapped read-only
+ * at @uaddr in the current address space (replacing whatever was there), and
+ * the kernel's own mapping becomes copy-on-write, so that neither side sees
+ * the other's later writes.
+ */
+int kshare_page(void *kaddr, void *uaddr, int flags)
+{
+	pte_t *kpte, *pte;
+	pmap_t kpgtab, pgtab;
+	unsigned char attr = vma_to_page_flags(flags & ~VM_WRITE);
+
+	kpgtab = kmap_page_table((uintptr_t)kaddr);
+	kpte = &kpgtab[addr_to_pti((uintptr_t)kaddr)];
+	if (!(*kpte & PE_P) || !frame_managed(*kpte)) {
+		kunmap_tmp_page(kpgtab);
+		return -EINVAL;
+	}
+	pte_get(*kpte);
+	*kpte = (*kpte & ~PE_RW) | PE_COW;
+
+	pgtab = umap_page_table(current_pgdir, (uintptr_t)uaddr);
+	pte = &pgtab[addr_to_pti((uintptr_t)uaddr)];
+	if (*pte & PE_P)
+		pte_put(*pte);
+	*pte = (*kpte & ~0xFFF) | PE_P | attr;
+
+	kunmap_tmp_page(pgtab);
+	kunmap_tmp_page(kpgtab);
+	flush_page(kaddr);
+	flush_page(uaddr);
+	return 0;
+}
+
+/*
+ * Make a shared kernel page writable again (called on a write fault), copying
+ * it if user space still holds a reference.  Returns -EINVAL if the page is
+ * not shared, or -ENOMEM if there is no frame to copy it to.
+ */
+int kunshare_page(void *kaddr)
+{
+	void *tmp;
+	pte_t *pte;
+	struct pf_info *frame;
+	pmap_t pgtab = kmap_page_table((uintptr_t)kaddr);
+
+	pte = &pgtab[addr_to_pti((uintptr_t)kaddr)];
+	if (!(*pte & PE_P) || !(*pte & PE_COW)) {
+		kunmap_tmp_page(pgtab);
+		return -EINVAL;
+	}
+	if (phys_to_info(*pte & ~0xFFF)->ref > 1) {
+		if (!(frame = kalloc_frame(0))) {
+			kunmap_tmp_page(pgtab);
+			return -ENOMEM;
+		}
+		tmp = kmap_tmp_page(frame->addr);
+		memcpy(tmp, (void*)page_base(kaddr), FRAME_SIZE);
+		kunmap_tmp_page(tmp);
+		pte_put(*pte);
+		*pte = frame->addr | (*pte & 0xFFF);
+	}
+	*pte = (*pte & ~PE_COW) | PE_RW;
+	kunmap_tmp_page(pgtab);
+	flush_page(page_base(kaddr));
+	return 0;
+}
+
 int map_page(void *addr, int flags)
 {
 	struct pf_info *frame = kalloc_frame(flags);
@@ -718,7 +856,8 @@ int copy_page(void *addr, int flags)
 	if (!pgtab)
 		return -ENOMEM;
 	// no need to copy if frame is only referenced once
-	if (phys_to_info(pgtab[pti] & ~0xFFF)->ref == 1) {
+	if (frame_managed(pgtab[pti])
+			&& phys_to_info(pgtab[pti] & ~0xFFF)->ref == 1) {
 		pgtab[pti] |= attr;
 		goto success;
 	}
@@ -731,7 +870,7 @@ int copy_page(void *addr, int flags)
 	memcpy(tmp, (void*)page_base(addr), FRAME_SIZE);
 	kunmap_tmp_page(tmp);
 
-	kfree_frame(phys_to_info(pgtab[pti] & ~0xFFF));
+	pte_put(pgtab[pti]);
 	pgtab[pti] = frame->addr | PE_P | attr;
 success:
 	kunmap_tmp_page(pgtab);
@@ -740,16 +879,16 @@ success:
 }
 
 /*
- * Allocate and map n consecutive pages in the kernel's address space.
+ * Find n consecutive, unmapped pages in the kernel's address space.  Returns
+ * the page number of the first page.
  */
-void *kalloc_pages(unsigned int n)
+static unsigned int kfind_pages(unsigned int n)
 {
 	unsigned int count = 0;
 	unsigned int start = 0;
 	unsigned int i = first_free;
 	pmap_t pgtab = kmap_page_table(i * FRAME_SIZE);
 
-	/* find n consecutive, free pages */
 	for (i = first_free; /*TODO*/; i++, pgtab = knext_page_table(i, pgtab)) {
 		if (pgtab[i % 1024] & PE_P) {
 			count = 0;
@@ -763,32 +902,67 @@ void *kalloc_pages(unsigned int n)
 	}
 	kunmap_tmp_page(pgtab);
 	// TODO: if (i == LIMIT) fail()
+	return start;
+}
+
+/*
+ * Update first_free after mapping n pages starting at page number start.
+ */
+static void kupdate_first_free(unsigned int start, unsigned int n)
+{
+	pmap_t pgtab;
 
-	pgtab = kmap_page_table(start * FRAME_SIZE);
+	if (start != first_free)
+		return;
+	pgtab = kmap_page_table((start+n) * FRAME_SIZE);
+	for (unsigned int i = start + n; ; i++, pgtab = knext_page_table(i, pgtab)) {
+		if (!(pgtab[i % 1024] & PE_P)) {
+			first_free = i;
+			break;
+		}
+	}
+	kunmap_tmp_page(pgtab);
+	// TODO: check limit
+}
+
+/*
+ * Allocate and map n consecutive pages in the kernel's address space.
+ */
+void *kalloc_pages(unsigned int n)
+{
+	unsigned int start = kfind_pages(n);
+	pmap_t pgtab = kmap_page_table(start * FRAME_SIZE);
 
 	/* allocate and map frames */
-	for (i = start; i < start + n; i++, pgtab = knext_page_table(i, pgtab)) {
+	for (unsigned int i = start; i < start + n; i++, pgtab = knext_page_table(i, pgtab)) {
 		struct pf_info *frame = kalloc_frame(0);
 		pgtab[i % 1024] = frame->addr | PE_P | PE_RW;
 	}
 	kunmap_tmp_page(pgtab);
 
-	/* update first_free */
-	if (start == first_free) {
-		pgtab = kmap_page_table((start+n) * FRAME_SIZE);
-		for (i = start + n; ; i++, pgtab = knext_page_table(i, pgtab)) {
-			if (!(pgtab[i % 1024] & PE_P)) {
-				first_free = i;
-				break;
-			}
-		}
-		kunmap_tmp_page(pgtab);
-		// TODO: check limit
-	}
+	kupdate_first_free(start, n);
 	flush_pages(start * FRAME_SIZE, n);
 	return (void*) (start * FRAME_SIZE);
 }
 
+/*
+ * Map the physical page containing @phys read-write at a free address in the
+ * kernel's address space.  This gives the kernel a writable alias of a page
+ * which is mapped read-only elsewhere.  Undo with kunmap_page().
+ */
+void *kmap_phys(uintptr_t phys)
+{
+	unsigned int page = kfind_pages(1);
+	pmap_t pgtab = kmap_page_table(page * FRAME_SIZE);
+
+	pgtab[page % 1024] = page_base(phys) | PE_P | PE_RW;
+	kunmap_tmp_page(pgtab);
+
+	kupdate_first_free(page, 1);
+	flush_page(page * FRAME_SIZE);
+	return (void*) (page * FRAME_SIZE + (phys & 0xFFF));
+}
+
 void kfree_pages(void *addr, unsigned int n)
 {
 	unsigned int start = (uintptr_t)addr / FRAME_SIZE;
@@ -864,6 +1038,7 @@ static int frame_pool_init(uintptr_t start, uintptr_t end)
 		frame_table[i].addr = start + i*FRAME_SIZE;
 		frame_table[i].ref = 0;
 		list_add_tail(&frame_table[i].chain, &frame_pool);
+		frame_pool_size++;
 	}
 	first_free = v_start/FRAME_SIZE + ft_needed;
 	return 0;
@@ -902,6 +1077,11 @@ SYSINIT(mem, SUB_MEMORY)
 		mb_info->mmap_addr = phys_to_kernel(mb_info->mmap_addr);
 		heap = MAX(heap, mb_info->mmap_addr + mb_info->mmap_length);
 	}
+	if (MULTIBOOT_CMDLINE_VALID(mb_info)) {
+		mb_info->cmdline = phys_to_kernel(mb_info->cmdline);
+		heap = MAX(heap, mb_info->cmdline
+				+ strlen((char*)mb_info->cmdline) + 1);
+	}
 	// align to 4MB and convert to physical address
 	heap = kernel_to_phys((page_align(heap) + 0x00500000) & 0xFFC00000);
 
@@ -927,6 +1107,14 @@ SYSINIT(mem, SUB_MEMORY)
 	for (int i = 0; i < 16; i++)
 		kernel_pgdir[i] = 0;
 
+	// allocate every kernel page table up front; make_new_pgdir() copies
+	// these PDEs into each page directory, so they never need updating
+	for (unsigned pdi = kernel_pdi; pdi < addr_to_pdi(TMP_PGTAB_BASE); pdi++) {
+		if (kernel_pgdir[pdi] & PE_P)
+			continue;
+		kernel_pgdir[pdi] = kalloc_frame(VM_ZERO)->addr | PE_P | PE_RW;
+	}
+
 	// only the first 4MB are direct-mapped at boot.  This is enough for
 	// the kernel, but multiboot modules may exceed this limit.
 	if (!MULTIBOOT_MODS_VALID(mb_info))
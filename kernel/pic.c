@@ -93,6 +93,58 @@ void enable_irq(unsigned char irq, bool disable)
 	outb(port, val);
 }
 
+/*
+ * Handlers for IRQs which are not wired to a dedicated entry point (i.e.
+ * everything but the timer and keyboard).  Handlers run with interrupts
+ * disabled; the EOI is sent after the handler returns.
+ */
+static struct {
+	void (*handler)(unsigned int, void*);
+	void *data;
+} irq_handlers[NR_IRQS];
+
+/*-----------------------------------------------------------------------------
+ * Registers a handler for an IRQ line and unmasks it */
+//-----------------------------------------------------------------------------
+int request_irq(unsigned int irq, void (*handler)(unsigned int, void*),
+		void *data)
+{
+	if (irq >= NR_IRQS || irq == IRQ_CASCADE)
+		return -EINVAL;
+	if (irq_handlers[irq].handler)
+		return -EBUSY;
+
+	irq_handlers[irq].handler = handler;
+	irq_handlers[irq].data = data;
+
+	enable_irq(irq, 0);
+	if (irq >= 8)
+		enable_irq(IRQ_CASCADE, 0);
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * Masks an IRQ line and unregisters its handler */
+//-----------------------------------------------------------------------------
+void free_irq(unsigned int irq)
+{
+	if (irq >= NR_IRQS)
+		return;
+	enable_irq(irq, 1);
+	irq_handlers[irq].handler = NULL;
+	irq_handlers[irq].data = NULL;
+}
+
+/*-----------------------------------------------------------------------------
+ * Dispatches an IRQ to its registered handler (called from entry.S) */
+//-----------------------------------------------------------------------------
+void do_irq(unsigned int irq)
+{
+	if (irq_handlers[irq].handler)
+		irq_handlers[irq].handler(irq, irq_handlers[irq].data);
+	pic_eoi();
+}
+
 /*-----------------------------------------------------------------------------
  * Initializes the programmable interval timer */
 //-----------------------------------------------------------------------------
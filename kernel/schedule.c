@@ -55,8 +55,8 @@ void ready(struct pcb *p)
 
 void reap(struct pcb *p)
 {
-	p->state = PROC_DEAD;
 	list_del(&p->chain);
+	free_pcb(p);
 }
 
 void wake(struct pcb *p, long rc)
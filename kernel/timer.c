@@ -22,42 +22,88 @@
 #include <kernel/mm/slab.h>
 
 /*
- * Kernel timers are implemented as a delta list of callbacks.
+ * Kernel timers are kept in a hierarchical timing wheel.  The first level has
+ * a slot for each of the next TVR_SIZE ticks; each subsequent level covers
+ * TVN_SIZE times the range of the level below it.  Timers in the outer levels
+ * are cascaded down into the lower levels as the wheel turns, so that arming
+ * and cancelling a timer are both constant-time operations.
  */
 
-static LIST_HEAD(timers);
+#define TVN_BITS 6
+#define TVR_BITS 8
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_LEVELS 4
+
+/* index into the n'th outer level for the time t */
+#define TVN_INDEX(t, n) (((t) >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+static struct list_head tv_root[TVR_SIZE];
+static struct list_head tv_outer[TVN_LEVELS][TVN_SIZE];
+
+/* the tick up to which the wheel has been processed */
+static unsigned long wheel_clock;
 
 static DEFINE_SLAB_CACHE(ktimers_cachep, sizeof(struct timer));
 #define get_timer() slab_alloc(ktimers_cachep)
 #define free_timer(p) slab_free(ktimers_cachep, p)
 
-int ktimer_start(struct timer *timer, unsigned long ticks)
+SYSINIT(timers, SUB_MEMORY)
 {
-	struct timer *t;
+	for (int i = 0; i < TVR_SIZE; i++)
+		INIT_LIST_HEAD(&tv_root[i]);
+	for (int i = 0; i < TVN_LEVELS; i++)
+		for (int j = 0; j < TVN_SIZE; j++)
+			INIT_LIST_HEAD(&tv_outer[i][j]);
+	wheel_clock = tick_count;
+}
 
-	timer->expires = tick_count + ticks;
-	timer->flags |= TF_ARMED;
+/*
+ * Returns the wheel slot in which a timer expiring at @expires belongs.
+ */
+static struct list_head *timer_slot(unsigned long expires)
+{
+	unsigned long idx = expires - wheel_clock;
+
+	/* already expired: run on the next tick */
+	if ((long) idx < 0)
+		return &tv_root[wheel_clock & TVR_MASK];
+	if (idx < TVR_SIZE)
+		return &tv_root[expires & TVR_MASK];
+	for (int i = 0; i < TVN_LEVELS - 1; i++) {
+		if (idx < 1UL << (TVR_BITS + (i + 1) * TVN_BITS))
+			return &tv_outer[i][TVN_INDEX(expires, i)];
+	}
+	return &tv_outer[TVN_LEVELS-1][TVN_INDEX(expires, TVN_LEVELS-1)];
+}
 
-	/* overflow */
-	if (timer->expires < tick_count) {
-		list_for_each_entry_reverse(t, &timers, chain) {
-			/* too far */
-			if (t->expires > tick_count) {
-				t = list_entry(t->chain.next, struct timer, chain);
-				break;
-			}
-			if (t->expires > timer->expires)
-				break;
-		}
-	} else {
-		list_for_each_entry(t, &timers, chain) {
-			if (t->expires > timer->expires)
-				break;
-		}
+/*
+ * Moves every timer in the given slot of an outer level down into the level(s)
+ * below it.  Returns the slot index, so that the caller knows whether the next
+ * level up needs cascading as well.
+ */
+static int cascade(int level, int index)
+{
+	struct timer *t, *n;
+	struct list_head head;
+
+	list_replace_init(&tv_outer[level][index], &head);
+	list_for_each_entry_safe(t, n, &head, chain) {
+		list_add_tail(&t->chain, timer_slot(t->expires));
 	}
+	return index;
+}
 
-	list_add_tail(&timer->chain, &t->chain);
+int ktimer_start(struct timer *timer, unsigned long ticks)
+{
+	if (timer->flags & TF_ARMED)
+		list_del(&timer->chain);
 
+	timer->expires = tick_count + ticks;
+	timer->flags |= TF_ARMED;
+	list_add_tail(&timer->chain, timer_slot(timer->expires));
 	return 0;
 }
 
@@ -73,18 +119,29 @@ struct timer *ktimer_create(void(*act)(void*), void *data, unsigned int flags)
 	return timer;
 }
 
+static unsigned long ticks_remaining(struct timer *t)
+{
+	if ((long) (t->expires - tick_count) <= 0)
+		return 0;
+	return t->expires - tick_count;
+}
+
 unsigned long ktimer_destroy(struct timer *t)
 {
-	unsigned long expires = t->expires;
+	unsigned long remaining = 0;
 
-	if (t->flags & TF_ARMED && t->flags & TF_ALWAYS && expires > tick_count)
-		t->action(t->data);
+	if (t->flags & TF_ARMED) {
+		remaining = ticks_remaining(t);
+		list_del(&t->chain);
+		t->flags &= ~TF_ARMED;
+		if (t->flags & TF_ALWAYS && remaining)
+			t->action(t->data);
+	}
 
-	list_del(&t->chain);
 	if (!(t->flags & TF_STATIC))
-		free_timer(&t);
+		free_timer(t);
 
-	return (expires <= tick_count) ? 0 : expires - tick_count;
+	return remaining;
 }
 
 /*
@@ -93,26 +150,41 @@ unsigned long ktimer_destroy(struct timer *t)
  */
 unsigned long ktimer_remove(struct timer *timer)
 {
+	if (!(timer->flags & TF_ARMED))
+		return 0;
 	list_del(&timer->chain);
-	return timer->expires - tick_count;
+	timer->flags &= ~TF_ARMED;
+	return ticks_remaining(timer);
 }
 
 /*
- * Called whenever the hardware timer goes off.  Updates software timers.
+ * Called whenever the hardware timer goes off.  Turns the wheel up to the
+ * current tick, running any timers which have expired.
  */
 void ktimers_tick(void)
 {
-	struct timer *t, *n;
-
-	if (list_empty(&timers))
-		return;
+	struct timer *t;
+	struct list_head work;
 
-	list_for_each_entry_safe(t, n, &timers, chain) {
-		if (t->expires > tick_count)
-			break;
+	while ((long) (tick_count - wheel_clock) >= 0) {
+		int index = wheel_clock & TVR_MASK;
 
-		t->flags &= ~TF_ARMED;
-		t->action(t->data);
-		ktimer_destroy(t);
+		/* refill the first level from the outer levels */
+		if (!index) {
+			for (int i = 0; i < TVN_LEVELS; i++)
+				if (cascade(i, TVN_INDEX(wheel_clock, i)))
+					break;
+		}
+		wheel_clock++;
+
+		list_replace_init(&tv_root[index], &work);
+		while (!list_empty(&work)) {
+			t = list_first_entry(&work, struct timer, chain);
+			list_del(&t->chain);
+			t->flags &= ~TF_ARMED;
+			t->action(t->data);
+			if (!(t->flags & (TF_STATIC | TF_ARMED)))
+				free_timer(t);
+		}
 	}
 }
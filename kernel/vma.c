@@ -17,6 +17,7 @@
 
 #include <kernel/list.h>
 #include <kernel/mmap.h>
+#include <kernel/process.h>
 #include <kernel/mm/paging.h>
 #include <kernel/mm/slab.h>
 #include <kernel/mm/vma.h>
@@ -316,6 +317,23 @@ int vm_map_page(struct vma *vma, void *addr)
 	return vma->op->map(vma, addr);
 }
 
+/*
+ * Map a page of kernel memory at @uaddr in an anonymous area of the current
+ * process, in place of its own page, copy-on-write.  Returns -EINVAL if the
+ * area can't share pages (the caller should copy instead).
+ */
+int vm_share_page(void *uaddr, void *kaddr)
+{
+	struct vma *vma = vma_get(&current->mm, uaddr);
+
+	if (!vma || vma->op || !(vma->flags & VM_WRITE)
+			|| (vma->flags & (VM_SHARE | VM_KEEP)))
+		return -EINVAL;
+	if (!page_aligned(uaddr) || !page_aligned(kaddr))
+		return -EINVAL;
+	return kshare_page(kaddr, uaddr, vma->flags);
+}
+
 int vm_writeback(struct vma *vma, void *addr, size_t len)
 {
 	// default: no writeback